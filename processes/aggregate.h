@@ -0,0 +1,245 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include "common.h"
+
+// --- Windowed aggregation ---
+// With -a P5 logs per-producer window summaries instead of every value.
+// Time is cut into panes of slide seconds (aligned to the wall clock); a
+// window is the last window/slide panes, so slide == window gives
+// tumbling windows and a shorter slide sliding ones. Every message updates
+// only its source's current pane: count, sum, min, max, a Welford running
+// mean and M2, and a log-linear histogram bucket, all O(1). When a pane
+// closes, each source's panes are merged (Chan et al. for the variance)
+// and the summary is handed to the caller. Quantiles come from the
+// histogram: 8 buckets per power of two, so they are within ~6% of the
+// true value, clamped to the exact min and max.
+#define AGG_MAX_PANES 60
+#define AGG_EXP_MIN -32 // Magnitudes below 2^-32 count as zero
+#define AGG_EXP_RANGE 64
+#define AGG_SUB_BITS 3
+#define AGG_HALF (AGG_EXP_RANGE << AGG_SUB_BITS) // Buckets per sign
+#define AGG_BUCKETS (2 * AGG_HALF + 1)           // Negative, zero, positive
+
+typedef struct {
+  int64_t id; // Pane number (seconds / slide), -1 = unused
+  uint64_t count;
+  double sum, min, max;
+  double mean, m2; // Welford
+  uint32_t buckets[AGG_BUCKETS];
+} agg_pane;
+
+typedef struct {
+  uint64_t key;    // channel << 32 | pid; 0 = empty
+  agg_pane *panes; // panes_per_window of them, indexed by id % panes
+} agg_source;
+
+typedef struct {
+  int window_s, slide_s, panes;
+  agg_source *sources; // Open addressing, as the sequence tracker
+  size_t cap, used;
+  int64_t closed; // Last pane whose window was summarised
+} aggregator;
+
+typedef struct {
+  uint64_t count;
+  double sum, min, max, mean, variance; // Population variance
+  double p50, p90, p99;
+} agg_summary;
+
+// Parses "<window_s>[:<slide_s>]". Returns 0 if the slide does not divide
+// the window or the window needs more than AGG_MAX_PANES panes.
+int aggregator_init(aggregator *a, const char *spec) {
+  memset(a, 0, sizeof(*a));
+  if (sscanf(spec, "%d:%d", &a->window_s, &a->slide_s) == 1)
+    a->slide_s = a->window_s;
+  if (a->window_s < 1 || a->slide_s < 1 || a->window_s % a->slide_s != 0)
+    return 0;
+  a->panes = a->window_s / a->slide_s;
+  a->closed = -1;
+  return a->panes <= AGG_MAX_PANES;
+}
+
+void aggregator_free(aggregator *a) {
+  for (size_t i = 0; i < a->cap; i++)
+    free(a->sources[i].panes);
+  free(a->sources);
+  a->sources = NULL;
+  a->cap = a->used = 0;
+}
+
+int agg_bucket(double v) {
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  int exp = (int)((bits >> 52) & 0x7FF) - 1023;
+  if (v == 0 || exp < AGG_EXP_MIN || v != v)
+    return AGG_HALF;
+  if (exp >= AGG_EXP_MIN + AGG_EXP_RANGE)
+    exp = AGG_EXP_MIN + AGG_EXP_RANGE - 1; // Also infinities
+  int k = ((exp - AGG_EXP_MIN) << AGG_SUB_BITS) |
+          (int)((bits >> (52 - AGG_SUB_BITS)) & ((1 << AGG_SUB_BITS) - 1));
+  return v > 0 ? AGG_HALF + 1 + k : AGG_HALF - 1 - k;
+}
+
+// Midpoint of the values that map to a bucket.
+double agg_bucket_value(int idx) {
+  if (idx == AGG_HALF)
+    return 0;
+  int k = idx > AGG_HALF ? idx - AGG_HALF - 1 : AGG_HALF - 1 - idx;
+  uint64_t exp = (k >> AGG_SUB_BITS) + AGG_EXP_MIN + 1023;
+  uint64_t sub = k & ((1 << AGG_SUB_BITS) - 1);
+  uint64_t bits = exp << 52 | sub << (52 - AGG_SUB_BITS) |
+                  1ULL << (51 - AGG_SUB_BITS);
+  double v;
+  memcpy(&v, &bits, sizeof(v));
+  return idx > AGG_HALF ? v : -v;
+}
+
+agg_source *agg_slot(agg_source *sources, size_t cap, uint64_t key) {
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 40;
+  for (;; i++) {
+    agg_source *s = &sources[i & (cap - 1)];
+    if (s->key == key || s->key == 0)
+      return s;
+  }
+}
+
+agg_source *agg_find(aggregator *a, int channel, int pid) {
+  if (a->used * 2 >= a->cap) {
+    size_t cap = a->cap ? a->cap * 2 : 64;
+    agg_source *grown = calloc(cap, sizeof(agg_source));
+    if (!grown)
+      return NULL;
+    for (size_t i = 0; i < a->cap; i++)
+      if (a->sources[i].key)
+        *agg_slot(grown, cap, a->sources[i].key) = a->sources[i];
+    free(a->sources);
+    a->sources = grown;
+    a->cap = cap;
+  }
+  uint64_t key = (uint64_t)channel << 32 | (uint32_t)pid;
+  agg_source *s = agg_slot(a->sources, a->cap, key);
+  if (s->key == 0) {
+    s->panes = malloc(a->panes * sizeof(agg_pane));
+    if (!s->panes)
+      return NULL;
+    for (int i = 0; i < a->panes; i++)
+      s->panes[i].id = -1;
+    s->key = key;
+    a->used++;
+  }
+  return s;
+}
+
+// Pane the given wall-clock second falls in.
+int64_t agg_pane_id(const aggregator *a, long seconds) {
+  return seconds / a->slide_s;
+}
+
+void agg_pane_reset(agg_pane *p, int64_t id) {
+  memset(p, 0, sizeof(*p));
+  p->id = id;
+}
+
+// Adds one value from (channel, pid) received at the given second.
+void aggregator_add(aggregator *a, int channel, int pid, long seconds,
+                    double v) {
+  agg_source *s = agg_find(a, channel, pid);
+  if (!s)
+    return;
+  int64_t id = agg_pane_id(a, seconds);
+  agg_pane *p = &s->panes[id % a->panes];
+  if (p->id != id)
+    agg_pane_reset(p, id);
+  if (p->count == 0 || v < p->min)
+    p->min = v;
+  if (p->count == 0 || v > p->max)
+    p->max = v;
+  p->count++;
+  p->sum += v;
+  double delta = v - p->mean;
+  p->mean += delta / p->count;
+  p->m2 += delta * (v - p->mean);
+  p->buckets[agg_bucket(v)]++;
+}
+
+// Value at the given percentile (0..100) of the merged histogram.
+double agg_quantile(const uint32_t *buckets, uint64_t count, double pct,
+                    double min, double max) {
+  uint64_t rank = (uint64_t)(pct / 100.0 * count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < AGG_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      double v = agg_bucket_value(i);
+      return v < min ? min : v > max ? max : v;
+    }
+  }
+  return max;
+}
+
+// Merges a source's panes in (last - panes, last] into one summary.
+// Returns 0 if the window saw no messages.
+int agg_summarise(const aggregator *a, const agg_source *s, int64_t last,
+                  agg_summary *out) {
+  static uint32_t buckets[AGG_BUCKETS];
+  memset(out, 0, sizeof(*out));
+  double m2 = 0;
+  for (int i = 0; i < a->panes; i++) {
+    const agg_pane *p = &s->panes[i];
+    if (p->id < 0 || p->id > last || p->id <= last - a->panes ||
+        p->count == 0)
+      continue;
+    if (out->count == 0) {
+      memset(buckets, 0, sizeof(buckets));
+      out->min = p->min;
+      out->max = p->max;
+    }
+    uint64_t n = out->count + p->count;
+    double delta = p->mean - out->mean;
+    m2 += p->m2 + delta * delta * out->count * p->count / n;
+    out->mean += delta * p->count / n;
+    out->count = n;
+    out->sum += p->sum;
+    if (p->min < out->min)
+      out->min = p->min;
+    if (p->max > out->max)
+      out->max = p->max;
+    for (int b = 0; b < AGG_BUCKETS; b++)
+      buckets[b] += p->buckets[b];
+  }
+  if (out->count == 0)
+    return 0;
+  out->variance = m2 / out->count;
+  out->p50 = agg_quantile(buckets, out->count, 50, out->min, out->max);
+  out->p90 = agg_quantile(buckets, out->count, 90, out->min, out->max);
+  out->p99 = agg_quantile(buckets, out->count, 99, out->min, out->max);
+  return 1;
+}
+
+// Summarises every window that closed before the given second and hands
+// each non-empty summary to emit(); with final set, the window still open
+// as well. Must run before a value of a new pane is added, as that pane
+// reuses the slot of the oldest one.
+void aggregator_close(aggregator *a, long seconds, int final,
+                      void (*emit)(int channel, int pid,
+                                   const agg_summary *)) {
+  int64_t last = agg_pane_id(a, seconds) - (final ? 0 : 1);
+  if (last <= a->closed)
+    return;
+  if (a->closed < 0)
+    a->closed = last - 1; // Nothing was added before the first call
+  for (int64_t id = a->closed + 1; id <= last; id++) {
+    for (size_t i = 0; i < a->cap; i++) {
+      agg_summary sum;
+      const agg_source *s = &a->sources[i];
+      if (s->key && agg_summarise(a, s, id, &sum))
+        emit((int)(s->key >> 32), (int)(uint32_t)s->key, &sum);
+    }
+  }
+  a->closed = last;
+}
+
+#endif // AGGREGATE_H
@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "../bcd/bcd.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define BCD_MAX_CLIENTS 256
+#define BCD_WORKERS 4
+#define BCD_MAX_PENDING_REPLY (4 << 20) // Then the client is not read
+#define BCD_MAX_FRAME                                                          \
+  (sizeof(bcd_req_header) + BCD_MAX_BATCH * sizeof(bcd_req_pair))
+
+volatile sig_atomic_t terminate_flag = 0;
+
+int listen_sock_fd = -1;
+
+// One per client. The event loop and every queued job hold a reference, so
+// the fd stays valid until the last reply for it has been queued. Replies
+// go out through a queue that the socket drains at its own pace: workers
+// send what fits right away and the event loop sends the rest on POLLOUT,
+// so a client that stops reading never blocks a worker.
+typedef struct {
+  int fd; // Non-blocking
+  unsigned char in_buf[2 * BCD_MAX_FRAME];
+  size_t in_len;
+  pthread_mutex_t lock; // Guards the reply queue, closed and refs
+  unsigned char *out;   // Replies not yet taken by the socket
+  size_t out_len, out_cap;
+  int closed; // Dropped by the event loop; further replies are discarded
+  int refs;
+} bcd_conn;
+
+// A job is every complete request read from one connection in one go.
+typedef struct bcd_job {
+  bcd_conn *conn;
+  unsigned char *data;
+  size_t len;
+  struct bcd_job *next;
+} bcd_job;
+
+bcd_job *job_head = NULL;
+bcd_job *job_tail = NULL;
+int workers_stop = 0;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+void handle_sigterm(int sig) {
+  terminate_flag = 1;
+  notify_signal_pipe();
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int send_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+int recv_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n == 0)
+      return 0;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+void conn_release(bcd_conn *conn) {
+  pthread_mutex_lock(&conn->lock);
+  int refs = --conn->refs;
+  pthread_mutex_unlock(&conn->lock);
+  if (refs == 0) {
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->out);
+    free(conn);
+  }
+}
+
+// Sends as much of the reply queue as the socket takes without blocking.
+// Call with conn->lock held. Returns 0 if the connection is broken.
+int conn_flush(bcd_conn *conn) {
+  size_t done = 0;
+  while (done < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + done, conn->out_len - done,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      conn->out_len = 0;
+      return 0;
+    }
+    done += n;
+  }
+  memmove(conn->out, conn->out + done, conn->out_len - done);
+  conn->out_len -= done;
+  return 1;
+}
+
+// Appends a reply to the queue and sends what fits. Call with conn->lock
+// held. Returns 0 if the reply could not be queued.
+int conn_reply(bcd_conn *conn, const unsigned char *data, size_t len) {
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap ? conn->out_cap : 64 * 1024;
+    while (cap < conn->out_len + len)
+      cap *= 2;
+    unsigned char *grown = realloc(conn->out, cap);
+    if (!grown)
+      return 0;
+    conn->out = grown;
+    conn->out_cap = cap;
+  }
+  memcpy(conn->out + conn->out_len, data, len);
+  conn->out_len += len;
+  return conn_flush(conn);
+}
+
+// --- Workers ---
+
+// Checks an operand before it reaches the library, whose validators print
+// to stdout: every nibble a decimal digit (the first may be the sign) and
+// at most max_digits digits.
+int operand_ok(unsigned char *bcd, int max_digits) {
+  for (int i = 0; i < MAX_BCD_BYTES; i++) {
+    int high = bcd[i] >> 4, low = bcd[i] & 0x0F;
+    if (low > 9 || (high > 9 && !(i == 0 && high == NEGATIVE_PREFIX)))
+      return 0;
+  }
+  return count_digits(bcd) <= max_digits;
+}
+
+// Writes packed digits and a sign as a MAX_BCD_WIDE_BYTES result.
+void store_wide(uint64_t digits, int negative, unsigned char *dst) {
+  for (int i = MAX_BCD_WIDE_BYTES - 1; i >= 0; i--) {
+    dst[i] = digits & 0xFF;
+    digits >>= 8;
+  }
+  if (negative)
+    set_negative(dst);
+}
+
+// a + b, or a - b, on packed digits. bcd_add() and bcd_subtract() are not
+// used: with mixed signs they go through a ten's complement that fails
+// their own validation.
+void eval_add(unsigned char *a, unsigned char *b, int subtract,
+              unsigned char *result) {
+  uint64_t ma = bcd_load_packed(a), mb = bcd_load_packed(b);
+  int a_neg = is_negative(a), b_neg = is_negative(b) ^ subtract;
+  uint64_t digits;
+  int negative;
+  if (a_neg == b_neg) {
+    digits = (uint64_t)bcd_add_packed(ma, mb);
+    negative = a_neg;
+  } else {
+    // The larger magnitude minus the smaller, as the larger plus the
+    // nines' complement of the smaller plus one, without the carry out
+    uint64_t big = ma >= mb ? ma : mb, small = ma >= mb ? mb : ma;
+    digits = (uint64_t)bcd_add_packed(big, 0x9999999999999999ULL - small);
+    digits = (uint64_t)bcd_add_packed(digits, 1);
+    negative = ma >= mb ? a_neg : b_neg;
+  }
+  store_wide(digits, negative && digits != 0, result);
+}
+
+void eval_pair(int op, bcd_req_pair *pair, bcd_resp_item *item) {
+  memset(item, 0, sizeof(*item));
+
+  switch (op) {
+  case BCD_OP_ADD:
+  case BCD_OP_SUB:
+    if (!operand_ok(pair->a, MAX_ADD_SUBTRACT_DIGITS) ||
+        !operand_ok(pair->b, MAX_ADD_SUBTRACT_DIGITS))
+      return;
+    eval_add(pair->a, pair->b, op == BCD_OP_SUB, item->value);
+    item->ok = 1;
+    break;
+  case BCD_OP_MUL:
+    if (!operand_ok(pair->a, MAX_WIDE_MULTIPLY_DIGITS) ||
+        !operand_ok(pair->b, MAX_WIDE_MULTIPLY_DIGITS))
+      return;
+    item->ok = bcd_multiply_wide(pair->a, pair->b, item->value);
+    break;
+  case BCD_OP_CMP:
+    if (!operand_ok(pair->a, 2 * MAX_BCD_BYTES - 1) ||
+        !operand_ok(pair->b, 2 * MAX_BCD_BYTES - 1))
+      return;
+    item->cmp = bcd_compare(pair->a, pair->b);
+    item->ok = 1;
+    break;
+  }
+}
+
+// Evaluates every request in data and writes the replies to out, which must
+// hold at least len + len / 10 + sizeof(bcd_resp_header) bytes.
+size_t eval_batch(unsigned char *data, size_t len, unsigned char *out) {
+  size_t in_off = 0, out_off = 0;
+
+  while (in_off < len) {
+    bcd_req_header req;
+    bcd_resp_header resp;
+    memcpy(&req, data + in_off, sizeof(req));
+    in_off += sizeof(req);
+
+    resp.request_id = req.request_id;
+    resp.count = req.count;
+    resp.status = (req.op < BCD_OP_ADD || req.op > BCD_OP_CMP);
+    memcpy(out + out_off, &resp, sizeof(resp));
+    out_off += sizeof(resp);
+
+    for (int i = 0; i < req.count; i++) {
+      bcd_req_pair pair;
+      bcd_resp_item item;
+      memcpy(&pair, data + in_off, sizeof(pair));
+      in_off += sizeof(pair);
+      eval_pair(req.op, &pair, &item);
+      memcpy(out + out_off, &item, sizeof(item));
+      out_off += sizeof(item);
+    }
+  }
+  return out_off;
+}
+
+void *worker_main(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&job_lock);
+    while (job_head == NULL && !workers_stop)
+      pthread_cond_wait(&job_cond, &job_lock);
+    if (job_head == NULL) {
+      pthread_mutex_unlock(&job_lock);
+      break;
+    }
+    bcd_job *job = job_head;
+    job_head = job->next;
+    if (job_head == NULL)
+      job_tail = NULL;
+    pthread_mutex_unlock(&job_lock);
+
+    unsigned char *out =
+        malloc(job->len + job->len / 10 + sizeof(bcd_resp_header));
+    size_t out_len = eval_batch(job->data, job->len, out);
+
+    // What the socket does not take now, the event loop sends on POLLOUT
+    bcd_conn *conn = job->conn;
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closed && (!conn_reply(conn, out, out_len) || conn->out_len))
+      notify_signal_pipe();
+    pthread_mutex_unlock(&conn->lock);
+
+    conn_release(job->conn);
+    free(out);
+    free(job->data);
+    free(job);
+  }
+  return NULL;
+}
+
+void queue_job(bcd_conn *conn, unsigned char *data, size_t len) {
+  bcd_job *job = malloc(sizeof(*job));
+  job->conn = conn;
+  job->data = malloc(len);
+  memcpy(job->data, data, len);
+  job->len = len;
+  job->next = NULL;
+
+  pthread_mutex_lock(&conn->lock);
+  conn->refs++;
+  pthread_mutex_unlock(&conn->lock);
+
+  pthread_mutex_lock(&job_lock);
+  if (job_tail)
+    job_tail->next = job;
+  else
+    job_head = job;
+  job_tail = job;
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+}
+
+// --- Server ---
+
+int openBcdSocket() {
+  struct sockaddr_un local_addr;
+  listen_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_sock_fd < 0) {
+    perror("  ERROR: Failed to create listening socket");
+    return 0;
+  }
+  unlink(BCD_SOCKET_PATH);
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.sun_family = AF_UNIX;
+  strncpy(local_addr.sun_path, BCD_SOCKET_PATH,
+          sizeof(local_addr.sun_path) - 1);
+  if (bind(listen_sock_fd, (struct sockaddr *)&local_addr,
+           sizeof(local_addr)) < 0) {
+    perror("  ERROR: Failed to bind socket");
+    close(listen_sock_fd);
+    listen_sock_fd = -1;
+    return 0;
+  }
+  if (listen(listen_sock_fd, SOMAXCONN) < 0) {
+    perror("  ERROR: Failed to listen on socket");
+    close(listen_sock_fd);
+    listen_sock_fd = -1;
+    return 0;
+  }
+  fcntl(listen_sock_fd, F_SETFL, O_NONBLOCK);
+  return 1;
+}
+
+// Reads what is available and queues every complete request as one job.
+// Returns 0 when the connection should be dropped.
+int handle_client_input(bcd_conn *conn) {
+  ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len,
+                   sizeof(conn->in_buf) - conn->in_len, 0);
+  if (n == 0)
+    return 0;
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN;
+  conn->in_len += n;
+
+  size_t off = 0;
+  while (conn->in_len - off >= sizeof(bcd_req_header)) {
+    bcd_req_header req;
+    memcpy(&req, conn->in_buf + off, sizeof(req));
+    if (req.count > BCD_MAX_BATCH) {
+      fprintf(stderr, "[BCD Daemon] Oversized request on FD %d.\n", conn->fd);
+      return 0;
+    }
+    size_t frame = sizeof(req) + req.count * sizeof(bcd_req_pair);
+    if (conn->in_len - off < frame)
+      break;
+    off += frame;
+  }
+
+  if (off > 0) {
+    queue_job(conn, conn->in_buf, off);
+    memmove(conn->in_buf, conn->in_buf + off, conn->in_len - off);
+    conn->in_len -= off;
+  }
+  return 1;
+}
+
+int run_server() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigterm;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!openBcdSocket())
+    return EXIT_FAILURE;
+  // Wakes the event loop for signals and for replies left queued
+  if (!setup_signal_pipe()) {
+    perror("BCD Daemon: Failed to create wakeup pipe");
+    return EXIT_FAILURE;
+  }
+
+  pthread_t workers[BCD_WORKERS];
+  for (int i = 0; i < BCD_WORKERS; i++)
+    pthread_create(&workers[i], NULL, worker_main, NULL);
+
+  printf("[BCD Daemon] Listening on %s with %d workers.\n", BCD_SOCKET_PATH,
+         BCD_WORKERS);
+  fflush(stdout);
+
+  // fds[0] is the listener, fds[1] the wakeup pipe, fds[i] belongs to
+  // conns[i] after that
+  struct pollfd fds[BCD_MAX_CLIENTS + 2];
+  bcd_conn *conns[BCD_MAX_CLIENTS + 2];
+  int nfds = 2;
+  fds[0].fd = listen_sock_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = signal_pipe[0];
+  fds[1].events = POLLIN;
+
+  while (!terminate_flag) {
+    // Read a client only while its replies are not too far behind, and
+    // watch for room in the socket while some are queued
+    for (int i = 2; i < nfds; i++) {
+      pthread_mutex_lock(&conns[i]->lock);
+      size_t queued = conns[i]->out_len;
+      pthread_mutex_unlock(&conns[i]->lock);
+      fds[i].events = (queued < BCD_MAX_PENDING_REPLY ? POLLIN : 0) |
+                      (queued > 0 ? POLLOUT : 0);
+    }
+
+    int poll_ret = poll(fds, nfds, 500);
+    if (poll_ret < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("BCD Daemon: poll() failed");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(signal_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept(listen_sock_fd, NULL, NULL)) >= 0) {
+        if (nfds >= BCD_MAX_CLIENTS + 2) {
+          close(fd); // Reject extra connections
+          continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        bcd_conn *conn = calloc(1, sizeof(*conn));
+        conn->fd = fd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        conns[nfds] = conn;
+        nfds++;
+      }
+    }
+
+    for (int i = nfds - 1; i >= 2; i--) {
+      short revents = fds[i].revents;
+      if (revents == 0)
+        continue;
+      bcd_conn *conn = conns[i];
+      int keep = !(revents & (POLLERR | POLLNVAL));
+      if (keep && (revents & POLLOUT)) {
+        pthread_mutex_lock(&conn->lock);
+        keep = conn_flush(conn);
+        pthread_mutex_unlock(&conn->lock);
+      }
+      if (keep && (revents & POLLIN))
+        keep = handle_client_input(conn);
+      else if (keep && (revents & POLLHUP))
+        keep = 0;
+      if (!keep) {
+        pthread_mutex_lock(&conn->lock);
+        conn->closed = 1;
+        pthread_mutex_unlock(&conn->lock);
+        conn_release(conn);
+        nfds--;
+        fds[i] = fds[nfds];
+        conns[i] = conns[nfds];
+      }
+    }
+  }
+
+  printf("[BCD Daemon] Shutting down...\n");
+  fflush(stdout);
+
+  pthread_mutex_lock(&job_lock);
+  workers_stop = 1;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+  for (int i = 0; i < BCD_WORKERS; i++)
+    pthread_join(workers[i], NULL);
+
+  for (int i = 2; i < nfds; i++)
+    conn_release(conns[i]);
+  close(listen_sock_fd);
+  unlink(BCD_SOCKET_PATH);
+  return EXIT_SUCCESS;
+}
+
+// --- Built-in client benchmark ---
+
+typedef struct {
+  int requests;
+  int ops;   // Operand pairs per request
+  int depth; // Requests in flight
+  uint64_t *latencies_ns;
+  int failed;
+  long long results, errors; // Items received, and those not ok
+} bench_client;
+
+void *bench_client_main(void *arg) {
+  bench_client *bc = arg;
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, BCD_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("BCD Bench: Failed to connect");
+    bc->failed = 1;
+    return NULL;
+  }
+
+  size_t req_len = sizeof(bcd_req_header) + bc->ops * sizeof(bcd_req_pair);
+  unsigned char *req = malloc(req_len);
+  bcd_req_pair *pairs = (bcd_req_pair *)(req + sizeof(bcd_req_header));
+  unsigned int seed = (unsigned int)(uintptr_t)bc;
+  for (int i = 0; i < bc->ops; i++) {
+    int_to_bcd(rand_r(&seed) % 100000000, pairs[i].a);
+    int_to_bcd(rand_r(&seed) % 100000000, pairs[i].b);
+  }
+  bcd_resp_item *items = malloc(bc->ops * sizeof(bcd_resp_item));
+  uint64_t *sent_at = malloc(bc->requests * sizeof(uint64_t));
+
+  int sent = 0, received = 0;
+  while (received < bc->requests) {
+    while (sent < bc->requests && sent - received < bc->depth) {
+      bcd_req_header hdr = {sent, BCD_OP_ADD + sent % 4, bc->ops};
+      memcpy(req, &hdr, sizeof(hdr));
+      sent_at[sent] = now_ns();
+      if (!send_all(fd, req, req_len)) {
+        bc->failed = 1;
+        goto out;
+      }
+      sent++;
+    }
+
+    bcd_resp_header resp;
+    if (!recv_all(fd, &resp, sizeof(resp)) ||
+        !recv_all(fd, items, resp.count * sizeof(bcd_resp_item)) ||
+        resp.request_id >= (uint32_t)sent) {
+      bc->failed = 1;
+      goto out;
+    }
+    bc->latencies_ns[received++] = now_ns() - sent_at[resp.request_id];
+    for (int i = 0; i < resp.count; i++)
+      bc->errors += !items[i].ok;
+    bc->results += resp.count;
+  }
+
+out:
+  close(fd);
+  free(req);
+  free(items);
+  free(sent_at);
+  return NULL;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int run_bench(int clients, int requests, int ops, int depth) {
+  if (clients < 1 || requests < 1 || ops < 1 || ops > BCD_MAX_BATCH ||
+      depth < 1) {
+    fprintf(stderr, "Invalid benchmark parameters.\n");
+    return EXIT_FAILURE;
+  }
+
+  pthread_t *threads = malloc(clients * sizeof(pthread_t));
+  bench_client *bcs = calloc(clients, sizeof(bench_client));
+  uint64_t *latencies = malloc((size_t)clients * requests * sizeof(uint64_t));
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < clients; i++) {
+    bcs[i].requests = requests;
+    bcs[i].ops = ops;
+    bcs[i].depth = depth;
+    bcs[i].latencies_ns = latencies + (size_t)i * requests;
+    pthread_create(&threads[i], NULL, bench_client_main, &bcs[i]);
+  }
+  int failed = 0;
+  long long results = 0, errors = 0;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+    failed |= bcs[i].failed;
+    results += bcs[i].results;
+    errors += bcs[i].errors;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  if (failed) {
+    fprintf(stderr, "BCD Bench: One or more clients failed.\n");
+  } else {
+    size_t total = (size_t)clients * requests;
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+    printf("[BCD Bench] %d clients x %d requests x %d ops, depth %d\n",
+           clients, requests, ops, depth);
+    printf("[BCD Bench] %.0f requests/s, %.0f ops/s\n", total / elapsed,
+           total * (double)ops / elapsed);
+    printf("[BCD Bench] Latency p50: %.1f us, p99: %.1f us, max: %.1f us\n",
+           latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+           latencies[total - 1] / 1e3);
+    printf("[BCD Bench] %lld of %lld results failed\n", errors, results);
+  }
+
+  free(threads);
+  free(bcs);
+  free(latencies);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 6 && strcmp(argv[1], "--bench") == 0) {
+    return run_bench(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
+                     atoi(argv[5]));
+  }
+  if (argc != 1) {
+    fprintf(stderr,
+            "Usage: %s\n"
+            "       %s --bench <clients> <requests> <ops_per_request> "
+            "<pipeline_depth>\n",
+            argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  return run_server();
+}
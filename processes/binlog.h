@@ -0,0 +1,115 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include "common.h"
+
+// --- Binary log format ---
+// The log is split into preallocated segment files "<log>.<index>.bin" of a
+// fixed size. Each starts with a binlog_segment_header followed by records;
+// the zero-filled, not yet used tail of a segment reads as channel 0, which
+// marks the end of the data.
+#define BINLOG_MAGIC 0x474C3550 // "P5LG"
+#define BINLOG_VERSION 1
+#define BINLOG_DEFAULT_SEGMENT_MB 64
+
+enum { BINLOG_INT = 1, BINLOG_DOUBLE, BINLOG_STRING };
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t segment_index;
+  uint64_t segment_size;
+  uint64_t reserved;
+} binlog_segment_header;
+
+typedef struct {
+  uint8_t channel; // 2, 3 or 4 (the producing process); 0 = end of data
+  uint8_t type;    // BINLOG_INT, BINLOG_DOUBLE or BINLOG_STRING
+  uint16_t len;    // Length of the string following the record
+  int32_t source_pid;
+  uint64_t timestamp_ns; // CLOCK_REALTIME
+  union {
+    int64_t i;
+    double d;
+  } value;
+} binlog_record;
+
+// Strings are padded so every record starts 8-byte aligned
+size_t binlog_record_size(const binlog_record *rec) {
+  size_t len = rec->type == BINLOG_STRING ? rec->len : 0;
+  return sizeof(binlog_record) + ((len + 7) & ~(size_t)7);
+}
+
+uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void binlog_segment_path(char *out, size_t out_size, const char *base,
+                         uint64_t index) {
+  snprintf(out, out_size, "%s.%06llu.bin", base, (unsigned long long)index);
+}
+
+// First index with no segment file yet, so a restarted P5 appends new
+// segments instead of overwriting old ones.
+uint64_t binlog_next_index(const char *base) {
+  char path[4096];
+  struct stat st;
+  uint64_t index = 0;
+  for (;;) {
+    binlog_segment_path(path, sizeof(path), base, index);
+    if (stat(path, &st) < 0)
+      return index;
+    index++;
+  }
+}
+
+// Creates, preallocates and stamps a segment. Returns the fd positioned
+// just after the header, or -1.
+int binlog_open_segment(const char *base, uint64_t index, uint64_t size) {
+  char path[4096];
+  binlog_segment_path(path, sizeof(path), base, index);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return -1;
+
+  // Reserve the blocks up front so appends never allocate; fall back to a
+  // sparse file where the filesystem cannot preallocate
+  if (posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  binlog_segment_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = BINLOG_MAGIC;
+  hdr.version = BINLOG_VERSION;
+  hdr.segment_index = index;
+  hdr.segment_size = size;
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Formats a record as the text log line P5 writes in text mode.
+int binlog_format_text(const binlog_record *rec, const char *str, char *out,
+                       size_t out_size) {
+  long seconds = (long)(rec->timestamp_ns / 1000000000ULL);
+  switch (rec->type) {
+  case BINLOG_INT:
+    return snprintf(out, out_size, "[%ld] P%d(%d): %d\n", seconds,
+                    rec->channel, rec->source_pid, (int)rec->value.i);
+  case BINLOG_DOUBLE:
+    return snprintf(out, out_size, "[%ld] P%d(%d): %f\n", seconds,
+                    rec->channel, rec->source_pid, rec->value.d);
+  case BINLOG_STRING:
+    return snprintf(out, out_size, "[%ld] P%d(%d): %.*s\n", seconds,
+                    rec->channel, rec->source_pid, rec->len, str);
+  }
+  return 0;
+}
+
+#endif // BINLOG_H
@@ -3,8 +3,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <mqueue.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +15,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // --- IPC Definitions ---
@@ -20,17 +24,35 @@
 #define SOCKET_PATH "./p5_socket"
 
 // --- FIFO Structures ---
+// Every message carries the producer's sequence number (1, 2, ...) and its
+// CLOCK_MONOTONIC send time, so P5 can spot gaps and measure latency.
 typedef struct {
   int source_pid;
   int value;
+  uint64_t seq;
+  int64_t send_ns;
 } fifo_msg_int;
 
+// P2 coalesces records into one atomic write of at most PIPE_BUF bytes,
+// flushed when full or FIFO_FLUSH_MS after the first buffered record.
+#define FIFO_BATCH_RECORDS (PIPE_BUF / sizeof(fifo_msg_int))
+#define FIFO_FLUSH_MS 2
+
 // --- Socket ---
+// P4 sends length-prefixed frames over the stream: a sock_frame_header
+// followed by exactly len bytes of string (no terminator). P5 reassembles
+// frames per connection, so a frame may arrive split across any number of
+// recv() calls and one recv() may carry many frames.
 #define SOCK_MSG_MAX_LEN 256
 typedef struct {
-  int source_pid;
-  char value[SOCK_MSG_MAX_LEN];
-} sock_msg_string;
+  uint16_t len; // Payload bytes, at most SOCK_MSG_MAX_LEN
+  uint16_t reserved;
+  int32_t source_pid;
+  uint64_t seq;
+  int64_t send_ns;
+} sock_frame_header;
+
+#define SOCK_FRAME_MAX (sizeof(sock_frame_header) + SOCK_MSG_MAX_LEN)
 
 #define MSG_MAX_SIZE 1024
 #define MSGQ_PERMS 0666
@@ -38,8 +60,103 @@ typedef struct {
   long mtype;
   int source_pid;
   double value;
+  uint64_t seq;
+  int64_t send_ns;
 } mq_msg_float;
 
+// P5 creates the queue MQ_DEFAULT_DEPTH deep unless told otherwise. Depth and
+// message size beyond /proc/sys/fs/mqueue/{msg_max,msgsize_max} need
+// CAP_SYS_RESOURCE; without it they are clamped to the system limits.
+#define MQ_DEFAULT_DEPTH 1024
+#define MQ_HARD_MAX_DEPTH 65536 // HARD_MSGMAX in the kernel
+#define MQ_PROC_DIR "/proc/sys/fs/mqueue/"
+
+long mq_proc_limit(const char *name, long fallback) {
+  char path[128];
+  snprintf(path, sizeof(path), "%s%s", MQ_PROC_DIR, name);
+  FILE *f = fopen(path, "r");
+  long value;
+  if (!f)
+    return fallback;
+  if (fscanf(f, "%ld", &value) != 1)
+    value = fallback;
+  fclose(f);
+  return value;
+}
+
+// Fills attr for a queue of the requested depth and message size (0 picks
+// the defaults). Returns 0 if the request can never be met.
+int mq_fill_attr(struct mq_attr *attr, long depth, long msg_size,
+                 const char *who) {
+  if (depth == 0)
+    depth = MQ_DEFAULT_DEPTH;
+  if (msg_size == 0)
+    msg_size = sizeof(mq_msg_float);
+  if (depth < 1 || depth > MQ_HARD_MAX_DEPTH) {
+    fprintf(stderr, "%s: Queue depth must be 1..%d\n", who, MQ_HARD_MAX_DEPTH);
+    return 0;
+  }
+  if (msg_size < (long)sizeof(mq_msg_float)) {
+    fprintf(stderr, "%s: Message size must be at least %zu bytes\n", who,
+            sizeof(mq_msg_float));
+    return 0;
+  }
+
+  int privileged = geteuid() == 0;
+  long msg_max = mq_proc_limit("msg_max", 10);
+  long msgsize_max = mq_proc_limit("msgsize_max", 8192);
+  if (!privileged && depth > msg_max) {
+    fprintf(stderr,
+            "%s: Queue depth %ld exceeds %smsg_max (%ld); using %ld\n", who,
+            depth, MQ_PROC_DIR, msg_max, msg_max);
+    depth = msg_max;
+  }
+  if (!privileged && msg_size > msgsize_max) {
+    fprintf(stderr, "%s: Message size %ld exceeds %smsgsize_max (%ld)\n", who,
+            msg_size, MQ_PROC_DIR, msgsize_max);
+    return 0;
+  }
+
+  memset(attr, 0, sizeof(*attr));
+  attr->mq_maxmsg = depth;
+  attr->mq_msgsize = msg_size;
+  return 1;
+}
+
+// --- BCD Service ---
+#define BCD_SOCKET_PATH "./bcd_socket"
+#define BCD_OPERAND_BYTES 5 // MAX_BCD_BYTES in bcd/bcd.h
+#define BCD_RESULT_BYTES 9  // MAX_BCD_WIDE_BYTES in bcd/bcd.h
+#define BCD_MAX_BATCH 1024  // Operand pairs per request
+
+enum { BCD_OP_ADD = 1, BCD_OP_SUB, BCD_OP_MUL, BCD_OP_CMP };
+
+// A request is a header followed by `count` operand pairs; the reply is a
+// header followed by `count` results. Many requests may be in flight on one
+// connection, replies are matched by request_id.
+typedef struct {
+  uint32_t request_id;
+  uint16_t op;
+  uint16_t count;
+} bcd_req_header;
+
+typedef struct {
+  unsigned char a[BCD_OPERAND_BYTES];
+  unsigned char b[BCD_OPERAND_BYTES];
+} bcd_req_pair;
+
+typedef struct {
+  uint32_t request_id;
+  uint16_t status; // 0 = OK, otherwise the request was malformed
+  uint16_t count;
+} bcd_resp_header;
+
+typedef struct {
+  unsigned char ok;       // 0 if the operands failed validation
+  signed char cmp;        // Result of BCD_OP_CMP
+  unsigned char value[BCD_RESULT_BYTES];
+} bcd_resp_item;
+
 // --- Права за FIFO ---
 #define FIFO_PERMS 0666 // <<<--- НОВО: Права за FIFO
 
@@ -100,4 +217,146 @@ int waitForKbhit() {
   return 0;
 }
 
+// --- Event-driven producer input ---
+// Producers block in poll() on stdin, a self-pipe written by the SIGTERM
+// handler and their outbound channel, instead of polling the keyboard.
+int signal_pipe[2] = {-1, -1};
+
+int setup_signal_pipe() {
+  if (pipe(signal_pipe) < 0)
+    return 0;
+  for (int i = 0; i < 2; i++) {
+    fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 1;
+}
+
+// Async-signal-safe; call from signal handlers to wake producer_wait()
+void notify_signal_pipe() {
+  int saved_errno = errno;
+  if (signal_pipe[1] >= 0)
+    write(signal_pipe[1], "x", 1);
+  errno = saved_errno;
+}
+
+// --- Readiness handshake ---
+// A supervisor (Process 1) starts a child with the write end of a pipe
+// named in READY_FD_ENV; the child writes one byte as soon as its IPC
+// endpoints exist, or exits, which the supervisor sees as EOF.
+#define READY_FD_ENV "P5_READY_FD"
+
+void notify_ready() {
+  const char *fd_str = getenv(READY_FD_ENV);
+  if (!fd_str)
+    return;
+  int fd = atoi(fd_str);
+  unsetenv(READY_FD_ENV);
+  write(fd, "R", 1);
+  close(fd);
+}
+
+long long monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define LINE_READER_SIZE 4096
+typedef struct {
+  char buf[LINE_READER_SIZE];
+  size_t len;
+  int eof;
+} line_reader;
+
+// Reads whatever is available on fd. Returns 0 on EOF or error.
+int line_reader_fill(line_reader *lr, int fd) {
+  if (lr->len == sizeof(lr->buf)) {
+    lr->buf[sizeof(lr->buf) - 1] = '\n'; // Overlong line, cut it
+    return 1;
+  }
+  ssize_t n = read(fd, lr->buf + lr->len, sizeof(lr->buf) - lr->len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return 1;
+  if (n <= 0) {
+    lr->eof = 1;
+    return 0;
+  }
+  lr->len += n;
+  return 1;
+}
+
+// Pops the next complete line (without the newline). After EOF a trailing
+// unterminated line is returned as well.
+int line_reader_next(line_reader *lr, char *out, size_t out_size) {
+  char *nl = memchr(lr->buf, '\n', lr->len);
+  size_t line_len = nl ? (size_t)(nl - lr->buf) : lr->len;
+  if (!nl && !(lr->eof && lr->len > 0))
+    return 0;
+
+  size_t copy = line_len < out_size - 1 ? line_len : out_size - 1;
+  memcpy(out, lr->buf, copy);
+  out[copy] = '\0';
+
+  size_t consumed = nl ? line_len + 1 : line_len;
+  memmove(lr->buf, lr->buf + consumed, lr->len - consumed);
+  lr->len -= consumed;
+  return 1;
+}
+
+int line_reader_has_line(line_reader *lr) {
+  return memchr(lr->buf, '\n', lr->len) != NULL || (lr->eof && lr->len > 0);
+}
+
+#define PRODUCER_EV_SIGNAL 1
+#define PRODUCER_EV_INPUT 2
+#define PRODUCER_EV_CHANNEL_CLOSED 4
+
+// Blocks until the termination signal, stdin input (if want_input) or a
+// hangup/error on channel_fd (ignored if negative). timeout_ms < 0 waits
+// forever. Returns a mask of PRODUCER_EV_* bits, 0 on timeout.
+int producer_wait(int want_input, int channel_fd, int timeout_ms) {
+  struct pollfd fds[3];
+  fds[0].fd = signal_pipe[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = want_input ? STDIN_FILENO : -1;
+  fds[1].events = POLLIN;
+  fds[2].fd = channel_fd;
+  fds[2].events = 0; // POLLERR/POLLHUP are always reported
+
+  if (poll(fds, 3, timeout_ms) <= 0)
+    return 0;
+
+  int ev = 0;
+  if (fds[0].revents & POLLIN) {
+    char drain[16];
+    while (read(signal_pipe[0], drain, sizeof(drain)) > 0)
+      ;
+    ev |= PRODUCER_EV_SIGNAL;
+  }
+  if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+    ev |= PRODUCER_EV_INPUT;
+  if (fds[2].revents & (POLLHUP | POLLERR))
+    ev |= PRODUCER_EV_CHANNEL_CLOSED;
+  return ev;
+}
+
+// Optional pacing between sends: with delay_ms > 0 the next line is held
+// back until delay_ms after the previous send. Returns the poll timeout to
+// use, 0 if a pending line may be sent now.
+int pacing_timeout(int delay_ms, long long last_send_ms, int have_line) {
+  if (!have_line)
+    return -1;
+  if (delay_ms <= 0)
+    return 0;
+  long long remaining = last_send_ms + delay_ms - monotonic_ms();
+  return remaining > 0 ? (int)remaining : 0;
+}
+
 #endif // COMMON_H
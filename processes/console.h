@@ -0,0 +1,176 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "common.h"
+#include <stdarg.h>
+
+// --- Console rendering ---
+// Per-message lines (Process 5's "Received", the producers' "Sent") are
+// formatted into a buffer and written to a non-blocking copy of stdout
+// once per batch. A terminal that cannot keep up never stalls sending or
+// receiving: lines that do not fit in the buffer are dropped and counted.
+// Modes:
+//   all           a line per message
+//   sample:<N>    a line for every Nth message
+//   summary[:ms]  a message count line every ms (default 1000) instead
+//   quiet         no per-message output
+typedef enum {
+  CONSOLE_ALL,
+  CONSOLE_SAMPLE,
+  CONSOLE_SUMMARY,
+  CONSOLE_QUIET
+} console_mode;
+
+#define CONSOLE_BUF_SIZE (64 * 1024)
+#define CONSOLE_DEFAULT_REFRESH_MS 1000
+#define CONSOLE_KINDS 5 // Message counts are kept by process number
+
+typedef struct {
+  int mode; // console_mode, -1 = the program's default
+  int every;
+  int refresh_ms;
+  int fd; // -1 until console_open()
+  char buf[CONSOLE_BUF_SIZE];
+  size_t len;
+  uint64_t messages;
+  uint64_t dropped, dropped_noted; // Lines
+  uint64_t counts[CONSOLE_KINDS];  // Messages in this summary interval
+  long long interval_ms;           // When it began
+} console_state;
+
+console_state console = {-1, 1, CONSOLE_DEFAULT_REFRESH_MS, -1};
+
+// Reads a console mode into *mode, *every and *refresh_ms, which keep
+// their values where the mode does not set them. Returns 0 if it is
+// invalid.
+int console_read_spec(const char *spec, int *mode, int *every,
+                      int *refresh_ms) {
+  if (strcmp(spec, "all") == 0) {
+    *mode = CONSOLE_ALL;
+  } else if (strcmp(spec, "quiet") == 0) {
+    *mode = CONSOLE_QUIET;
+  } else if (strncmp(spec, "sample:", 7) == 0) {
+    *mode = CONSOLE_SAMPLE;
+    *every = atoi(spec + 7);
+    return *every > 0;
+  } else if (strncmp(spec, "summary", 7) == 0 &&
+             (spec[7] == '\0' || spec[7] == ':')) {
+    *mode = CONSOLE_SUMMARY;
+    if (spec[7] == ':')
+      *refresh_ms = atoi(spec + 8);
+    return *refresh_ms > 0;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Checks a console mode without applying it (Process 1 passes modes on to
+// its children).
+int console_valid(const char *spec) {
+  int mode, every = 1, refresh_ms = CONSOLE_DEFAULT_REFRESH_MS;
+  return console_read_spec(spec, &mode, &every, &refresh_ms);
+}
+
+// Parses a console mode. Returns 0 if it is invalid.
+int console_parse(const char *spec) {
+  return console_read_spec(spec, &console.mode, &console.every,
+                           &console.refresh_ms);
+}
+
+// Opens the console output; default_mode applies unless a mode was parsed.
+// A terminal or pipe is reopened with O_NONBLOCK, which gives it a file
+// description of its own: setting the flag on stdout itself would also
+// make writes by Process 1 and the other children fail with EAGAIN. Other
+// stdouts (a file) do not block for long and are written as they are.
+void console_open(int default_mode) {
+  if (console.mode < 0)
+    console.mode = default_mode;
+  struct stat st;
+  if (fstat(STDOUT_FILENO, &st) == 0 &&
+      (S_ISCHR(st.st_mode) || S_ISFIFO(st.st_mode)))
+    console.fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (console.fd < 0)
+    console.fd = dup(STDOUT_FILENO);
+  console.interval_ms = monotonic_ms();
+}
+
+// Counts a message of the given kind and says whether to render a line
+// for it.
+int console_line(int kind) {
+  console.counts[kind]++;
+  if (console.mode == CONSOLE_ALL)
+    return 1;
+  return console.mode == CONSOLE_SAMPLE &&
+         console.messages++ % console.every == 0;
+}
+
+// Adds a line to the buffer, or drops it if the buffer is full.
+void console_printf(const char *fmt, ...) {
+  size_t room = CONSOLE_BUF_SIZE - console.len;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(console.buf + console.len, room, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= room)
+    console.dropped++;
+  else
+    console.len += n;
+}
+
+// In summary mode, once every refresh_ms: copies the interval's message
+// counts to counts[] and starts a new interval. Returns the interval's
+// length in seconds, or 0 if no summary is due.
+double console_summary_due(uint64_t counts[CONSOLE_KINDS]) {
+  if (console.mode != CONSOLE_SUMMARY)
+    return 0;
+  long long now = monotonic_ms();
+  if (now - console.interval_ms < console.refresh_ms)
+    return 0;
+  double seconds = (now - console.interval_ms) / 1000.0;
+  memcpy(counts, console.counts, sizeof(console.counts));
+  memset(console.counts, 0, sizeof(console.counts));
+  console.interval_ms = now;
+  return seconds;
+}
+
+int console_pending() {
+  return console.len > 0 || console.dropped > console.dropped_noted;
+}
+
+// Writes as much of the buffer as the terminal takes without blocking;
+// the rest waits for the next call.
+void console_flush() {
+  if (console.dropped > console.dropped_noted &&
+      CONSOLE_BUF_SIZE - console.len >= 64) {
+    console.len += snprintf(console.buf + console.len, 64,
+                            "[console: %llu lines dropped]\n",
+                            (unsigned long long)(console.dropped -
+                                                 console.dropped_noted));
+    console.dropped_noted = console.dropped;
+  }
+  if (console.len == 0 || console.fd < 0)
+    return;
+  fflush(stdout); // Keeps the order of other output
+  ssize_t n = write(console.fd, console.buf, console.len);
+  if (n <= 0)
+    return; // EAGAIN: the terminal is behind
+  memmove(console.buf, console.buf + n, console.len - n);
+  console.len -= n;
+}
+
+// Writes whatever is left, waiting for the terminal this time.
+void console_close() {
+  if (console.fd < 0)
+    return;
+  fcntl(console.fd, F_SETFL, 0);
+  size_t before;
+  do {
+    before = console.len;
+    console_flush();
+  } while (console.len > 0 && console.len < before); // Stop on an error
+  close(console.fd);
+  console.fd = -1;
+}
+
+#endif // CONSOLE_H
@@ -0,0 +1,385 @@
+#ifndef CREDITS_H
+#define CREDITS_H
+
+#include "common.h"
+#include "p5_stats.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+// --- Credit-based flow control ---
+// P5 publishes a shared-memory page with a slot per producer that opts in
+// with "--credits <policy>". A producer may send up to sequence number
+// granted; P5 sets granted to the last sequence number it delivered from
+// that producer plus a window, and shrinks the window as its own headroom
+// (free log-writer blocks, free ingest-queue cells) runs out. What a
+// producer does with a value it has no credit for is its policy:
+//   block        wait for credit; the waits and their length are counted
+//   coalesce     hold only the newest value, send it when credit returns
+//   sample       below a quarter of the window send every
+//                CREDIT_SAMPLE_EVERY-th value, none at all at zero
+//   drop-oldest  hold up to CREDIT_BACKLOG values, discarding the oldest
+// Every value a policy did not send is counted in the producer's slot.
+#define P5_CREDITS_SHM "/p5_credits"
+#define CREDIT_MAGIC 0x52433550 // "P5CR"
+#define CREDIT_VERSION 2
+#define CREDIT_SLOTS 64
+#define CREDIT_DEFAULT_WINDOW 1024
+#define CREDIT_MIN_WINDOW 16 // Never throttle a producer to nothing
+#define CREDIT_BACKLOG 1024
+#define CREDIT_SAMPLE_EVERY 8
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+enum {
+  CREDIT_BLOCK,
+  CREDIT_COALESCE,
+  CREDIT_SAMPLE,
+  CREDIT_DROP_OLDEST,
+  CREDIT_POLICIES
+};
+const char *credit_policy_names[CREDIT_POLICIES] = {"block", "coalesce",
+                                                    "sample", "drop-oldest"};
+
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic int32_t pid; // Owning producer; 0 = free
+  uint16_t channel; // Producing process (2-4), as P5 tracks sequences
+  uint16_t policy;
+  // Written by the producer
+  _Atomic uint64_t base; // Last sequence number sent before attaching
+  _Atomic uint64_t sent; // Sequence number of the last message sent
+  _Atomic uint64_t waits;
+  _Atomic uint64_t wait_ns;
+  _Atomic uint64_t coalesced; // Values replaced by a newer one
+  _Atomic uint64_t sampled;   // Values skipped by sampling
+  _Atomic uint64_t dropped;   // Values discarded from a full backlog
+  // Written by P5
+  _Atomic uint64_t delivered; // Last sequence number delivered
+  _Atomic uint64_t granted;
+} credit_slot;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t p5_pid;
+  _Atomic uint32_t window; // Window P5 currently grants
+  credit_slot slots[CREDIT_SLOTS];
+} credit_page;
+
+// Returns the policy for a name, or -1.
+int credit_parse_policy(const char *name) {
+  for (int i = 0; i < CREDIT_POLICIES; i++)
+    if (strcmp(name, credit_policy_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+// P5: creates a fresh page. Returns NULL on failure.
+credit_page *credit_page_create(uint32_t window) {
+  shm_unlink(P5_CREDITS_SHM);
+  int fd = shm_open(P5_CREDITS_SHM, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0)
+    return NULL;
+  fchmod(fd, 0666); // Producers write their half of the slots
+  if (ftruncate(fd, sizeof(credit_page)) < 0) {
+    close(fd);
+    return NULL;
+  }
+  credit_page *page = mmap(NULL, sizeof(credit_page), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED)
+    return NULL;
+  page->magic = CREDIT_MAGIC;
+  page->version = CREDIT_VERSION;
+  page->p5_pid = getpid();
+  atomic_store(&page->window, window);
+  return page;
+}
+
+// Producers map the page read-write, Process 1 read-only. NULL if P5 has
+// not published one.
+credit_page *credit_page_map(int writable) {
+  int fd = shm_open(P5_CREDITS_SHM, writable ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  credit_page *page = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(credit_page)) {
+    page = mmap(NULL, sizeof(credit_page),
+                writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd,
+                0);
+    if (page == MAP_FAILED || page->magic != CREDIT_MAGIC ||
+        page->version != CREDIT_VERSION) {
+      if (page != MAP_FAILED)
+        munmap(page, sizeof(credit_page));
+      page = NULL;
+    }
+  }
+  close(fd);
+  return page;
+}
+
+void credit_page_unmap(const credit_page *page) {
+  if (page)
+    munmap((void *)page, sizeof(credit_page));
+}
+
+// --- Producer side ---
+
+// A value waiting for credit; the union is the one the shm ring carries.
+typedef struct {
+  uint16_t len; // String length for P4
+  union {
+    int i;
+    double d;
+    char s[SOCK_MSG_MAX_LEN];
+  } value;
+} credit_item;
+
+typedef struct {
+  credit_page *page; // NULL: not (or no longer) flow controlled
+  credit_slot *slot;
+  int channel;
+  int policy;
+  uint64_t sent;
+  uint64_t offered;
+  // Kept here and mirrored into the slot, which goes away with P5
+  uint64_t waits, wait_ns, coalesced, sampled, dropped;
+  long long next_check_ns; // When to check that P5 is still alive
+  credit_item *backlog;    // Values not sent yet, a ring of cap items
+  size_t head, count, cap;
+} credit_client;
+
+void credit_publish(credit_client *c) {
+  if (!c->page)
+    return;
+  p5_stat_set(&c->slot->waits, c->waits);
+  p5_stat_set(&c->slot->wait_ns, c->wait_ns);
+  p5_stat_set(&c->slot->coalesced, c->coalesced);
+  p5_stat_set(&c->slot->sampled, c->sampled);
+  p5_stat_set(&c->slot->dropped, c->dropped);
+}
+
+// Claims a slot on the page P5 currently publishes, granting a window
+// beyond the last sequence number sent so far. Returns 0 if there is no
+// page or it is full.
+int credit_claim(credit_client *c) {
+  c->page = credit_page_map(1);
+  if (!c->page)
+    return 0;
+
+  int32_t me = getpid();
+  for (int i = 0; i < CREDIT_SLOTS; i++) {
+    credit_slot *s = &c->page->slots[i];
+    int32_t owner = atomic_load(&s->pid);
+    // Free, or left behind by a producer that died without detaching
+    if ((owner == 0 || (kill(owner, 0) < 0 && errno == ESRCH)) &&
+        atomic_compare_exchange_strong(&s->pid, &owner, me)) {
+      s->channel = c->channel;
+      s->policy = c->policy;
+      c->slot = s;
+      credit_publish(c);
+      p5_stat_set(&s->base, c->sent);
+      p5_stat_set(&s->sent, c->sent);
+      // P5 takes over from its next batch on
+      p5_stat_set(&s->delivered, c->sent);
+      p5_stat_set(&s->granted, c->sent + atomic_load(&c->page->window));
+      return 1;
+    }
+  }
+  credit_page_unmap(c->page);
+  c->page = NULL;
+  errno = EBUSY;
+  return 0;
+}
+
+// Sets up the client and claims a slot. Returns 0 if P5 has no page (or
+// it is full), in which case the client passes every value straight
+// through, or -1 if out of memory.
+int credit_attach(credit_client *c, int channel, int policy) {
+  memset(c, 0, sizeof(*c));
+  c->channel = channel;
+  c->policy = policy;
+  c->cap = policy == CREDIT_DROP_OLDEST ? CREDIT_BACKLOG : 1;
+  c->backlog = calloc(c->cap, sizeof(credit_item));
+  if (!c->backlog)
+    return -1;
+  return credit_claim(c);
+}
+
+// Attaches for --credits, saying so if P5 grants none. Returns 0 if out of
+// memory.
+int credit_start(credit_client *c, int channel, int policy, const char *who,
+                 pid_t pid) {
+  int attached = credit_attach(c, channel, policy);
+  if (attached == 0) {
+    printf("[%s - PID: %d] Process 5 grants no credits; sending without "
+           "flow control\n",
+           who, pid);
+    fflush(stdout);
+  }
+  return attached >= 0;
+}
+
+// Called once the producer has (re)connected to P5: a P5 that started
+// since the client attached publishes a page of its own, which the client
+// claims a slot on, carrying on from the sequence number it last sent.
+// Values held back and the counters are kept.
+void credit_resume(credit_client *c, const char *who, pid_t pid) {
+  if (c->page) {
+    if (kill(c->page->p5_pid, 0) == 0)
+      return; // Still the P5 the client is attached to
+    credit_page_unmap(c->page);
+    c->page = NULL;
+  }
+  if (credit_claim(c)) {
+    printf("[%s - PID: %d] Flow control resumed with Process 5 (PID %d)\n",
+           who, pid, c->page->p5_pid);
+    fflush(stdout);
+  }
+}
+
+void credit_detach(credit_client *c) {
+  if (c->page) {
+    atomic_store(&c->slot->pid, 0);
+    credit_page_unmap(c->page);
+    c->page = NULL;
+  }
+  free(c->backlog);
+  c->backlog = NULL;
+}
+
+// Messages that may be sent right now.
+uint64_t credit_available(const credit_client *c) {
+  if (!c->page)
+    return UINT64_MAX;
+  uint64_t granted = p5_stat_get(&c->slot->granted);
+  return granted > c->sent ? granted - c->sent : 0;
+}
+
+// Values held back for lack of credit.
+size_t credit_held(const credit_client *c) { return c->count; }
+
+// Stops flow control if P5 went away, so the producer finds out from its
+// channel instead of waiting for credit forever. Checked every 10 ms.
+void credit_check_p5(credit_client *c) {
+  long long now = monotonic_ns();
+  if (!c->page || now < c->next_check_ns)
+    return;
+  c->next_check_ns = now + 10000000LL;
+  if (kill(c->page->p5_pid, 0) < 0 && errno == ESRCH) {
+    credit_page_unmap(c->page);
+    c->page = NULL;
+  }
+}
+
+// Waits until there is credit for a message. Returns 0 if *stop becomes
+// set meanwhile.
+int credit_wait(credit_client *c, volatile sig_atomic_t *stop) {
+  if (credit_available(c) > 0)
+    return 1;
+  long long start = monotonic_ns();
+  int spins = 0;
+  while (credit_available(c) == 0) {
+    if (*stop)
+      return 0;
+    credit_check_p5(c);
+    if (++spins < 100)
+      sched_yield();
+    else
+      usleep(100);
+  }
+  c->waits++;
+  c->wait_ns += monotonic_ns() - start;
+  credit_publish(c);
+  return 1;
+}
+
+void credit_push(credit_client *c, const credit_item *item) {
+  size_t size = offsetof(credit_item, value) +
+                (item->len ? item->len : sizeof(item->value.d));
+  memcpy(&c->backlog[(c->head + c->count) % c->cap], item, size);
+  c->count++;
+}
+
+// Hands a newly generated value to the policy, which queues it for
+// sending, holds it, merges it or skips it. Only the block policy waits;
+// it returns 0 if *stop becomes set meanwhile.
+int credit_offer(credit_client *c, const credit_item *item,
+                 volatile sig_atomic_t *stop) {
+  uint64_t n = c->offered++;
+  credit_check_p5(c);
+  uint64_t avail = credit_available(c);
+  if (avail > c->count && c->count < c->cap) {
+    // Sampling starts once a quarter of the window is left
+    if (c->page && c->policy == CREDIT_SAMPLE &&
+        avail - c->count <= atomic_load(&c->page->window) / 4 &&
+        n % CREDIT_SAMPLE_EVERY != 0) {
+      c->sampled++;
+      credit_publish(c);
+      return 1;
+    }
+    credit_push(c, item);
+    return 1;
+  }
+
+  switch (c->policy) {
+  case CREDIT_BLOCK:
+    // Nothing is held: what was queued had credit and has been sent
+    if (!credit_wait(c, stop))
+      return 0;
+    break;
+  case CREDIT_COALESCE:
+    if (c->count > 0) {
+      c->count = 0; // Replaces the value still waiting
+      c->coalesced++;
+    }
+    break;
+  case CREDIT_SAMPLE:
+    c->sampled++;
+    credit_publish(c);
+    return 1;
+  case CREDIT_DROP_OLDEST:
+    if (c->count == c->cap) {
+      c->head = (c->head + 1) % c->cap;
+      c->count--;
+      c->dropped++;
+    }
+    break;
+  }
+  credit_push(c, item);
+  credit_publish(c);
+  return 1;
+}
+
+// The next value to send if there is credit for it, else NULL. The
+// producer sends it and then calls credit_sent().
+const credit_item *credit_next(credit_client *c) {
+  if (c->count == 0 || credit_available(c) == 0)
+    return NULL;
+  return &c->backlog[c->head];
+}
+
+// Releases the value credit_next() returned, sent as sequence number seq.
+void credit_sent(credit_client *c, uint64_t seq) {
+  c->head = (c->head + 1) % c->cap;
+  c->count--;
+  c->sent = seq;
+  if (c->page)
+    p5_stat_set(&c->slot->sent, seq);
+}
+
+void credit_report(const credit_client *c, const char *who, pid_t pid) {
+  printf("[%s - PID: %d] Credits (%s): %llu waits (%.1f ms), %llu "
+         "coalesced, %llu sampled, %llu dropped\n",
+         who, pid, credit_policy_names[c->policy],
+         (unsigned long long)c->waits, c->wait_ns / 1e6,
+         (unsigned long long)c->coalesced, (unsigned long long)c->sampled,
+         (unsigned long long)c->dropped);
+  fflush(stdout);
+}
+
+#endif // CREDITS_H
@@ -0,0 +1,168 @@
+#ifndef INGEST_QUEUE_H
+#define INGEST_QUEUE_H
+
+#include "common.h"
+#include "tuning.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+
+// --- Ingest queue ---
+// In threaded mode P5's reader threads parse messages and hand them to the
+// main thread, which prints, logs and accounts for them. The queue is a
+// bounded lock-free multi-producer/single-consumer array: a reader claims a
+// cell by advancing the shared tail with a CAS, and every cell carries a
+// turn number that tells whether it is free or published. Messages pushed
+// by one reader come out in the order it pushed them, so a channel stays
+// in order as long as a single reader owns it.
+#define INGEST_QUEUE_SLOTS 16384 // Must be a power of two
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+typedef struct {
+  uint16_t transport; // P5_CH_*
+  uint16_t len;       // String length; 0 for numeric values
+  int32_t source_pid;
+  uint64_t seq;
+  int64_t send_ns;
+  uint32_t bytes;   // Size on the wire, for the stats page
+  uint16_t channel; // Producing process on shared transports, else 0
+  union {
+    int i;
+    double d;
+    char s[SOCK_MSG_MAX_LEN];
+  } value;
+} p5_msg;
+
+typedef struct {
+  _Atomic uint64_t turn; // == position: free, == position + 1: published
+  p5_msg msg;
+} ingest_cell;
+
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t tail; // Next cell to claim
+  _Alignas(CACHE_LINE) uint64_t head;         // Consumer only
+  _Alignas(CACHE_LINE) _Atomic uint32_t consumer_sleeping;
+  int wake_fd; // eventfd, written only while the consumer sleeps
+  ingest_cell *cells;
+} ingest_queue;
+
+int ingest_queue_init(ingest_queue *q) {
+  memset(q, 0, sizeof(*q));
+  q->cells = tuning_alloc(INGEST_QUEUE_SLOTS * sizeof(ingest_cell));
+  if (!q->cells)
+    return 0;
+  for (uint64_t i = 0; i < INGEST_QUEUE_SLOTS; i++)
+    atomic_init(&q->cells[i].turn, i);
+  q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->wake_fd < 0) {
+    tuning_free(q->cells, INGEST_QUEUE_SLOTS * sizeof(ingest_cell));
+    q->cells = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+void ingest_queue_free(ingest_queue *q) {
+  if (!q->cells)
+    return;
+  close(q->wake_fd);
+  tuning_free(q->cells, INGEST_QUEUE_SLOTS * sizeof(ingest_cell));
+  q->cells = NULL;
+}
+
+// Copies msg into the queue, or returns 0 if the queue is full.
+int ingest_queue_push(ingest_queue *q, const p5_msg *msg) {
+  uint64_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  ingest_cell *cell;
+  for (;;) {
+    cell = &q->cells[pos & (INGEST_QUEUE_SLOTS - 1)];
+    uint64_t turn = atomic_load_explicit(&cell->turn, memory_order_acquire);
+    int64_t diff = (int64_t)(turn - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return 0; // The consumer has not released this cell yet
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  // Only the used part of the value is copied
+  size_t size = offsetof(p5_msg, value) +
+                (msg->len ? msg->len : sizeof(msg->value.d));
+  memcpy(&cell->msg, msg, size);
+  atomic_store_explicit(&cell->turn, pos + 1, memory_order_release);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->consumer_sleeping, memory_order_relaxed) &&
+      atomic_exchange(&q->consumer_sleeping, 0)) {
+    uint64_t one = 1;
+    write(q->wake_fd, &one, sizeof(one));
+  }
+  return 1;
+}
+
+// Blocking variant of push: yields while the queue is full, which leaves
+// the reader's source unread and so pushes back on its producers. Returns 0
+// if *stop becomes set meanwhile.
+int ingest_queue_push_wait(ingest_queue *q, const p5_msg *msg,
+                           volatile sig_atomic_t *stop) {
+  int spins = 0;
+  while (!ingest_queue_push(q, msg)) {
+    if (*stop)
+      return 0;
+    if (++spins < 100)
+      sched_yield();
+    else
+      usleep(100);
+  }
+  return 1;
+}
+
+// Hands up to max_items published messages to handle() and releases their
+// cells. Returns the number of messages consumed.
+int ingest_queue_consume(ingest_queue *q, int max_items,
+                         void (*handle)(const p5_msg *)) {
+  int n = 0;
+  while (n < max_items) {
+    ingest_cell *cell = &q->cells[q->head & (INGEST_QUEUE_SLOTS - 1)];
+    if (atomic_load_explicit(&cell->turn, memory_order_acquire) !=
+        q->head + 1)
+      break;
+    handle(&cell->msg);
+    atomic_store_explicit(&cell->turn, q->head + INGEST_QUEUE_SLOTS,
+                          memory_order_release);
+    q->head++;
+    n++;
+  }
+  return n;
+}
+
+// Messages queued and not yet consumed; called by the consumer.
+uint64_t ingest_queue_depth(ingest_queue *q) {
+  return atomic_load_explicit(&q->tail, memory_order_relaxed) - q->head;
+}
+
+// Sleeps until a reader publishes a message or timeout_ms passes.
+void ingest_queue_wait(ingest_queue *q, int timeout_ms) {
+  atomic_store_explicit(&q->consumer_sleeping, 1, memory_order_seq_cst);
+  atomic_thread_fence(memory_order_seq_cst);
+  ingest_cell *cell = &q->cells[q->head & (INGEST_QUEUE_SLOTS - 1)];
+  if (atomic_load_explicit(&cell->turn, memory_order_acquire) == q->head + 1) {
+    atomic_store_explicit(&q->consumer_sleeping, 0, memory_order_relaxed);
+    return;
+  }
+  struct pollfd pfd = {q->wake_fd, POLLIN, 0};
+  if (poll(&pfd, 1, timeout_ms) > 0) {
+    uint64_t count;
+    read(q->wake_fd, &count, sizeof(count));
+  }
+  atomic_store_explicit(&q->consumer_sleeping, 0, memory_order_relaxed);
+}
+
+#endif // INGEST_QUEUE_H
@@ -0,0 +1,170 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "common.h"
+
+// --- Delivery latency histograms ---
+// HDR-style log-linear histogram of nanosecond latencies: exact below
+// 2^LAT_SUB_BITS, above that every power of two is split into
+// 2^(LAT_SUB_BITS - 1) equal buckets, so any recorded value is reported
+// within 1/64 (~1.6%) of its true value. Values up to 2^LAT_MAX_BITS ns
+// (~18 minutes) are tracked; larger ones land in the top bucket.
+#define LAT_SUB_BITS 7
+#define LAT_MAX_BITS 40
+#define LAT_HALF (1 << (LAT_SUB_BITS - 1))
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 2) * LAT_HALF)
+
+typedef struct {
+  uint64_t counts[LAT_BUCKETS];
+  uint64_t total;
+  int64_t min_ns, max_ns;
+  double sum_ns;
+} latency_hist;
+
+int latency_bucket(int64_t ns) {
+  if (ns < 0)
+    ns = 0;
+  if (ns < (1 << LAT_SUB_BITS))
+    return (int)ns;
+  int msb = 63 - __builtin_clzll((uint64_t)ns);
+  int shift = msb - LAT_SUB_BITS + 1;
+  int idx = shift * LAT_HALF + (int)(ns >> shift);
+  return idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1;
+}
+
+// Midpoint of the values that map to a bucket.
+int64_t latency_bucket_value(int idx) {
+  if (idx < (1 << LAT_SUB_BITS))
+    return idx;
+  int shift = idx / LAT_HALF - 1;
+  int64_t low = (int64_t)(idx - shift * LAT_HALF) << shift;
+  return low + ((1LL << shift) >> 1);
+}
+
+void latency_reset(latency_hist *h) {
+  memset(h, 0, sizeof(*h));
+  h->min_ns = INT64_MAX;
+}
+
+void latency_record(latency_hist *h, int64_t ns) {
+  if (ns < 0)
+    ns = 0; // Sender and receiver read the same clock; guard anyway
+  h->counts[latency_bucket(ns)]++;
+  h->total++;
+  h->sum_ns += ns;
+  if (ns < h->min_ns)
+    h->min_ns = ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+}
+
+// Value at the given percentile (0..100), clamped to the exact min/max.
+int64_t latency_percentile(const latency_hist *h, double pct) {
+  if (h->total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(pct / 100.0 * h->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      int64_t v = latency_bucket_value(i);
+      return v < h->min_ns ? h->min_ns : v > h->max_ns ? h->max_ns : v;
+    }
+  }
+  return h->max_ns;
+}
+
+void latency_merge(latency_hist *into, const latency_hist *from) {
+  for (int i = 0; i < LAT_BUCKETS; i++)
+    into->counts[i] += from->counts[i];
+  into->total += from->total;
+  into->sum_ns += from->sum_ns;
+  if (from->min_ns < into->min_ns)
+    into->min_ns = from->min_ns;
+  if (from->max_ns > into->max_ns)
+    into->max_ns = from->max_ns;
+}
+
+void latency_print(const latency_hist *h, const char *label) {
+  if (h->total == 0)
+    return;
+  printf("  %-12s n=%-10llu mean=%.1fus p50=%.1fus p99=%.1fus "
+         "p99.9=%.1fus max=%.1fus\n",
+         label, (unsigned long long)h->total, h->sum_ns / h->total / 1e3,
+         latency_percentile(h, 50) / 1e3, latency_percentile(h, 99) / 1e3,
+         latency_percentile(h, 99.9) / 1e3, h->max_ns / 1e3);
+}
+
+// --- Per-source sequence tracking ---
+// Open-addressing table of the last sequence number seen per (channel,
+// PID), used to count lost and out-of-order messages.
+typedef struct {
+  uint64_t key; // channel << 32 | pid; 0 = empty
+  uint64_t last_seq;
+} seq_entry;
+
+typedef struct {
+  seq_entry *entries;
+  size_t cap, used;
+  uint64_t gaps;      // Messages missing between consecutive sequence numbers
+  uint64_t reordered; // Messages at or below a sequence number already seen
+} seq_tracker;
+
+seq_entry *seq_slot(seq_entry *entries, size_t cap, uint64_t key) {
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 40;
+  for (;; i++) {
+    seq_entry *e = &entries[i & (cap - 1)];
+    if (e->key == key || e->key == 0)
+      return e;
+  }
+}
+
+// Returns how many messages of this producer went missing right before seq.
+uint64_t seq_track(seq_tracker *t, int channel, int pid, uint64_t seq) {
+  if (t->used * 2 >= t->cap) {
+    size_t cap = t->cap ? t->cap * 2 : 64;
+    seq_entry *grown = calloc(cap, sizeof(seq_entry));
+    if (!grown)
+      return 0;
+    for (size_t i = 0; i < t->cap; i++)
+      if (t->entries[i].key)
+        *seq_slot(grown, cap, t->entries[i].key) = t->entries[i];
+    free(t->entries);
+    t->entries = grown;
+    t->cap = cap;
+  }
+
+  uint64_t key = (uint64_t)channel << 32 | (uint32_t)pid;
+  seq_entry *e = seq_slot(t->entries, t->cap, key);
+  uint64_t lost = 0;
+  if (e->key == 0) {
+    e->key = key;
+    t->used++;
+  } else if (seq <= e->last_seq) {
+    t->reordered++;
+    return 0;
+  } else {
+    lost = seq - e->last_seq - 1;
+    t->gaps += lost;
+  }
+  e->last_seq = seq;
+  return lost;
+}
+
+// Last sequence number seen from (channel, pid), 0 if none yet.
+uint64_t seq_last(const seq_tracker *t, int channel, int pid) {
+  if (t->cap == 0)
+    return 0;
+  uint64_t key = (uint64_t)channel << 32 | (uint32_t)pid;
+  const seq_entry *e = seq_slot(t->entries, t->cap, key);
+  return e->key == key ? e->last_seq : 0;
+}
+
+void seq_tracker_free(seq_tracker *t) {
+  free(t->entries);
+  memset(t, 0, sizeof(*t));
+}
+
+#endif // LATENCY_H
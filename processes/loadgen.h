@@ -0,0 +1,164 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "common.h"
+#include "console.h"
+#include "credits.h"
+#include "transport.h"
+
+// --- Load generator ---
+// With "--gen <spec>" a producer sends synthetic values instead of reading
+// stdin. The spec is a comma-separated list of:
+//   rate=<msgs/s>|max   target send rate (default max)
+//   count=<n>           stop after n messages
+//   duration=<seconds>  stop after this long
+//   size=<n>|<min>-<max> string length for P4, uniform in [min, max]
+// Without count or duration the generator runs until it is signalled.
+typedef struct {
+  int enabled;
+  double rate; // 0 = as fast as the channel accepts
+  long long count;
+  double duration_s;
+  int min_size, max_size;
+
+  long long start_ns;
+  long long sent;
+  long long bytes;
+  uint64_t rng;
+} loadgen;
+
+// Returns 0 on a malformed spec.
+int loadgen_parse(loadgen *g, const char *spec) {
+  memset(g, 0, sizeof(*g));
+  g->enabled = 1;
+  g->min_size = g->max_size = 16;
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  char *save = NULL;
+  for (char *kv = strtok_r(buf, ",", &save); kv;
+       kv = strtok_r(NULL, ",", &save)) {
+    char *val = strchr(kv, '=');
+    if (!val)
+      return 0;
+    *val++ = '\0';
+    if (strcmp(kv, "rate") == 0) {
+      g->rate = strcmp(val, "max") == 0 ? 0 : atof(val);
+      if (g->rate < 0)
+        return 0;
+    } else if (strcmp(kv, "count") == 0) {
+      g->count = atoll(val);
+    } else if (strcmp(kv, "duration") == 0) {
+      g->duration_s = atof(val);
+    } else if (strcmp(kv, "size") == 0) {
+      if (sscanf(val, "%d-%d", &g->min_size, &g->max_size) != 2)
+        g->max_size = g->min_size = atoi(val);
+      if (g->min_size < 1 || g->max_size < g->min_size ||
+          g->max_size > SOCK_MSG_MAX_LEN)
+        return 0;
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void loadgen_start(loadgen *g) {
+  g->start_ns = monotonic_ns();
+  g->rng = (uint64_t)g->start_ns ^ ((uint64_t)getpid() << 32);
+}
+
+// How long until the next message is due: 0 = send now, > 0 = wait this
+// many ms, < 0 = the count or duration is reached.
+int loadgen_wait_ms(const loadgen *g) {
+  if (g->count > 0 && g->sent >= g->count)
+    return -1;
+  long long elapsed = monotonic_ns() - g->start_ns;
+  if (g->duration_s > 0 && elapsed >= (long long)(g->duration_s * 1e9))
+    return -1;
+  if (g->rate <= 0)
+    return 0;
+  long long due = (long long)(g->sent * 1e9 / g->rate);
+  if (due <= elapsed)
+    return 0;
+  return (int)((due - elapsed + 999999) / 1000000);
+}
+
+void loadgen_sent(loadgen *g, size_t bytes) {
+  g->sent++;
+  g->bytes += bytes;
+}
+
+uint64_t loadgen_random(loadgen *g) {
+  // xorshift64
+  g->rng ^= g->rng << 13;
+  g->rng ^= g->rng >> 7;
+  g->rng ^= g->rng << 17;
+  return g->rng;
+}
+
+// Values count up from 1 so the receiver can check ordering.
+int loadgen_int(loadgen *g) { return (int)(g->sent + 1); }
+
+double loadgen_double(loadgen *g) { return (g->sent + 1) + 0.5; }
+
+// Fills out with a string of a length drawn from the size distribution.
+size_t loadgen_string(loadgen *g, char *out, size_t out_size) {
+  size_t len = g->min_size;
+  if (g->max_size > g->min_size)
+    len += loadgen_random(g) % (g->max_size - g->min_size + 1);
+  if (len > out_size - 1)
+    len = out_size - 1;
+  int prefix = snprintf(out, out_size, "g%lld-", g->sent + 1);
+  for (size_t i = prefix; i < len; i++)
+    out[i] = 'a' + i % 26;
+  out[len] = '\0'; // Cuts the prefix for very short sizes
+  return len;
+}
+
+// Parses the optional producer arguments after <delay_ms>: the transport
+// (channel_name or "shm", or "--via <backend>" for a shared transport, see
+// transport.h; -1 = none), "--gen <spec>" and, for generated load,
+// "--credits <policy>" (see credits.h; -1 = no flow control), in any
+// order. Returns 0 on bad usage.
+int producer_parse_options(int argc, char *argv[], const char *channel_name,
+                           int *use_shm, int *via, loadgen *g,
+                           int *credit_policy) {
+  *use_shm = 0;
+  *via = -1;
+  *credit_policy = -1;
+  g->enabled = 0;
+  for (int i = 4; i < argc; i++) {
+    if (strcmp(argv[i], "--gen") == 0) {
+      if (++i == argc || !loadgen_parse(g, argv[i]))
+        return 0;
+    } else if (strcmp(argv[i], "--via") == 0) {
+      if (++i == argc || (*via = transport_parse(argv[i])) < 0)
+        return 0;
+    } else if (strcmp(argv[i], "--console") == 0) {
+      if (++i == argc || !console_parse(argv[i]))
+        return 0;
+    } else if (strcmp(argv[i], "--credits") == 0) {
+      if (++i == argc || (*credit_policy = credit_parse_policy(argv[i])) < 0)
+        return 0;
+    } else if (strcmp(argv[i], "shm") == 0) {
+      *use_shm = 1;
+    } else if (strcmp(argv[i], channel_name) != 0) {
+      return 0;
+    }
+  }
+  return (*credit_policy < 0 || g->enabled) && !(*use_shm && *via >= 0);
+}
+
+void loadgen_report(const loadgen *g, const char *who, pid_t pid) {
+  double seconds = (monotonic_ns() - g->start_ns) / 1e9;
+  if (seconds <= 0)
+    seconds = 1e-9;
+  printf("[%s - PID: %d] Generated %lld messages (%lld bytes) in %.3f s: "
+         "%.0f msg/s, %.2f MB/s\n",
+         who, pid, g->sent, g->bytes, seconds, g->sent / seconds,
+         g->bytes / seconds / 1e6);
+  fflush(stdout);
+}
+
+#endif // LOADGEN_H
@@ -0,0 +1,429 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include "binlog.h"
+#include "common.h"
+#include "tuning.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// --- Asynchronous log writer ---
+// The event loop formats records into the current block; full blocks (or
+// the partial block at the end of a loop iteration, if the writer is idle)
+// are handed to a writer thread through a lock-free SPSC ring and written
+// with one writev() per group. Blocks come back through a second ring.
+// In segmented mode (the binary log) the writer rolls over to a new
+// preallocated segment whenever a block marked end_segment has been written.
+#define LOG_BLOCK_SIZE (256 * 1024)
+#define LOG_BLOCK_COUNT 8 // Power of two
+#define LOG_DEFAULT_SYNC_MS 1000
+
+typedef enum {
+  LOG_DURABILITY_NONE,     // Leave flushing to the kernel
+  LOG_DURABILITY_PERIODIC, // fdatasync() every sync_interval_ms
+  LOG_DURABILITY_SYNC      // fdatasync() before the loop continues
+} log_durability;
+
+typedef struct {
+  size_t len;
+  int end_segment; // Start a new segment after writing this block
+  char data[LOG_BLOCK_SIZE];
+} log_block;
+
+typedef struct {
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  int items[LOG_BLOCK_COUNT];
+} log_index_ring;
+
+typedef struct {
+  int fd;
+  log_durability durability;
+  int sync_interval_ms;
+  log_block *blocks;
+  log_index_ring full, free;
+  sem_t full_sem, free_sem, durable_sem;
+  int current;        // Block being filled by the event loop, -1 if none
+  uint64_t published; // Only touched by the event loop
+  uint64_t appended;  // Event loop: file offset the next record will get
+  _Atomic uint64_t written;
+  _Atomic int stop;
+  _Atomic uint64_t write_errors;
+  // Written by the writer thread, read for P5's stats page
+  _Atomic uint64_t bytes_written;
+  _Atomic uint64_t writes;
+  _Atomic uint64_t write_ns_total;
+  _Atomic uint64_t write_ns_max;
+  pthread_t thread;
+  // Segmented mode only (segment_size > 0)
+  const char *segment_base;
+  uint64_t segment_size;
+  uint64_t segment_index; // Writer thread
+  uint64_t segment_used;  // Event loop: bytes already assigned to the segment
+} log_writer;
+
+void log_ring_push(log_index_ring *r, int item) {
+  uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  r->items[tail & (LOG_BLOCK_COUNT - 1)] = item;
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+int log_ring_pop(log_index_ring *r) {
+  uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+    return -1;
+  int item = r->items[head & (LOG_BLOCK_COUNT - 1)];
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return item;
+}
+
+int log_ring_empty(log_index_ring *r) {
+  return atomic_load_explicit(&r->head, memory_order_acquire) ==
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+// Parses "none", "periodic", "periodic:<ms>" or "sync".
+int log_durability_parse(const char *s, log_durability *durability,
+                         int *interval_ms) {
+  *interval_ms = LOG_DEFAULT_SYNC_MS;
+  if (strcmp(s, "none") == 0) {
+    *durability = LOG_DURABILITY_NONE;
+  } else if (strcmp(s, "sync") == 0) {
+    *durability = LOG_DURABILITY_SYNC;
+  } else if (strncmp(s, "periodic", 8) == 0) {
+    *durability = LOG_DURABILITY_PERIODIC;
+    if (s[8] == ':')
+      *interval_ms = atoi(s + 9);
+    else if (s[8] != '\0')
+      return 0;
+    if (*interval_ms <= 0)
+      return 0;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+void log_write_iov(log_writer *lw, struct iovec *iov, int n) {
+  int iov_start = 0;
+  long long start_ns = monotonic_ns();
+  while (iov_start < n) {
+    ssize_t w = writev(lw->fd, iov + iov_start, n - iov_start);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      atomic_fetch_add(&lw->write_errors, 1);
+      return;
+    }
+    atomic_fetch_add_explicit(&lw->bytes_written, w, memory_order_relaxed);
+    while (iov_start < n && (size_t)w >= iov[iov_start].iov_len)
+      w -= iov[iov_start++].iov_len;
+    if (iov_start < n) {
+      iov[iov_start].iov_base = (char *)iov[iov_start].iov_base + w;
+      iov[iov_start].iov_len -= w;
+    }
+  }
+
+  uint64_t elapsed = monotonic_ns() - start_ns;
+  atomic_fetch_add_explicit(&lw->writes, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&lw->write_ns_total, elapsed,
+                            memory_order_relaxed);
+  if (elapsed > atomic_load_explicit(&lw->write_ns_max, memory_order_relaxed))
+    atomic_store_explicit(&lw->write_ns_max, elapsed, memory_order_relaxed);
+}
+
+void log_writer_rotate(log_writer *lw) {
+  if (lw->fd >= 0) {
+    if (lw->durability != LOG_DURABILITY_NONE)
+      fdatasync(lw->fd);
+    close(lw->fd);
+  }
+  lw->segment_index++;
+  lw->fd = binlog_open_segment(lw->segment_base, lw->segment_index,
+                               lw->segment_size);
+  if (lw->fd < 0)
+    atomic_fetch_add(&lw->write_errors, 1);
+}
+
+void *log_writer_main(void *arg) {
+  log_writer *lw = arg;
+  long long last_sync_ms = monotonic_ms();
+  int dirty = 0;
+
+  while (1) {
+    int got;
+    if (lw->durability == LOG_DURABILITY_PERIODIC) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += lw->sync_interval_ms / 1000;
+      deadline.tv_nsec += (lw->sync_interval_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      got = sem_timedwait(&lw->full_sem, &deadline) == 0;
+    } else {
+      got = sem_wait(&lw->full_sem) == 0;
+    }
+
+    // Group commit: take every block that is ready, not just one
+    int idx[LOG_BLOCK_COUNT];
+    struct iovec iov[LOG_BLOCK_COUNT];
+    int n = 0;
+    if (got) {
+      int b;
+      while (n < LOG_BLOCK_COUNT && (b = log_ring_pop(&lw->full)) >= 0) {
+        if (n > 0)
+          sem_trywait(&lw->full_sem); // Consume the matching post
+        idx[n] = b;
+        iov[n].iov_base = lw->blocks[b].data;
+        iov[n].iov_len = lw->blocks[b].len;
+        n++;
+      }
+    }
+
+    // Write up to and including each block that ends a segment, then roll
+    int start = 0;
+    for (int k = 0; k < n; k++) {
+      int end_segment = lw->blocks[idx[k]].end_segment;
+      if (k == n - 1 || end_segment) {
+        log_write_iov(lw, iov + start, k + 1 - start);
+        start = k + 1;
+      }
+      if (end_segment)
+        log_writer_rotate(lw);
+    }
+    if (n > 0)
+      dirty = 1;
+
+    if (dirty && (lw->durability == LOG_DURABILITY_SYNC ||
+                  (lw->durability == LOG_DURABILITY_PERIODIC &&
+                   monotonic_ms() - last_sync_ms >= lw->sync_interval_ms))) {
+      fdatasync(lw->fd);
+      last_sync_ms = monotonic_ms();
+      dirty = 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+      lw->blocks[idx[i]].len = 0;
+      lw->blocks[idx[i]].end_segment = 0;
+      log_ring_push(&lw->free, idx[i]);
+      sem_post(&lw->free_sem);
+    }
+    if (n > 0) {
+      atomic_fetch_add(&lw->written, n);
+      if (lw->durability == LOG_DURABILITY_SYNC)
+        sem_post(&lw->durable_sem);
+    }
+
+    if (atomic_load(&lw->stop) && log_ring_empty(&lw->full))
+      break;
+  }
+
+  if (lw->durability != LOG_DURABILITY_NONE)
+    fdatasync(lw->fd);
+  return NULL;
+}
+
+// Takes ownership of fd; log_writer_run() starts the writer thread.
+log_writer *log_writer_start(int fd, log_durability durability,
+                             int sync_interval_ms) {
+  log_writer *lw = calloc(1, sizeof(log_writer));
+  if (!lw) {
+    close(fd);
+    return NULL;
+  }
+  lw->blocks = tuning_alloc(LOG_BLOCK_COUNT * sizeof(log_block));
+  lw->fd = fd;
+  if (!lw->blocks) {
+    close(fd);
+    free(lw);
+    return NULL;
+  }
+  lw->durability = durability;
+  lw->sync_interval_ms = sync_interval_ms;
+  lw->current = -1;
+  sem_init(&lw->full_sem, 0, 0);
+  sem_init(&lw->free_sem, 0, LOG_BLOCK_COUNT);
+  sem_init(&lw->durable_sem, 0, 0);
+  for (int i = 0; i < LOG_BLOCK_COUNT; i++) {
+    lw->blocks[i].len = 0;
+    lw->blocks[i].end_segment = 0;
+    log_ring_push(&lw->free, i);
+  }
+  return lw;
+}
+
+// Starts the writer thread with SIGTERM/SIGINT blocked, so the signals
+// always interrupt the main thread.
+int log_writer_run(log_writer *lw) {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int err = pthread_create(&lw->thread, NULL, log_writer_main, lw);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    close(lw->fd);
+    tuning_free(lw->blocks, LOG_BLOCK_COUNT * sizeof(log_block));
+    free(lw);
+    return 0;
+  }
+  return 1;
+}
+
+// Text log: one file, appended to.
+log_writer *log_writer_open(const char *path, log_durability durability,
+                            int sync_interval_ms) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  off_t existing = fstat(fd, &st) == 0 ? st.st_size : 0;
+  log_writer *lw = log_writer_start(fd, durability, sync_interval_ms);
+  if (!lw)
+    return NULL;
+  lw->appended = existing;
+  return log_writer_run(lw) ? lw : NULL;
+}
+
+// Binary log: preallocated segments of segment_size bytes named after base.
+log_writer *log_writer_open_segmented(const char *base, uint64_t segment_size,
+                                      log_durability durability,
+                                      int sync_interval_ms) {
+  uint64_t index = binlog_next_index(base);
+  int fd = binlog_open_segment(base, index, segment_size);
+  if (fd < 0)
+    return NULL;
+  log_writer *lw = log_writer_start(fd, durability, sync_interval_ms);
+  if (!lw)
+    return NULL;
+  lw->segment_base = base;
+  lw->segment_size = segment_size;
+  lw->segment_index = index;
+  lw->segment_used = sizeof(binlog_segment_header);
+  return log_writer_run(lw) ? lw : NULL;
+}
+
+void log_writer_publish(log_writer *lw) {
+  log_ring_push(&lw->full, lw->current);
+  lw->current = -1;
+  lw->published++;
+  sem_post(&lw->full_sem);
+}
+
+// Returns the block being filled, waiting for the writer if every block is
+// in flight.
+log_block *log_writer_block(log_writer *lw) {
+  if (lw->current < 0) {
+    while (sem_wait(&lw->free_sem) < 0 && errno == EINTR)
+      ;
+    lw->current = log_ring_pop(&lw->free);
+  }
+  return &lw->blocks[lw->current];
+}
+
+// Appends raw bytes to the current block.
+void log_writer_append(log_writer *lw, const void *data, size_t len) {
+  while (len > 0) {
+    log_block *block = log_writer_block(lw);
+    size_t chunk = LOG_BLOCK_SIZE - block->len;
+    if (chunk > len)
+      chunk = len;
+    memcpy(block->data + block->len, data, chunk);
+    block->len += chunk;
+    data = (const char *)data + chunk;
+    len -= chunk;
+    lw->appended += chunk;
+    if (block->len == LOG_BLOCK_SIZE)
+      log_writer_publish(lw);
+  }
+}
+
+// Appends one binary record that must not be split across segments.
+void log_writer_append_record(log_writer *lw, const void *data, size_t len) {
+  if (lw->segment_size > 0) {
+    if (lw->segment_used + len > lw->segment_size) {
+      log_block *block = log_writer_block(lw);
+      block->end_segment = 1;
+      log_writer_publish(lw);
+      lw->segment_used = sizeof(binlog_segment_header);
+    }
+    lw->segment_used += len;
+  }
+  log_writer_append(lw, data, len);
+}
+
+// Formats one record into the current block.
+void log_writer_printf(log_writer *lw, const char *fmt, ...) {
+  log_block *block = log_writer_block(lw);
+  size_t avail = LOG_BLOCK_SIZE - block->len;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(block->data + block->len, avail, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if ((size_t)n >= avail) {
+    // Did not fit: hand over this block and format into a fresh one
+    log_writer_publish(lw);
+    block = log_writer_block(lw);
+    va_start(ap, fmt);
+    n = vsnprintf(block->data, LOG_BLOCK_SIZE, fmt, ap);
+    va_end(ap);
+    if (n >= LOG_BLOCK_SIZE)
+      n = LOG_BLOCK_SIZE - 1;
+  }
+  block->len += n;
+  lw->appended += n;
+}
+
+// Whether formatted records are waiting in the partially filled block.
+int log_writer_pending(log_writer *lw) {
+  return lw->current >= 0 && lw->blocks[lw->current].len > 0;
+}
+
+// Share of the blocks not queued for the writer thread (0-1): how much
+// more the log can take before the event loop would wait for the disk.
+double log_writer_headroom(log_writer *lw) {
+  uint32_t queued = atomic_load_explicit(&lw->full.tail, memory_order_acquire) -
+                    atomic_load_explicit(&lw->full.head, memory_order_acquire);
+  return 1.0 - (double)queued / LOG_BLOCK_COUNT;
+}
+
+// Called once per event-loop iteration. The partial block is handed over
+// only if the writer has nothing queued, so a slow disk makes blocks grow
+// instead of multiplying. In sync mode it also waits until everything
+// handed over is on disk.
+void log_writer_commit(log_writer *lw) {
+  if (log_writer_pending(lw) &&
+      (lw->durability == LOG_DURABILITY_SYNC || log_ring_empty(&lw->full)))
+    log_writer_publish(lw);
+
+  if (lw->durability == LOG_DURABILITY_SYNC) {
+    while (atomic_load(&lw->written) < lw->published)
+      sem_wait(&lw->durable_sem);
+  }
+}
+
+void log_writer_close(log_writer *lw) {
+  if (!lw)
+    return;
+  if (log_writer_pending(lw))
+    log_writer_publish(lw);
+  atomic_store(&lw->stop, 1);
+  sem_post(&lw->full_sem);
+  pthread_join(lw->thread, NULL);
+  close(lw->fd);
+  sem_destroy(&lw->full_sem);
+  sem_destroy(&lw->free_sem);
+  sem_destroy(&lw->durable_sem);
+  tuning_free(lw->blocks, LOG_BLOCK_COUNT * sizeof(log_block));
+  free(lw);
+}
+
+#endif // LOG_WRITER_H
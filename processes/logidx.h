@@ -0,0 +1,89 @@
+#ifndef LOGIDX_H
+#define LOGIDX_H
+
+#include "common.h"
+
+// --- Sparse log index ---
+// Alongside the text log P5 writes "<log>.idx": one entry per block of
+// LOGIDX_DEFAULT_EVERY records giving the block's byte offset in the log,
+// its time range and which PIDs occur in it. p5_logquery binary-searches
+// the entries by time and skips blocks that cannot hold the wanted PID.
+#define LOGIDX_SUFFIX ".idx"
+#define LOGIDX_DEFAULT_EVERY 1024
+
+typedef struct {
+  uint64_t offset; // Byte offset of the block's first record in the log
+  int64_t first_ts;
+  int64_t last_ts;
+  int32_t min_pid;
+  int32_t max_pid;
+  uint64_t pid_bloom; // Bit (pid % 64) set for every PID in the block
+  uint32_t records;
+  uint32_t reserved;
+} logidx_entry;
+
+typedef struct {
+  int fd;
+  uint32_t every;
+  logidx_entry cur;
+} logidx_builder;
+
+void logidx_path(char *out, size_t out_size, const char *log_filename) {
+  snprintf(out, out_size, "%s%s", log_filename, LOGIDX_SUFFIX);
+}
+
+int logidx_open(logidx_builder *b, const char *log_filename, uint32_t every) {
+  char path[4096];
+  logidx_path(path, sizeof(path), log_filename);
+  b->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  b->every = every;
+  b->cur.records = 0;
+  return b->fd >= 0;
+}
+
+// Writes out the current (possibly partial) block entry. Entries are small
+// and written once per block, so a plain write() is enough.
+void logidx_flush(logidx_builder *b) {
+  if (b->fd < 0 || b->cur.records == 0)
+    return;
+  if (write(b->fd, &b->cur, sizeof(b->cur)) != sizeof(b->cur))
+    perror("Process 5: Failed to write log index");
+  b->cur.records = 0;
+}
+
+// Registers a record about to be written at the given log offset.
+void logidx_add(logidx_builder *b, uint64_t offset, int64_t ts, int32_t pid) {
+  if (b->fd < 0)
+    return;
+  logidx_entry *e = &b->cur;
+  if (e->records == 0) {
+    memset(e, 0, sizeof(*e));
+    e->offset = offset;
+    e->first_ts = ts;
+    e->min_pid = pid;
+    e->max_pid = pid;
+  }
+  e->last_ts = ts;
+  if (pid < e->min_pid)
+    e->min_pid = pid;
+  if (pid > e->max_pid)
+    e->max_pid = pid;
+  e->pid_bloom |= 1ULL << ((uint32_t)pid % 64);
+  if (++e->records == b->every)
+    logidx_flush(b);
+}
+
+void logidx_close(logidx_builder *b) {
+  if (b->fd < 0)
+    return;
+  logidx_flush(b);
+  close(b->fd);
+  b->fd = -1;
+}
+
+int logidx_may_contain_pid(const logidx_entry *e, int32_t pid) {
+  return pid >= e->min_pid && pid <= e->max_pid &&
+         (e->pid_bloom & (1ULL << ((uint32_t)pid % 64)));
+}
+
+#endif // LOGIDX_H
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include "binlog.h"
+#include "common.h"
+#include "rawcap.h"
+#include "shm_ring.h"
+#include <sys/mman.h>
+
+// Converts a binary Process 5 log (all "<log>.<index>.bin" segments) or a
+// raw capture (-f raw) back to the text format Process 5 writes by default.
+
+void write_line(FILE *out, const binlog_record *rec, const char *str) {
+  char line[SOCK_MSG_MAX_LEN + 64];
+  int n = binlog_format_text(rec, str, line, sizeof(line));
+  fwrite(line, 1, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1, out);
+}
+
+int convert_segment(const char *path, FILE *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      st.st_size < (off_t)sizeof(binlog_segment_header)) {
+    fprintf(stderr, "%s: Not a Process 5 log segment\n", path);
+    close(fd);
+    return 0;
+  }
+  unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return 0;
+  }
+
+  binlog_segment_header hdr;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (hdr.magic != BINLOG_MAGIC || hdr.version != BINLOG_VERSION) {
+    fprintf(stderr, "%s: Not a Process 5 log segment\n", path);
+    munmap(data, st.st_size);
+    return 0;
+  }
+
+  size_t offset = sizeof(hdr);
+  while (offset + sizeof(binlog_record) <= (size_t)st.st_size) {
+    binlog_record rec;
+    memcpy(&rec, data + offset, sizeof(rec));
+    if (rec.channel == 0)
+      break; // Unused, preallocated tail
+    size_t rec_size = binlog_record_size(&rec);
+    if (offset + rec_size > (size_t)st.st_size)
+      break;
+    write_line(out, &rec, (const char *)data + offset + sizeof(rec));
+    offset += rec_size;
+  }
+
+  munmap(data, st.st_size);
+  return 1;
+}
+
+// Reassembly state for one captured P4 connection.
+typedef struct {
+  uint32_t stream;
+  size_t len;
+  char buf[SOCK_FRAME_MAX];
+} capture_stream;
+
+capture_stream *find_stream(capture_stream **streams, size_t *count,
+                            uint32_t stream) {
+  for (size_t i = 0; i < *count; i++)
+    if ((*streams)[i].stream == stream)
+      return &(*streams)[i];
+  capture_stream *grown = realloc(*streams, (*count + 1) * sizeof(**streams));
+  if (!grown)
+    return NULL;
+  *streams = grown;
+  capture_stream *s = &grown[(*count)++];
+  s->stream = stream;
+  s->len = 0;
+  return s;
+}
+
+// Emits the complete frames buffered for a connection and keeps the rest.
+// Returns 0 on a malformed frame, which P5 would have closed the
+// connection for.
+int flush_frames(capture_stream *s, uint64_t timestamp_ns, FILE *out) {
+  size_t off = 0;
+  while (s->len - off >= sizeof(sock_frame_header)) {
+    sock_frame_header fh;
+    memcpy(&fh, s->buf + off, sizeof(fh));
+    if (fh.len > SOCK_MSG_MAX_LEN)
+      return 0;
+    if (s->len - off < sizeof(fh) + fh.len)
+      break;
+    binlog_record rec = {4, BINLOG_STRING, fh.len, fh.source_pid,
+                         timestamp_ns, {0}};
+    write_line(out, &rec, s->buf + off + sizeof(fh));
+    off += sizeof(fh) + fh.len;
+  }
+  memmove(s->buf, s->buf + off, s->len - off);
+  s->len -= off;
+  return 1;
+}
+
+void convert_shm(const unsigned char *data, uint32_t len, uint64_t ts,
+                 FILE *out) {
+  shm_ring_slot slot;
+  memset(&slot, 0, sizeof(slot));
+  memcpy(&slot, data, len < sizeof(slot) ? len : sizeof(slot));
+  binlog_record rec = {slot.channel, 0, 0, slot.source_pid, ts, {0}};
+  switch (slot.channel) {
+  case SHM_CH_P2:
+    rec.type = BINLOG_INT;
+    rec.value.i = slot.value.i;
+    break;
+  case SHM_CH_P3:
+    rec.type = BINLOG_DOUBLE;
+    rec.value.d = slot.value.d;
+    break;
+  case SHM_CH_P4:
+    rec.type = BINLOG_STRING;
+    rec.len = slot.len > SOCK_MSG_MAX_LEN ? SOCK_MSG_MAX_LEN : slot.len;
+    break;
+  default:
+    return;
+  }
+  write_line(out, &rec, slot.value.s);
+}
+
+// Replays a capture chunk by chunk. Lines carry the time a chunk was
+// captured, which is when P5 would have logged its messages.
+int convert_capture(const char *path, FILE *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return 0;
+  }
+  unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return 0;
+  }
+
+  // FIFO P2 is one byte stream, so a record may span two chunks
+  unsigned char carry[sizeof(fifo_msg_int)];
+  size_t carry_len = 0;
+  capture_stream *streams = NULL;
+  size_t stream_count = 0;
+  int ok = 1;
+  size_t offset = sizeof(rawcap_file_header);
+  while (offset + sizeof(rawcap_chunk) <= (size_t)st.st_size) {
+    rawcap_chunk chunk;
+    memcpy(&chunk, data + offset, sizeof(chunk));
+    offset += sizeof(chunk);
+    if (chunk.len > (size_t)st.st_size - offset) {
+      fprintf(stderr, "%s: Truncated chunk at offset %zu\n", path, offset);
+      ok = 0;
+      break;
+    }
+    const unsigned char *payload = data + offset;
+    offset += chunk.len;
+
+    switch (chunk.kind) {
+    case RAWCAP_FIFO_P2:
+      for (uint32_t i = 0; i < chunk.len;) {
+        size_t take = sizeof(carry) - carry_len;
+        if (take > chunk.len - i)
+          take = chunk.len - i;
+        memcpy(carry + carry_len, payload + i, take);
+        carry_len += take;
+        i += take;
+        if (carry_len < sizeof(carry))
+          break;
+        fifo_msg_int msg;
+        memcpy(&msg, carry, sizeof(msg));
+        binlog_record rec = {2, BINLOG_INT, 0, msg.source_pid,
+                             chunk.timestamp_ns, {.i = msg.value}};
+        write_line(out, &rec, NULL);
+        carry_len = 0;
+      }
+      break;
+    case RAWCAP_MQ_P3: {
+      mq_msg_float msg;
+      if (chunk.len < sizeof(msg))
+        break; // P5 skips short messages as well
+      memcpy(&msg, payload, sizeof(msg));
+      binlog_record rec = {3, BINLOG_DOUBLE, 0, msg.source_pid,
+                           chunk.timestamp_ns, {.d = msg.value}};
+      write_line(out, &rec, NULL);
+      break;
+    }
+    case RAWCAP_SHM:
+      convert_shm(payload, chunk.len, chunk.timestamp_ns, out);
+      break;
+    case RAWCAP_SOCK_P4: {
+      capture_stream *s = find_stream(&streams, &stream_count, chunk.stream);
+      if (!s) {
+        perror("Failed to track connection");
+        ok = 0;
+        break;
+      }
+      for (uint32_t i = 0; i < chunk.len;) {
+        size_t take = sizeof(s->buf) - s->len;
+        if (take > chunk.len - i)
+          take = chunk.len - i;
+        memcpy(s->buf + s->len, payload + i, take);
+        s->len += take;
+        i += take;
+        if (!flush_frames(s, chunk.timestamp_ns, out)) {
+          fprintf(stderr, "%s: Malformed frame on connection %u\n", path,
+                  chunk.stream);
+          s->len = 0;
+          break;
+        }
+      }
+      if (chunk.len == 0)
+        s->len = 0; // Connection closed; a partial frame was lost with it
+      break;
+    }
+    default:
+      fprintf(stderr, "%s: Unknown chunk kind %u\n", path, chunk.kind);
+      break;
+    }
+  }
+
+  free(streams);
+  munmap(data, st.st_size);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s <log_filename> [text_output]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *out = stdout;
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (!out) {
+      perror("Failed to open output file");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (rawcap_detect(argv[1])) {
+    int ok = convert_capture(argv[1], out);
+    if (out != stdout)
+      fclose(out);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  uint64_t count = binlog_next_index(argv[1]);
+  if (count == 0) {
+    fprintf(stderr, "No segments found for %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  char path[4096];
+  int ok = 1;
+  for (uint64_t i = 0; i < count; i++) {
+    binlog_segment_path(path, sizeof(path), argv[1], i);
+    ok &= convert_segment(path, out);
+  }
+
+  if (out != stdout)
+    fclose(out);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
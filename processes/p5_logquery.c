@@ -0,0 +1,247 @@
+#include "common.h"
+#include "logidx.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// Finds Process 5 text log lines by producer PID and/or time window. The
+// sparse index written by P5 narrows the search to the relevant blocks,
+// which are then scanned in parallel over an mmap of the log.
+
+#define QUERY_CHUNK_SIZE (4 << 20) // Unindexed ranges are split this finely
+
+typedef struct {
+  uint64_t start, end;
+  char *out; // Matching lines, printed in chunk order
+  size_t out_len, out_cap;
+} query_chunk;
+
+const char *log_data;
+uint64_t log_size;
+int32_t want_pid = -1;
+int64_t from_ts = INT64_MIN, to_ts = INT64_MAX;
+
+query_chunk *chunks = NULL;
+int chunk_count = 0, chunk_cap = 0;
+_Atomic int next_chunk = 0;
+
+void add_chunk(uint64_t start, uint64_t end) {
+  if (chunk_count == chunk_cap) {
+    chunk_cap = chunk_cap ? chunk_cap * 2 : 64;
+    chunks = realloc(chunks, chunk_cap * sizeof(query_chunk));
+  }
+  query_chunk *c = &chunks[chunk_count++];
+  memset(c, 0, sizeof(*c));
+  c->start = start;
+  c->end = end;
+}
+
+// Adds [start, end) as chunks that each begin at a line start.
+void add_range(uint64_t start, uint64_t end) {
+  if (end > log_size)
+    end = log_size;
+  while (start < end) {
+    uint64_t stop = start + QUERY_CHUNK_SIZE;
+    if (stop >= end) {
+      stop = end;
+    } else {
+      const char *nl = memchr(log_data + stop, '\n', end - stop);
+      stop = nl ? (uint64_t)(nl - log_data) + 1 : end;
+    }
+    add_chunk(start, stop);
+    start = stop;
+  }
+}
+
+// Parses "[<ts>] P<n>(<pid>): ..." within [p, end).
+int parse_line(const char *p, const char *end, int64_t *ts, int32_t *pid) {
+  if (p >= end || *p++ != '[')
+    return 0;
+  int64_t t = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    t = t * 10 + (*p++ - '0');
+  while (p < end && *p != '(')
+    p++;
+  if (p >= end)
+    return 0;
+  p++;
+  int32_t v = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    v = v * 10 + (*p++ - '0');
+  *ts = t;
+  *pid = v;
+  return 1;
+}
+
+void scan_chunk(query_chunk *c) {
+  const char *p = log_data + c->start;
+  const char *end = log_data + c->end;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *line_end = nl ? nl + 1 : end;
+    int64_t ts;
+    int32_t pid;
+    if (parse_line(p, line_end, &ts, &pid) && ts >= from_ts && ts <= to_ts &&
+        (want_pid < 0 || pid == want_pid)) {
+      size_t len = line_end - p;
+      if (c->out_len + len > c->out_cap) {
+        c->out_cap = (c->out_len + len) * 2;
+        c->out = realloc(c->out, c->out_cap);
+      }
+      memcpy(c->out + c->out_len, p, len);
+      c->out_len += len;
+    }
+    p = line_end;
+  }
+}
+
+void *scan_worker(void *arg) {
+  int i;
+  while ((i = atomic_fetch_add(&next_chunk, 1)) < chunk_count)
+    scan_chunk(&chunks[i]);
+  return NULL;
+}
+
+// Index of the first entry whose block may end at or after from_ts.
+size_t first_block(logidx_entry *e, size_t n) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (e[mid].last_ts < from_ts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Index of the first entry whose block starts after to_ts.
+size_t end_block(logidx_entry *e, size_t n) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (e[mid].first_ts <= to_ts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+logidx_entry *load_index(const char *log_filename, size_t *count) {
+  char path[4096];
+  logidx_path(path, sizeof(path), log_filename);
+  *count = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  logidx_entry *entries = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(logidx_entry)) {
+    *count = st.st_size / sizeof(logidx_entry);
+    entries = malloc(*count * sizeof(logidx_entry));
+    if (read(fd, entries, *count * sizeof(logidx_entry)) !=
+        (ssize_t)(*count * sizeof(logidx_entry))) {
+      free(entries);
+      entries = NULL;
+      *count = 0;
+    }
+  }
+  close(fd);
+  return entries;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt, usage_error = 0;
+  while ((opt = getopt(argc, argv, "p:f:t:j:")) != -1) {
+    switch (opt) {
+    case 'p':
+      want_pid = atoi(optarg);
+      break;
+    case 'f':
+      from_ts = atoll(optarg);
+      break;
+    case 't':
+      to_ts = atoll(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      usage_error |= threads < 1;
+      break;
+    default:
+      usage_error = 1;
+    }
+  }
+  if (usage_error || optind != argc - 1) {
+    fprintf(stderr,
+            "Usage: %s [-p pid] [-f from_ts] [-t to_ts] [-j threads] "
+            "<log_filename>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *log_filename = argv[optind];
+  if (threads < 1)
+    threads = 1;
+
+  int fd = open(log_filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(log_filename);
+    return EXIT_FAILURE;
+  }
+  log_size = st.st_size;
+  if (log_size == 0)
+    return EXIT_SUCCESS;
+  log_data = mmap(NULL, log_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (log_data == MAP_FAILED) {
+    perror(log_filename);
+    return EXIT_FAILURE;
+  }
+  madvise((void *)log_data, log_size, MADV_WILLNEED);
+
+  size_t n;
+  logidx_entry *entries = load_index(log_filename, &n);
+  size_t selected = 0;
+  if (n == 0) {
+    add_range(0, log_size); // No index: scan everything
+  } else {
+    // Lines written before the index existed
+    add_range(0, entries[0].offset);
+    size_t lo = first_block(entries, n), hi = end_block(entries, n);
+    for (size_t i = lo; i < hi && i < n - 1; i++) {
+      if (want_pid >= 0 && !logidx_may_contain_pid(&entries[i], want_pid))
+        continue;
+      add_range(entries[i].offset, entries[i + 1].offset);
+      selected++;
+    }
+    // The last block runs to the end of the file, including records that
+    // are not indexed yet, so it is always scanned
+    if (entries[n - 1].offset < log_size) {
+      add_range(entries[n - 1].offset, log_size);
+      selected++;
+    }
+  }
+
+  pthread_t *tids = malloc(threads * sizeof(pthread_t));
+  for (int i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, scan_worker, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_join(tids[i], NULL);
+
+  for (int i = 0; i < chunk_count; i++) {
+    fwrite(chunks[i].out, 1, chunks[i].out_len, stdout);
+    free(chunks[i].out);
+  }
+  fprintf(stderr,
+          "[p5_logquery] %zu of %zu indexed blocks scanned, %d threads\n",
+          selected, n, threads);
+
+  free(tids);
+  free(chunks);
+  free(entries);
+  munmap((void *)log_data, log_size);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+#ifndef P5_STATS_H
+#define P5_STATS_H
+
+#include "common.h"
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// --- Process 5 stats page ---
+// P5 publishes its counters in a shared-memory page that anyone can map
+// read-only (Process 1 renders it in its menu). P5 is the only writer, so
+// counters are updated with relaxed loads and stores, no read-modify-write
+// and no locks; readers derive rates from two snapshots.
+#define P5_STATS_SHM "/p5_stats"
+#define P5_STATS_MAGIC 0x53543550 // "P5TS"
+#define P5_STATS_VERSION 2
+
+// Inbound transports, as P5 counts them
+enum {
+  P5_CH_FIFO_P2,
+  P5_CH_MQ_P3,
+  P5_CH_SOCK_P4,
+  P5_CH_SHM_P2,
+  P5_CH_SHM_P3,
+  P5_CH_SHM_P4,
+  P5_CH_VIA_FIFO, // Shared transports (transport.h), in XPORT_* order
+  P5_CH_VIA_MQ,
+  P5_CH_VIA_STREAM,
+  P5_CH_VIA_SEQPACKET,
+  P5_CHANNELS
+};
+const char *p5_channel_names[P5_CHANNELS] = {
+    "P2 fifo", "P3 mqueue", "P4 socket",  "P2 shm",    "P3 shm",
+    "P4 shm",  "via fifo",  "via mqueue", "via stream", "via seqpkt"};
+
+typedef struct {
+  _Atomic uint64_t messages;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t lost;        // Gaps in the producers' sequence numbers
+  _Atomic uint64_t queue_depth; // Backlog in messages when last serviced
+} p5_channel_stats;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t p5_pid;
+  uint32_t reserved;
+  _Atomic uint64_t updated_ns; // CLOCK_MONOTONIC of the last publish
+  _Atomic uint64_t clients;    // Connected P4 sockets
+  _Atomic uint64_t log_bytes;
+  _Atomic uint64_t log_writes;
+  _Atomic uint64_t log_write_ns_total;
+  _Atomic uint64_t log_write_ns_max;
+  _Atomic uint64_t log_errors;
+  p5_channel_stats ch[P5_CHANNELS];
+} p5_stats_page;
+
+// Single-writer increment: a plain load and store, never a locked RMW
+void p5_stat_add(_Atomic uint64_t *field, uint64_t n) {
+  uint64_t v = atomic_load_explicit(field, memory_order_relaxed);
+  atomic_store_explicit(field, v + n, memory_order_relaxed);
+}
+
+void p5_stat_set(_Atomic uint64_t *field, uint64_t v) {
+  atomic_store_explicit(field, v, memory_order_relaxed);
+}
+
+uint64_t p5_stat_get(const _Atomic uint64_t *field) {
+  return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+// P5: creates a fresh, zeroed page. Returns NULL on failure.
+p5_stats_page *p5_stats_create() {
+  shm_unlink(P5_STATS_SHM);
+  int fd = shm_open(P5_STATS_SHM, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return NULL;
+  if (ftruncate(fd, sizeof(p5_stats_page)) < 0) {
+    close(fd);
+    return NULL;
+  }
+  p5_stats_page *page = mmap(NULL, sizeof(p5_stats_page),
+                             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED)
+    return NULL;
+  page->magic = P5_STATS_MAGIC;
+  page->version = P5_STATS_VERSION;
+  page->p5_pid = getpid();
+  return page;
+}
+
+// Readers: maps the page read-only, NULL if P5 has not published one.
+const p5_stats_page *p5_stats_map() {
+  int fd = shm_open(P5_STATS_SHM, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  const p5_stats_page *page = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(p5_stats_page)) {
+    page = mmap(NULL, sizeof(p5_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED || page->magic != P5_STATS_MAGIC ||
+        page->version != P5_STATS_VERSION) {
+      if (page != MAP_FAILED)
+        munmap((void *)page, sizeof(p5_stats_page));
+      page = NULL;
+    }
+  }
+  close(fd);
+  return page;
+}
+
+void p5_stats_unmap(const p5_stats_page *page) {
+  if (page)
+    munmap((void *)page, sizeof(p5_stats_page));
+}
+
+#endif // P5_STATS_H
@@ -1,44 +1,344 @@
+#define _GNU_SOURCE // sched_setaffinity (tuning.h)
 #include "common.h"
+#include "console.h"
+#include "credits.h"
+#include "p5_stats.h"
+#include "transport.h"
+#include "tuning.h"
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/wait.h>
 
-pid_t pids[6] = {
-    0}; // pids[0] unused, pids[1] unused, pids[2-4] for P2-P4, pids[5] for P5
-int running_status[6] = {0}; // 0=stopped, 1=running
+// --- Process table ---
+// P5 plus any number of producer instances. Each entry keeps its launch
+// settings so a crashed child can be restarted as it was.
+typedef struct {
+  pid_t pid; // 0 while not running
+  int process_num; // 2-4, or 5 for P5
+  int fg_color, bg_color, delay_ms;
+  char transport[8];  // "" = the producer's default channel
+  char via[12];       // Shared transport backend (--via), "" = none
+  char gen_spec[128]; // "" = interactive, reads the terminal
+  char credits[16];   // Flow control policy for generated load, "" = none
+  char console[24];   // Console mode, "" = the child's default
+  launch_tuning tuning; // Applied by the child itself (see tuning.h)
+  long long started_ms;
+} child_entry;
+
+child_entry p5_child = {0, 5};
+child_entry *children = NULL; // Producers
+int child_count = 0, child_cap = 0;
 
 char p5_log_filename[256] = "process5_log.txt";
+int auto_restart = 0; // -r: restart children that die unexpectedly
+
+#define READY_TIMEOUT_MS 5000
+#define MIN_RESTART_UPTIME_MS 1000 // Dying faster than this is a crash loop
+#define MENU_REFRESH_MS 2000
+
+void handle_sigchld(int sig) { notify_signal_pipe(); }
+
+child_entry *add_child(int process_num) {
+  if (child_count == child_cap) {
+    int new_cap = child_cap ? child_cap * 2 : 16;
+    child_entry *grown = realloc(children, new_cap * sizeof(child_entry));
+    if (!grown)
+      return NULL;
+    children = grown;
+    child_cap = new_cap;
+  }
+  child_entry *e = &children[child_count++];
+  memset(e, 0, sizeof(*e));
+  e->process_num = process_num;
+  e->fg_color = 7;
+  return e;
+}
+
+void remove_child(int i) { children[i] = children[--child_count]; }
+
+int count_running(int process_num) {
+  int n = 0;
+  for (int i = 0; i < child_count; i++)
+    n += children[i].process_num == process_num && children[i].pid != 0;
+  return n;
+}
+
+// P5's stats page and the previous reading, from which rates are derived
+const p5_stats_page *p5_stats = NULL;
+uint64_t prev_messages[P5_CHANNELS], prev_bytes[P5_CHANNELS];
+long long prev_stats_ns = 0;
+
+void display_p5_stats() {
+  if (p5_stats && p5_stats->p5_pid != p5_child.pid) {
+    p5_stats_unmap(p5_stats); // P5 was restarted or stopped
+    p5_stats = NULL;
+  }
+  if (!p5_stats && p5_child.pid != 0) {
+    p5_stats = p5_stats_map();
+    prev_stats_ns = 0;
+    if (p5_stats && p5_stats->p5_pid != p5_child.pid) {
+      p5_stats_unmap(p5_stats); // Left over from another P5
+      p5_stats = NULL;
+    }
+  }
+  if (!p5_stats)
+    return;
+
+  long long now_ns = monotonic_ns();
+  double dt = prev_stats_ns ? (now_ns - prev_stats_ns) / 1e9 : 0;
+  int stale = now_ns - (long long)p5_stat_get(&p5_stats->updated_ns) >
+              2000000000LL;
+  printf("--- Process 5 Stats%s ---\n", stale ? " (not updating)" : "");
+  printf("%-10s %12s %10s %12s %8s %6s\n", "Channel", "Messages", "msg/s",
+         "bytes/s", "Lost", "Depth");
+  for (int i = 0; i < P5_CHANNELS; i++) {
+    const p5_channel_stats *ch = &p5_stats->ch[i];
+    uint64_t messages = p5_stat_get(&ch->messages);
+    uint64_t bytes = p5_stat_get(&ch->bytes);
+    if (messages > 0)
+      printf("%-10s %12llu %10.0f %12.0f %8llu %6llu\n", p5_channel_names[i],
+             (unsigned long long)messages,
+             dt > 0 ? (messages - prev_messages[i]) / dt : 0.0,
+             dt > 0 ? (bytes - prev_bytes[i]) / dt : 0.0,
+             (unsigned long long)p5_stat_get(&ch->lost),
+             (unsigned long long)p5_stat_get(&ch->queue_depth));
+    prev_messages[i] = messages;
+    prev_bytes[i] = bytes;
+  }
+  uint64_t writes = p5_stat_get(&p5_stats->log_writes);
+  printf("P4 clients: %llu | Log: %.1f MB in %llu writes, avg %.1f us, "
+         "max %.1f us, %llu errors\n",
+         (unsigned long long)p5_stat_get(&p5_stats->clients),
+         p5_stat_get(&p5_stats->log_bytes) / 1e6, (unsigned long long)writes,
+         writes ? p5_stat_get(&p5_stats->log_write_ns_total) / 1e3 / writes
+                : 0.0,
+         p5_stat_get(&p5_stats->log_write_ns_max) / 1e3,
+         (unsigned long long)p5_stat_get(&p5_stats->log_errors));
+  prev_stats_ns = now_ns;
+}
+
+// P5's credit page, listing the producers under flow control
+const credit_page *p5_credits = NULL;
+
+void display_credits() {
+  if (p5_credits && p5_credits->p5_pid != p5_child.pid) {
+    credit_page_unmap(p5_credits);
+    p5_credits = NULL;
+  }
+  if (!p5_credits && p5_child.pid != 0) {
+    p5_credits = credit_page_map(0);
+    if (p5_credits && p5_credits->p5_pid != p5_child.pid) {
+      credit_page_unmap(p5_credits);
+      p5_credits = NULL;
+    }
+  }
+  if (!p5_credits)
+    return;
+
+  int shown = 0;
+  for (int i = 0; i < CREDIT_SLOTS; i++) {
+    const credit_slot *s = &p5_credits->slots[i];
+    pid_t pid = atomic_load(&s->pid);
+    if (pid == 0 || (kill(pid, 0) < 0 && errno == ESRCH))
+      continue;
+    if (!shown++) {
+      printf("--- Credits (window %u) ---\n", atomic_load(&p5_credits->window));
+      printf("%-10s %-11s %9s %8s %9s %10s %10s %10s\n", "Producer",
+             "Policy", "In flight", "Waits", "Waited ms", "Coalesced",
+             "Sampled", "Dropped");
+    }
+    uint64_t sent = p5_stat_get(&s->sent);
+    uint64_t delivered = p5_stat_get(&s->delivered);
+    char who[16];
+    snprintf(who, sizeof(who), "P%d %d", s->channel, pid);
+    printf("%-10s %-11s %9llu %8llu %9.1f %10llu %10llu %10llu\n", who,
+           s->policy < CREDIT_POLICIES ? credit_policy_names[s->policy] : "?",
+           (unsigned long long)(sent > delivered ? sent - delivered : 0),
+           (unsigned long long)p5_stat_get(&s->waits),
+           p5_stat_get(&s->wait_ns) / 1e6,
+           (unsigned long long)p5_stat_get(&s->coalesced),
+           (unsigned long long)p5_stat_get(&s->sampled),
+           (unsigned long long)p5_stat_get(&s->dropped));
+  }
+}
+
+// Forks and execs the entry's program with the write end of a readiness
+// pipe (see notify_ready() in common.h). Returns the read end, or -1.
+int spawn_child(child_entry *e) {
+  char exe[20], fg_str[12], bg_str[12], delay_str[12];
+  char *args[16];
+  int argc = 0;
+  if (e->process_num == 5) {
+    args[argc++] = "./process5";
+    if (e->console[0]) {
+      args[argc++] = "-o";
+      args[argc++] = e->console;
+    }
+    args[argc++] = p5_log_filename;
+  } else {
+    snprintf(exe, sizeof(exe), "./process%d", e->process_num);
+    snprintf(fg_str, sizeof(fg_str), "%d", e->fg_color);
+    snprintf(bg_str, sizeof(bg_str), "%d", e->bg_color);
+    snprintf(delay_str, sizeof(delay_str), "%d", e->delay_ms);
+    args[argc++] = exe;
+    args[argc++] = fg_str;
+    args[argc++] = bg_str;
+    args[argc++] = delay_str;
+    if (e->transport[0])
+      args[argc++] = e->transport;
+    if (e->via[0]) {
+      args[argc++] = "--via";
+      args[argc++] = e->via;
+    }
+    if (e->gen_spec[0]) {
+      args[argc++] = "--gen";
+      args[argc++] = e->gen_spec;
+    }
+    if (e->credits[0]) {
+      args[argc++] = "--credits";
+      args[argc++] = e->credits;
+    }
+    if (e->console[0]) {
+      args[argc++] = "--console";
+      args[argc++] = e->console;
+    }
+  }
+  args[argc] = NULL;
+
+  int ready_pipe[2];
+  if (pipe(ready_pipe) < 0) {
+    perror("Failed to create readiness pipe");
+    return -1;
+  }
+  fcntl(ready_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(ready_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Failed to fork child process");
+    close(ready_pipe[0]);
+    close(ready_pipe[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    char fd_str[16];
+    // dup() drops FD_CLOEXEC, so only this descriptor survives the exec
+    snprintf(fd_str, sizeof(fd_str), "%d", dup(ready_pipe[1]));
+    setenv(READY_FD_ENV, fd_str, 1);
+    char tuning_str[128];
+    tuning_format(&e->tuning, tuning_str, sizeof(tuning_str));
+    if (tuning_str[0])
+      setenv(TUNING_ENV, tuning_str, 1);
+    else
+      unsetenv(TUNING_ENV);
+    execvp(args[0], args);
+    perror("Failed to exec child process");
+    exit(EXIT_FAILURE);
+  }
+  close(ready_pipe[1]);
+  e->pid = pid;
+  e->started_ms = monotonic_ms();
+  return ready_pipe[0];
+}
+
+// Waits until every child in entries[] with a valid fds[] entry reports
+// ready, exits, or READY_TIMEOUT_MS passes. Children that are not ready by
+// then are stopped and get pid 0.
+void await_ready(child_entry **entries, int *fds, int n) {
+  struct pollfd *pfds = calloc(n, sizeof(struct pollfd));
+  int waiting = 0;
+  for (int i = 0; i < n; i++) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLIN;
+    waiting += fds[i] >= 0;
+  }
+
+  long long deadline = monotonic_ms() + READY_TIMEOUT_MS;
+  while (waiting > 0) {
+    long long left = deadline - monotonic_ms();
+    if (left <= 0)
+      break;
+    int r = poll(pfds, n, (int)left);
+    if (r < 0 && errno == EINTR)
+      continue; // SIGCHLD, handled by the menu loop
+    if (r <= 0)
+      break;
+    for (int i = 0; i < n; i++) {
+      if (pfds[i].fd < 0 || !pfds[i].revents)
+        continue;
+      char byte;
+      if (read(pfds[i].fd, &byte, 1) != 1) {
+        printf("Process %d exited during startup.\n", entries[i]->process_num);
+        kill(entries[i]->pid, SIGTERM);
+        waitpid(entries[i]->pid, NULL, 0);
+        entries[i]->pid = 0;
+      }
+      close(pfds[i].fd);
+      pfds[i].fd = -1;
+      waiting--;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (pfds[i].fd < 0)
+      continue;
+    printf("Process %d (PID: %d) did not report ready within %d ms; "
+           "stopping it.\n",
+           entries[i]->process_num, entries[i]->pid, READY_TIMEOUT_MS);
+    close(pfds[i].fd);
+    kill(entries[i]->pid, SIGTERM);
+    waitpid(entries[i]->pid, NULL, 0);
+    entries[i]->pid = 0;
+  }
+  free(pfds);
+}
 
 void ensure_p5_started() {
-  if (pids[5] == 0) {
+  if (p5_child.pid == 0) {
     printf("Starting Process 5 (Logging Process)...\n");
+    child_entry *e = &p5_child;
+    int fd = spawn_child(e);
+    if (fd < 0)
+      return;
+    await_ready(&e, &fd, 1);
+    if (p5_child.pid != 0)
+      printf("Process 5 ready with PID: %d (%lld ms)\n", p5_child.pid,
+             monotonic_ms() - p5_child.started_ms);
+  }
+}
 
-    pids[5] = fork();
-    if (pids[5] < 0) {
-      perror("Failed to fork Process 5");
-      pids[5] = 0; // Reset PID
-    } else if (pids[5] == 0) {
-      char *args[] = {"./process5", p5_log_filename, NULL};
-      execvp("./process5", args);
-      perror("Failed to exec Process 5");
-      exit(EXIT_FAILURE);
-    } else {
-      printf("Process 5 started with PID: %d\n", pids[5]);
-      running_status[5] = 1;
-      printf("Waiting for Process 5 to initialize...\n");
-      sleep(2);
-    }
+// Starts children[first .. first + count) all at once, then waits for them
+// to become ready together. Entries that fail to start are removed.
+void launch_children(int first, int count) {
+  child_entry **entries = malloc(count * sizeof(child_entry *));
+  int *fds = malloc(count * sizeof(int));
+  long long start_ms = monotonic_ms();
+  for (int i = 0; i < count; i++) {
+    entries[i] = &children[first + i];
+    fds[i] = spawn_child(entries[i]);
+  }
+  await_ready(entries, fds, count);
+
+  int ready = 0;
+  for (int i = count - 1; i >= 0; i--) {
+    if (children[first + i].pid != 0)
+      ready++;
+    else
+      remove_child(first + i);
   }
+  printf("%d of %d instance(s) ready in %lld ms\n", ready, count,
+         monotonic_ms() - start_ms);
+  free(entries);
+  free(fds);
 }
 
 void try_stop_p5() {
-  if (pids[5] != 0 && running_status[2] == 0 && running_status[3] == 0 &&
-      running_status[4] == 0) {
-    printf("Stopping Process 5 (PID: %d)...\n", pids[5]);
-    if (kill(pids[5], SIGTERM) == 0) {
+  if (p5_child.pid != 0 && child_count == 0) {
+    printf("Stopping Process 5 (PID: %d)...\n", p5_child.pid);
+    if (kill(p5_child.pid, SIGTERM) == 0) {
       int status;
-      waitpid(pids[5], &status, 0);
+      waitpid(p5_child.pid, &status, 0);
       printf("Process 5 terminated.\n");
     } else {
       if (errno == ESRCH) {
@@ -47,19 +347,196 @@ void try_stop_p5() {
         perror("Failed to send SIGTERM to Process 5");
       }
     }
-    pids[5] = 0;
-    running_status[5] = 0;
+    p5_child.pid = 0;
+  }
+}
+
+// Reaps every child that has exited as soon as SIGCHLD arrives and, with
+// -r, restarts the ones that died unexpectedly.
+void reap_children() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    child_entry *e = &p5_child;
+    int i = -1;
+    if (pid != p5_child.pid) {
+      for (i = 0; i < child_count && children[i].pid != pid; i++)
+        ;
+      if (i == child_count)
+        continue;
+      e = &children[i];
+    }
+    e->pid = 0;
+    if (WIFSIGNALED(status))
+      printf("\nProcess %d (PID: %d) was killed by signal %d.\n",
+             e->process_num, pid, WTERMSIG(status));
+    else
+      printf("\nProcess %d (PID: %d) exited with status %d.\n",
+             e->process_num, pid, WEXITSTATUS(status));
+
+    int crashed = WIFSIGNALED(status) || WEXITSTATUS(status) != 0;
+    int restart = auto_restart && crashed;
+    if (restart && monotonic_ms() - e->started_ms < MIN_RESTART_UPTIME_MS) {
+      printf("Process %d died within %d ms of starting; not restarting.\n",
+             e->process_num, MIN_RESTART_UPTIME_MS);
+      restart = 0;
+    }
+    if (i < 0) {
+      if (restart) {
+        printf("Restarting Process 5...\n");
+        ensure_p5_started();
+      }
+    } else if (restart && p5_child.pid != 0) {
+      printf("Restarting Process %d...\n", e->process_num);
+      launch_children(i, 1);
+    } else {
+      remove_child(i);
+    }
   }
 }
 
+// Parses one topology entry and adds its instances to the table:
+//   <count> <p2|p3|p4> [transport=<name>] [via=<backend>] [gen=<spec>]
+//   [credits=<policy>] [console=<mode>] [fg=<0-7>] [bg=<0-7>]
+//   [delay=<ms>] [<tuning>]
+//   1 p5 [console=<mode>] <tuning>
+// where <tuning> is [cpus=<list>] [rt=<1-99>] [mlock=1] [hugepages=1]
+// (see tuning.h) and <mode> a console mode (see console.h). e.g.
+// "8 p2 gen=rate=10000", "4 p4 transport=shm gen=rate=max", "2 p3
+// via=seqpacket gen=rate=max cpus=1" or "1 p5 console=summary cpus=0".
+// Returns the number of instances added, or -1 on a syntax error.
+int add_topology_entry(char *entry) {
+  char *save = NULL;
+  char *tok = strtok_r(entry, " \t", &save);
+  if (!tok || tok[0] == '#')
+    return 0;
+  int count = atoi(tok);
+  tok = strtok_r(NULL, " \t", &save);
+  if (count < 1 || !tok || (tok[0] != 'p' && tok[0] != 'P') ||
+      tok[1] < '2' || tok[1] > '5' || tok[2] != '\0')
+    return -1;
+
+  // P5 is a single instance started on demand; its entry only sets how
+  // it is tuned and rendered when it next starts
+  if (tok[1] == '5') {
+    launch_tuning t;
+    char mode[sizeof(p5_child.console)] = "";
+    memset(&t, 0, sizeof(t));
+    if (count != 1)
+      return -1;
+    while ((tok = strtok_r(NULL, " \t", &save))) {
+      char *val = strchr(tok, '=');
+      if (!val)
+        return -1;
+      *val++ = '\0';
+      if (strcmp(tok, "console") == 0) {
+        if (!console_valid(val)) {
+          fprintf(stderr, "Invalid console mode: \"%s\"\n", val);
+          return -1;
+        }
+        snprintf(mode, sizeof(mode), "%s", val);
+      } else if (!tuning_parse_key(&t, tok, val))
+        return -1;
+    }
+    p5_child.tuning = t;
+    memcpy(p5_child.console, mode, sizeof(mode));
+    if (p5_child.pid != 0)
+      printf("Process 5 is already running; these settings apply from its "
+             "next start.\n");
+    return 0;
+  }
+
+  child_entry proto;
+  memset(&proto, 0, sizeof(proto));
+  proto.process_num = tok[1] - '0';
+  proto.fg_color = 7;
+  while ((tok = strtok_r(NULL, " \t", &save))) {
+    char *val = strchr(tok, '=');
+    if (!val)
+      return -1;
+    *val++ = '\0';
+    if (strcmp(tok, "transport") == 0)
+      snprintf(proto.transport, sizeof(proto.transport), "%s", val);
+    else if (strcmp(tok, "via") == 0 && transport_parse(val) >= 0)
+      snprintf(proto.via, sizeof(proto.via), "%s", val);
+    else if (strcmp(tok, "gen") == 0)
+      snprintf(proto.gen_spec, sizeof(proto.gen_spec), "%s", val);
+    else if (strcmp(tok, "credits") == 0 && credit_parse_policy(val) >= 0)
+      snprintf(proto.credits, sizeof(proto.credits), "%s", val);
+    else if (strcmp(tok, "console") == 0) {
+      if (!console_valid(val)) {
+        fprintf(stderr, "Invalid console mode: \"%s\"\n", val);
+        return -1;
+      }
+      snprintf(proto.console, sizeof(proto.console), "%s", val);
+    } else if (strcmp(tok, "fg") == 0)
+      proto.fg_color = atoi(val);
+    else if (strcmp(tok, "bg") == 0)
+      proto.bg_color = atoi(val);
+    else if (strcmp(tok, "delay") == 0)
+      proto.delay_ms = atoi(val);
+    else if (!tuning_parse_key(&proto.tuning, tok, val))
+      return -1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    child_entry *e = add_child(proto.process_num);
+    if (!e)
+      return i;
+    *e = proto;
+  }
+  return count;
+}
+
+// Launches a whole topology: entries separated by ';' or newlines.
+int launch_topology(const char *spec) {
+  char *text = strdup(spec);
+  int first = child_count;
+  char *save = NULL;
+  for (char *entry = strtok_r(text, ";\n", &save); entry;
+       entry = strtok_r(NULL, ";\n", &save)) {
+    if (add_topology_entry(entry) < 0) {
+      fprintf(stderr, "Invalid topology entry: \"%s\"\n", entry);
+      child_count = first;
+      free(text);
+      return 0;
+    }
+  }
+  free(text);
+  if (child_count == first)
+    return 1;
+
+  ensure_p5_started();
+  if (p5_child.pid == 0) {
+    printf("Cannot launch the topology because Process 5 is not running.\n");
+    child_count = first;
+    return 0;
+  }
+  printf("Launching %d producer instance(s)...\n", child_count - first);
+  launch_children(first, child_count - first);
+  return 1;
+}
+
+char *read_file(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+  size_t len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  size_t n;
+  while ((n = fread(buf + len, 1, cap - len - 1, f)) > 0) {
+    len += n;
+    if (len + 1 == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  buf[len] = '\0';
+  fclose(f);
+  return buf;
+}
+
 void start_child(int process_num) {
   if (process_num < 2 || process_num > 4)
     return;
-  if (pids[process_num] != 0) {
-    printf("Process %d is already running (PID: %d).\n", process_num,
-           pids[process_num]);
-    return;
-  }
 
   int fg_color, bg_color, delay_ms;
   printf("--- Configure Process %d ---\n", process_num);
@@ -77,7 +554,7 @@ void start_child(int process_num) {
       ;
     return;
   }
-  printf("Enter pause duration between cycles (milliseconds): ");
+  printf("Enter minimum pause between sends (milliseconds, 0 = none): ");
   if (scanf("%d", &delay_ms) != 1) {
     printf("Invalid input.\n");
     while (getchar() != '\n')
@@ -86,110 +563,169 @@ void start_child(int process_num) {
   }
   while (getchar() != '\n')
     ;
+  launch_tuning tuning;
+  memset(&tuning, 0, sizeof(tuning));
+  char line[256], *save = NULL;
+  printf("Tuning (e.g. \"cpus=1 rt=10 mlock=1 hugepages=1\", Enter = none): ");
+  fflush(stdout);
+  if (fgets(line, sizeof(line), stdin)) {
+    for (char *tok = strtok_r(line, " \t\n", &save); tok;
+         tok = strtok_r(NULL, " \t\n", &save)) {
+      char *val = strchr(tok, '=');
+      if (val)
+        *val++ = '\0';
+      if (!val || !tuning_parse_key(&tuning, tok, val)) {
+        printf("Invalid tuning option \"%s\".\n", tok);
+        return;
+      }
+    }
+  }
 
   ensure_p5_started();
 
-  if (pids[5] == 0 || kill(pids[5], 0) != 0) {
+  if (p5_child.pid == 0) {
     printf("Cannot start Process %d because Process 5 is not running or failed "
            "to start properly.\n",
            process_num);
-    if (pids[5] != 0 && errno == ESRCH) {
-      running_status[5] = 0;
-      pids[5] = 0;
-    }
     return;
   }
 
+  child_entry *e = add_child(process_num);
+  if (!e)
+    return;
+  e->fg_color = fg_color;
+  e->bg_color = bg_color;
+  e->delay_ms = delay_ms;
+  e->tuning = tuning;
   printf("Starting Process %d...\n", process_num);
-  pids[process_num] = fork();
-
-  if (pids[process_num] < 0) {
-    perror("Failed to fork child process");
-    pids[process_num] = 0;
-  } else if (pids[process_num] == 0) {
-    char fg_str[5], bg_str[5], delay_str[10];
-    snprintf(fg_str, sizeof(fg_str), "%d", fg_color);
-    snprintf(bg_str, sizeof(bg_str), "%d", bg_color);
-    snprintf(delay_str, sizeof(delay_str), "%d", delay_ms);
-
-    char executable_name[20];
-    snprintf(executable_name, sizeof(executable_name), "./process%d",
-             process_num);
-
-    char *args[] = {executable_name, fg_str, bg_str, delay_str, NULL};
-    execvp(executable_name, args);
-    perror("Failed to exec child process");
-    exit(EXIT_FAILURE);
-  } else {
-    printf("Process %d started with PID: %d\n", process_num, pids[process_num]);
-    running_status[process_num] = 1;
-  }
-  usleep(delay_ms * 1000);
+  launch_children(child_count - 1, 1);
 }
 
+// Stops every instance of a producer type: all are signalled first, then
+// reaped, so N instances take as long to stop as one.
 void stop_child(int process_num) {
   if (process_num < 2 || process_num > 4)
     return;
-  if (pids[process_num] == 0) {
+  if (count_running(process_num) == 0) {
     printf("Process %d is not running.\n", process_num);
     return;
   }
 
-  printf("Stopping Process %d (PID: %d)...\n", process_num, pids[process_num]);
-  if (kill(pids[process_num], SIGTERM) == 0) {
-    int status;
-    waitpid(pids[process_num], &status, 0);
-    printf("Process %d terminated.\n", process_num);
-  } else {
-    if (errno == ESRCH) {
-      printf("Process %d already terminated.\n", process_num);
-    } else {
+  for (int i = 0; i < child_count; i++) {
+    child_entry *e = &children[i];
+    if (e->process_num != process_num || e->pid == 0)
+      continue;
+    printf("Stopping Process %d (PID: %d)...\n", process_num, e->pid);
+    if (kill(e->pid, SIGTERM) != 0 && errno != ESRCH) {
       perror("Failed to send SIGTERM to child process");
       printf("Attempting force kill (SIGKILL)...\n");
-      kill(pids[process_num], SIGKILL);
-      waitpid(pids[process_num], NULL, 0);
+      kill(e->pid, SIGKILL);
     }
   }
-
-  pids[process_num] = 0;
-  running_status[process_num] = 0;
+  for (int i = child_count - 1; i >= 0; i--) {
+    if (children[i].process_num != process_num)
+      continue;
+    if (children[i].pid != 0)
+      waitpid(children[i].pid, NULL, 0);
+    remove_child(i);
+  }
+  printf("Process %d terminated.\n", process_num);
 
   try_stop_p5();
 }
 
+void print_status(int process_num) {
+  int n = count_running(process_num);
+  if (n > 0)
+    printf("[Running x%d]\n", n);
+  else
+    printf("[Stopped]\n");
+}
+
 void display_menu() {
   printf("\n--- Main Menu ---\n");
-  printf("1. Start Process 2 (Integers -> FIFO)\t\t[%s]\n",
-         running_status[2] ? "Running" : "Stopped");
-  printf("2. Start Process 3 (Floats -> MSGQueue)\t\t[%s]\n",
-         running_status[3] ? "Running" : "Stopped");
-  printf("3. Start Process 4 (Strings -> Socket)\t\t[%s]\n",
-         running_status[4] ? "Running" : "Stopped");
+  printf("1. Start Process 2 (Integers -> FIFO)\t\t");
+  print_status(2);
+  printf("2. Start Process 3 (Floats -> MSGQueue)\t\t");
+  print_status(3);
+  printf("3. Start Process 4 (Strings -> Socket)\t\t");
+  print_status(4);
   printf("--------------------\n");
-  printf("4. Stop Process 2\n");
-  printf("5. Stop Process 3\n");
-  printf("6. Stop Process 4\n");
+  printf("4. Stop Process 2 (all instances)\n");
+  printf("5. Stop Process 3 (all instances)\n");
+  printf("6. Stop Process 4 (all instances)\n");
   printf("--------------------\n");
   printf("7. Exit Program\n");
-  if (pids[5] != 0 && kill(pids[5], 0) == -1 && errno == ESRCH) {
-    running_status[5] = 0;
-    pids[5] = 0;
-  }
+  printf("8. Launch topology entry (e.g. \"8 p2 gen=rate=10000\")\n");
   printf("Process 5 (Logger) Status:\t\t\t[%s]\n",
-         running_status[5] ? "Running" : "Stopped");
+         p5_child.pid ? "Running" : "Stopped");
+  display_p5_stats();
+  display_credits();
   printf("Enter your choice: ");
 }
 
-int main() {
-  int choice;
+int main(int argc, char *argv[]) {
+  const char *topology = NULL, *topology_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "rt:f:")) != -1) {
+    switch (opt) {
+    case 'r':
+      auto_restart = 1;
+      break;
+    case 't':
+      topology = optarg;
+      break;
+    case 'f':
+      topology_file = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-r (restart crashed children)] [-t topology] "
+              "[-f topology_file]\n"
+              "  topology: entries separated by ';' or newlines, each\n"
+              "  <count> <p2|p3|p4> [transport=..] [via=<backend>] "
+              "[gen=<spec>] [credits=<policy>] [fg=..] [bg=..] [delay=..]\n"
+              "  [console=all|sample:N|summary[:ms]|quiet] [cpus=<list>] "
+              "[rt=<1-99>] [mlock=1]\n"
+              "  [hugepages=1], and 1 p5 [console=..] [<tuning keys>] for "
+              "Process 5\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // SIGCHLD only wakes the menu loop, which reaps the children
+  if (!setup_signal_pipe()) {
+    perror("Failed to create signal pipe");
+    return EXIT_FAILURE;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  if (topology_file) {
+    char *text = read_file(topology_file);
+    if (!text) {
+      perror(topology_file);
+      return EXIT_FAILURE;
+    }
+    launch_topology(text);
+    free(text);
+  }
+  if (topology)
+    launch_topology(topology);
 
+  int choice = 0;
   do {
     display_menu();
-    sleep(1);
-    if (!kbhit()) {
-      sleep(1);
+    fflush(stdout);
+    int ev = producer_wait(1, -1, MENU_REFRESH_MS);
+    if (ev & PRODUCER_EV_SIGNAL)
+      reap_children();
+    if (!(ev & PRODUCER_EV_INPUT))
       continue;
-    }
 
     if (scanf("%d", &choice) != 1) {
       printf("Invalid input. Please enter a number.\n");
@@ -222,16 +758,15 @@ int main() {
       stop_child(4);
       break;
     case 7:
-      if (running_status[2] != 0 || running_status[3] != 0 ||
-          running_status[4] != 0) {
+      if (child_count > 0) {
         printf("Error: Cannot exit while Process 2, 3, or 4 are running.\n");
         printf("Please stop all child processes first.\n");
       } else {
-        if (running_status[5] != 0) {
+        if (p5_child.pid != 0) {
           printf("Process 5 is still running. Stopping it now...\n");
           try_stop_p5();
         }
-        if (running_status[5] == 0) {
+        if (p5_child.pid == 0) {
           printf("Exiting program.\n");
         } else {
           printf("Error: Failed to stop Process 5. Cannot exit cleanly.\n");
@@ -240,12 +775,20 @@ int main() {
       }
 
       break;
+    case 8: {
+      char entry[256];
+      printf("Topology entry: ");
+      fflush(stdout);
+      if (fgets(entry, sizeof(entry), stdin))
+        launch_topology(entry);
+      break;
+    }
     default:
       printf("Invalid choice. Please try again.\n");
     }
-  } while (choice != 7 || running_status[2] != 0 || running_status[3] != 0 ||
-           running_status[4] != 0 || running_status[5] != 0);
+  } while (choice != 7 || child_count > 0 || p5_child.pid != 0);
 
+  free(children);
   printf("Main program finished.\n");
   return 0;
 }
@@ -1,109 +1,325 @@
+#define _GNU_SOURCE // sched_setaffinity (tuning.h)
 #include "common.h"
+#include "loadgen.h"
+#include "shm_ring.h"
+#include "spill.h"
+#include "transport.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
 
 volatile sig_atomic_t terminate_flag = 0;
+uint64_t last_seq = 0; // Sequence number of the last value sent
+pid_t my_pid;
+const char *fg_code, *bg_code;
+int use_shm, via_kind;
+int fifo_fd = -1;
+shm_ring_producer ring = {NULL};
+transport via;         // --via: a shared transport instead of the FIFO
+producer_link p5_link; // Buffers values while P5 is away, see spill.h
+credit_client credits; // --credits
 
-void handle_sigterm(int sig) { terminate_flag = 1; }
+void handle_sigterm(int sig) {
+  terminate_flag = 1;
+  notify_signal_pipe();
+}
+
+// Opens the selected channel. Called again and again while P5 is away, so
+// failures are not reported.
+int connect_channel() {
+  if (via_kind >= 0)
+    return transport_open(&via, via_kind, 0);
+  if (use_shm)
+    return shm_ring_attach(&ring, SHM_RING_P2);
+  // Non-blocking, so that without P5 the open fails (ENXIO) instead of
+  // waiting; writes block as usual
+  fifo_fd = open(FIFO_PATH_P2, O_WRONLY | O_NONBLOCK);
+  if (fifo_fd >= 0 && fcntl(fifo_fd, F_SETFL, 0) < 0) {
+    close(fifo_fd);
+    fifo_fd = -1;
+  }
+  return fifo_fd >= 0;
+}
+
+// A ring P5 left behind may still hold values; they are taken back.
+void disconnect_channel(int lost) {
+  if (lost && ring.ring)
+    link_reclaim_ring(&p5_link, &ring);
+  transport_close(&via);
+  shm_ring_detach(&ring);
+  if (fifo_fd >= 0)
+    close(fifo_fd);
+  fifo_fd = -1;
+}
+
+// The descriptor whose hangup means P5 went away, -1 if there is none.
+int channel_fd() {
+  if (!p5_link.up)
+    return -1;
+  return via.ops ? transport_fd(&via) : fifo_fd;
+}
+
+// Writes up to FIFO_BATCH_RECORDS records with a single write(). Returns
+// how many were sent.
+size_t write_fifo(const xport_msg *msgs, size_t n) {
+  fifo_msg_int records[FIFO_BATCH_RECORDS];
+  for (size_t i = 0; i < n; i++) {
+    records[i].source_pid = msgs[i].source_pid;
+    records[i].value = msgs[i].value.i;
+    records[i].seq = msgs[i].seq;
+    records[i].send_ns = msgs[i].send_ns;
+  }
+
+  ssize_t bytes_written;
+  do {
+    bytes_written = write(fifo_fd, records, n * sizeof(fifo_msg_int));
+  } while (bytes_written < 0 && errno == EINTR && !terminate_flag);
+  if (bytes_written < 0) {
+    if (errno != EPIPE) // P5 went away
+      perror("Process 2: Failed to write to FIFO");
+    return 0;
+  }
+  return n; // At most PIPE_BUF bytes, so never a partial write
+}
+
+// Adds the summary line if one is due and writes what the terminal takes.
+void render_console() {
+  uint64_t n[CONSOLE_KINDS];
+  double seconds = console_summary_due(n);
+  if (seconds > 0 && n[2] > 0)
+    console_printf("%s%s[Process 2 - PID: %d] Sent %llu values in %.1f s "
+                   "(%.0f/s)%s\n",
+                   fg_code, bg_code, my_pid, (unsigned long long)n[2],
+                   seconds, n[2] / seconds, COLOR_RESET);
+  console_flush();
+}
+
+size_t send_records(const xport_msg *msgs, size_t n) {
+  size_t sent = via.ops     ? link_send_transport(&p5_link, &via, msgs, n)
+                : ring.ring ? link_send_ring(&p5_link, &ring, msgs, n)
+                            : write_fifo(msgs, n);
+  for (size_t i = 0; i < sent; i++)
+    if (console_line(2))
+      console_printf("%s%s[Process 2 - PID: %d] Sent: %d%s\n", fg_code,
+                     bg_code, my_pid, msgs[i].value.i, COLOR_RESET);
+  render_console();
+  return sent;
+}
+
+// Queues one value; the link sends it with the next batch. Returns 0 if
+// the process should terminate.
+int send_value(int value) {
+  xport_msg m = {SHM_CH_P2, 0, my_pid, ++last_seq, monotonic_ns(),
+                 {.i = value}};
+  return link_send(&p5_link, &m);
+}
+
+// Waits for pacing, input (if want_input) or the link, whichever is due
+// first, and reconnects or flushes when the link is due. Returns the
+// PRODUCER_EV_* bits.
+int wait_and_poll(int want_input, int timeout_ms) {
+  int ev = producer_wait(want_input, channel_fd(),
+                         link_timeout(&p5_link, timeout_ms));
+  if (ev & PRODUCER_EV_CHANNEL_CLOSED)
+    link_lost(&p5_link);
+  link_poll(&p5_link);
+  render_console();
+  return ev;
+}
+
+// Flow control lapses while P5 is away; picks it up again from the P5
+// the link reconnected to.
+void resume_credits() { credit_resume(&credits, "Process 2", my_pid); }
+
+// Sends the held-back values the credits allow. Batched records count
+// against the credits, so the batch is written as soon as they run out;
+// otherwise P5 could not deliver them and grant more.
+int send_held(credit_client *credits) {
+  const credit_item *item;
+  while ((item = credit_next(credits))) {
+    if (!send_value(item->value.i))
+      return 0;
+    credit_sent(credits, last_seq);
+  }
+  if (credit_available(credits) == 0)
+    link_flush(&p5_link);
+  return 1;
+}
+
+// Sends generated integers until the generator's count or duration is
+// reached. Records are batched as in interactive mode. With credits (NULL
+// = none) every value goes through the flow control policy, and what it
+// still holds is sent before returning.
+void run_generator(loadgen *gen, credit_client *credits) {
+  size_t msg_size = via_kind >= 0 ? offsetof(xport_msg, value) + sizeof(double)
+                    : use_shm     ? sizeof(shm_ring_slot)
+                                  : sizeof(fifo_msg_int);
+  loadgen_start(gen);
+  while (!terminate_flag) {
+    if (credits && !send_held(credits))
+      break;
+    int wait_ms = loadgen_wait_ms(gen);
+    if (wait_ms < 0) {
+      if (!credits || !credit_held(credits) ||
+          !credit_wait(credits, &terminate_flag))
+        break;
+      continue;
+    }
+    if (wait_ms > 0) {
+      wait_and_poll(0, wait_ms);
+      continue;
+    }
+
+    int value = loadgen_int(gen);
+    if (credits) {
+      credit_item item = {0, {.i = value}};
+      if (!credit_offer(credits, &item, &terminate_flag))
+        break;
+    } else if (!send_value(value)) {
+      break;
+    }
+    loadgen_sent(gen, msg_size);
+  }
+  link_flush(&p5_link);
+  loadgen_report(gen, "Process 2", my_pid);
+  if (credits)
+    credit_report(credits, "Process 2", my_pid);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <fg_color> <bg_color> <delay_ms>\n", argv[0]);
+  loadgen gen;
+  int credit_policy;
+  if (argc < 4 || !producer_parse_options(argc, argv, "fifo", &use_shm,
+                                          &via_kind, &gen, &credit_policy)) {
+    fprintf(stderr,
+            "Usage: %s <fg_color> <bg_color> <delay_ms (0 = no pacing)> "
+            "[fifo|shm|--via fifo|mq|stream|seqpacket] [--gen <spec> "
+            "[--credits block|coalesce|sample|drop-oldest]] "
+            "[--console all|sample:N|summary[:ms]|quiet]\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
 
   int fg_color = atoi(argv[1]);
   int bg_color = atoi(argv[2]);
   int delay_ms = atoi(argv[3]);
-  pid_t my_pid = getpid();
+  my_pid = getpid();
+  tuning_apply();
+  // Generated load is too fast to echo in full
+  console_open(gen.enabled ? CONSOLE_QUIET : CONSOLE_ALL);
 
-  const char *fg_code = get_color_code(fg_color, 0);
-  const char *bg_code = get_color_code(bg_color, 1);
+  fg_code = get_color_code(fg_color, 0);
+  bg_code = get_color_code(bg_color, 1);
 
   // Setup signal handler
+  if (!setup_signal_pipe()) {
+    perror("Process 2: Failed to create signal pipe");
+    return EXIT_FAILURE;
+  }
   signal(SIGTERM, handle_sigterm);
+  signal(SIGPIPE, SIG_IGN); // Report EPIPE from write() instead
 
-  printf("%s%s[Process 2 - PID: %d] Started. Delay: %d ms. Reading integers -> "
-         "FIFO (%s)%s\n",
-         fg_code, bg_code, my_pid, delay_ms, FIFO_PATH_P2, COLOR_RESET);
+  // One banner, naming the channel actually in use
+  printf("%s%s[Process 2 - PID: %d] Started. Pacing: %d ms. Reading integers "
+         "-> %s (%s)%s\n",
+         fg_code, bg_code, my_pid, delay_ms,
+         via_kind >= 0 ? "Transport"
+         : use_shm     ? "Shared-memory ring"
+                       : "FIFO",
+         via_kind >= 0 ? xport_backends[via_kind].name
+         : use_shm     ? SHM_RING_P2
+                       : FIFO_PATH_P2,
+         COLOR_RESET);
   fflush(stdout);
 
-  int fifo_fd = -1;
-  fifo_fd = open(FIFO_PATH_P2, O_WRONLY);
-  if (fifo_fd < 0) {
-    printf("%s%s[Process 2 - PID: %d] Terminating due to FIFO error.%s\n",
-           fg_code, bg_code, my_pid, COLOR_RESET);
+  // Ring slots are sent as they come; the FIFO and transports take
+  // batches
+  p5_link = (producer_link){"Process 2", my_pid, &terminate_flag,
+                            connect_channel, send_records, disconnect_channel,
+                            via_kind >= 0 ? XPORT_BATCH
+                            : use_shm     ? 1
+                                          : FIFO_BATCH_RECORDS,
+                            via_kind >= 0 ? XPORT_FLUSH_MS : FIFO_FLUSH_MS};
+  if (!link_start(&p5_link)) {
+    perror("Process 2: Failed to allocate the spill buffer");
+    return EXIT_FAILURE;
+  }
+  if (credit_policy >= 0 &&
+      !credit_start(&credits, 2, credit_policy, "Process 2", my_pid)) {
+    perror("Process 2: Failed to set up flow control");
     return EXIT_FAILURE;
   }
+  if (credit_policy >= 0)
+    p5_link.connected = resume_credits;
+  tuning_report("Process 2", my_pid);
+  notify_ready();
 
   int input_int;
-  fifo_msg_int msg;
-  msg.source_pid = my_pid;
+  line_reader input = {0};
+  char line[LINE_READER_SIZE];
+  long long last_send_ms = 0;
+  int prompt_shown = 0;
 
-  printf("%s%s[Process 2 - PID: %d] Enter integers (Ctrl+D or signal to "
-         "stop):\n%s",
-         fg_code, bg_code, my_pid, COLOR_RESET);
-  fflush(stdout);
+  if (gen.enabled) {
+    run_generator(&gen, credit_policy >= 0 ? &credits : NULL);
+  } else {
+    printf("%s%s[Process 2 - PID: %d] Enter integers (Ctrl+D or signal to "
+           "stop):\n%s",
+           fg_code, bg_code, my_pid, COLOR_RESET);
+    fflush(stdout);
+  }
 
-  while (!terminate_flag) {
+  // Interactive mode: values come from stdin
+  while (!gen.enabled && !terminate_flag) {
+    int have_line = line_reader_has_line(&input);
+    if (!have_line && input.eof) {
+      printf("\n%s%s[Process 2 - PID: %d] EOF detected on input. "
+             "Terminating.%s\n",
+             fg_code, bg_code, my_pid, COLOR_RESET);
+      break;
+    }
 
-    printf("%s%sP2 Input> %s", fg_code, bg_code, COLOR_RESET);
-    fflush(stdout);
-    sleep(1);
-
-    if (kbhit()) {
-      if (scanf("%d", &input_int) == 1) {
-        while (getchar() != '\n')
-          ;
-
-        msg.value = input_int;
-        ssize_t bytes_written = write(fifo_fd, &msg, sizeof(msg));
-        if (bytes_written < 0) {
-          if (errno == EPIPE) {
-            printf("\n%s%s[Process 2 - PID: %d] Detected P5 closed the FIFO. "
-                   "Terminating.%s\n",
-                   fg_code, bg_code, my_pid, COLOR_RESET);
-            terminate_flag = 1;
-          } else {
-            perror("Process 2: Failed to write to FIFO");
-          }
-        } else if (bytes_written < sizeof(msg)) {
-          fprintf(
-              stderr,
-              "%s%s[Process 2 - PID: %d] Warning: Partial write to FIFO.%s\n",
-              fg_code, bg_code, my_pid, COLOR_RESET);
-        } else {
-          printf("%s%s[Process 2 - PID: %d] Sent: %d%s\n", fg_code, bg_code,
-                 my_pid, input_int, COLOR_RESET);
-          fflush(stdout);
-        }
-      } else {
-        if (feof(stdin)) {
-          printf("\n%s%s[Process 2 - PID: %d] EOF detected on input. "
-                 "Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-        } else {
-          printf("\n%s%s[Process 2 - PID: %d] Invalid input. Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-          while (getchar() != '\n' && !feof(stdin) && !ferror(stdin))
-            ;
-        }
-        terminate_flag = 1;
-        break;
+    int timeout_ms = pacing_timeout(delay_ms, last_send_ms, have_line);
+    if (timeout_ms != 0) {
+      if (!have_line && !prompt_shown) {
+        printf("%s%sP2 Input> %s", fg_code, bg_code, COLOR_RESET);
+        fflush(stdout);
+        prompt_shown = 1;
       }
+      if (wait_and_poll(!have_line, timeout_ms) & PRODUCER_EV_INPUT)
+        line_reader_fill(&input, STDIN_FILENO);
+      continue;
     }
-    if (!terminate_flag && delay_ms > 0) {
-      usleep(delay_ms * 1000);
+
+    line_reader_next(&input, line, sizeof(line));
+    prompt_shown = 0;
+    if (line[strspn(line, " \t\r")] == '\0')
+      continue;
+    if (sscanf(line, "%d", &input_int) != 1) {
+      printf("\n%s%s[Process 2 - PID: %d] Invalid input. Terminating.%s\n",
+             fg_code, bg_code, my_pid, COLOR_RESET);
+      terminate_flag = 1;
+      break;
     }
+
+    last_send_ms = monotonic_ms();
+    if (!send_value(input_int))
+      break;
+    // Transports batch, so an interactive value is flushed to them right
+    // away; the ring already sends one record at a time and the FIFO
+    // keeps batching
+    if (via_kind >= 0)
+      link_flush(&p5_link);
   }
 
+  link_finish(&p5_link);
+  console_close();
+
   printf("%s%s[Process 2 - PID: %d] Terminating and closing FIFO.%s\n", fg_code,
          bg_code, my_pid, COLOR_RESET);
-  if (fifo_fd >= 0) {
-    close(fifo_fd);
-  }
+  if (credit_policy >= 0)
+    credit_detach(&credits);
 
   return EXIT_SUCCESS;
 }
@@ -1,99 +1,307 @@
+#define _GNU_SOURCE // sched_setaffinity (tuning.h)
 #include "common.h"
+#include "loadgen.h"
+#include "shm_ring.h"
+#include "spill.h"
+#include "transport.h"
 
 volatile sig_atomic_t terminate_flag = 0;
+uint64_t last_seq = 0; // Sequence number of the last value sent
+pid_t my_pid;
+const char *fg_code, *bg_code;
+int use_shm, via_kind;
+mqd_t mq = (mqd_t)-1;
+shm_ring_producer ring = {NULL};
+transport via;         // --via: a shared transport instead of the queue
+producer_link p5_link; // Buffers values while P5 is away, see spill.h
+credit_client credits; // --credits
 
-void handle_sigterm(int sig) { terminate_flag = 1; }
+void handle_sigterm(int sig) {
+  terminate_flag = 1;
+  notify_signal_pipe();
+}
+
+// Opens the selected channel. Called again and again while P5 is away, so
+// failures are not reported.
+int connect_channel() {
+  if (via_kind >= 0)
+    return transport_open(&via, via_kind, 0);
+  if (use_shm)
+    return shm_ring_attach(&ring, SHM_RING_P3);
+  // P5 creates and sizes the queue. Non-blocking: the queue outlives P5, so
+  // a full queue is waited out here, as long as P5 is alive.
+  struct mq_attr attr;
+  mq = mq_open(MSGQ_NAME, O_WRONLY | O_NONBLOCK);
+  if (mq != (mqd_t)-1 && mq_getattr(mq, &attr) == 0 &&
+      attr.mq_msgsize < (long)sizeof(mq_msg_float)) {
+    fprintf(stderr, "Process 3: Queue message size %ld is too small\n",
+            attr.mq_msgsize);
+    mq_close(mq);
+    mq = (mqd_t)-1;
+  }
+  return mq != (mqd_t)-1;
+}
+
+// A ring P5 left behind may still hold values; they are taken back.
+void disconnect_channel(int lost) {
+  if (lost && ring.ring)
+    link_reclaim_ring(&p5_link, &ring);
+  transport_close(&via);
+  shm_ring_detach(&ring);
+  if (mq != (mqd_t)-1)
+    mq_close(mq); // P5 owns the queue and unlinks it; other P3s may use it
+  mq = (mqd_t)-1;
+}
+
+// Returns how many records were sent.
+size_t send_mq(const xport_msg *msgs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    mq_msg_float msg = {1, msgs[i].source_pid, msgs[i].value.d, msgs[i].seq,
+                        msgs[i].send_ns};
+    while (mq_send(mq, (const char *)&msg, sizeof(msg), 0) == -1) {
+      if (errno == EAGAIN) {
+        if (!link_wait_writable(&p5_link, mq))
+          return i; // Terminating, or P5 is gone
+      } else if (errno != EINTR) {
+        perror("Process 3: Failed to send message");
+        return i;
+      } else if (terminate_flag) {
+        return i;
+      }
+    }
+  }
+  return n;
+}
+
+// Adds the summary line if one is due and writes what the terminal takes.
+void render_console() {
+  uint64_t n[CONSOLE_KINDS];
+  double seconds = console_summary_due(n);
+  if (seconds > 0 && n[3] > 0)
+    console_printf("%s%s[Process 3 - PID: %d] Sent %llu values in %.1f s "
+                   "(%.0f/s)%s\n",
+                   fg_code, bg_code, my_pid, (unsigned long long)n[3],
+                   seconds, n[3] / seconds, COLOR_RESET);
+  console_flush();
+}
+
+size_t send_records(const xport_msg *msgs, size_t n) {
+  size_t sent = via.ops     ? link_send_transport(&p5_link, &via, msgs, n)
+                : ring.ring ? link_send_ring(&p5_link, &ring, msgs, n)
+                            : send_mq(msgs, n);
+  for (size_t i = 0; i < sent; i++)
+    if (console_line(3))
+      console_printf("%s%s[Process 3 - PID: %d] Sent: %f%s\n", fg_code,
+                     bg_code, my_pid, msgs[i].value.d, COLOR_RESET);
+  render_console();
+  return sent;
+}
+
+// Queues one value; the link sends it with the next batch. Returns 0 if
+// the process should terminate.
+int send_value(double value) {
+  xport_msg m = {SHM_CH_P3, 0, my_pid, ++last_seq, monotonic_ns(),
+                 {.d = value}};
+  return link_send(&p5_link, &m);
+}
+
+// Waits for pacing, input (if want_input) or the link, whichever is due
+// first, and reconnects or flushes when the link is due. A message queue
+// has no hangup notification; the link notices when P5 is gone. Returns
+// the PRODUCER_EV_* bits.
+int wait_and_poll(int want_input, int timeout_ms) {
+  int fd = p5_link.up && via.ops ? transport_fd(&via) : -1;
+  int ev = producer_wait(want_input, fd, link_timeout(&p5_link, timeout_ms));
+  if (ev & PRODUCER_EV_CHANNEL_CLOSED)
+    link_lost(&p5_link);
+  link_poll(&p5_link);
+  render_console();
+  return ev;
+}
+
+// Flow control lapses while P5 is away; picks it up again from the P5
+// the link reconnected to.
+void resume_credits() { credit_resume(&credits, "Process 3", my_pid); }
+
+// Sends the held-back values the credits allow. A transport batch is sent
+// as soon as they run out, as P5 cannot grant more before it arrives.
+int send_held(credit_client *credits) {
+  const credit_item *item;
+  while ((item = credit_next(credits))) {
+    if (!send_value(item->value.d))
+      return 0;
+    credit_sent(credits, last_seq);
+  }
+  if (credit_available(credits) == 0)
+    link_flush(&p5_link);
+  return 1;
+}
+
+// Sends generated floats until the generator's count or duration is
+// reached. With credits (NULL = none) every value goes through the flow
+// control policy, and what it still holds is sent before returning.
+void run_generator(loadgen *gen, credit_client *credits) {
+  size_t msg_size = via_kind >= 0 ? offsetof(xport_msg, value) + sizeof(double)
+                    : use_shm     ? sizeof(shm_ring_slot)
+                                  : sizeof(mq_msg_float);
+  loadgen_start(gen);
+  while (!terminate_flag) {
+    if (credits && !send_held(credits))
+      break;
+    int wait_ms = loadgen_wait_ms(gen);
+    if (wait_ms < 0) {
+      if (!credits || !credit_held(credits) ||
+          !credit_wait(credits, &terminate_flag))
+        break;
+      continue;
+    }
+    if (wait_ms > 0) {
+      wait_and_poll(0, wait_ms);
+      continue;
+    }
+
+    double value = loadgen_double(gen);
+    if (credits) {
+      credit_item item = {0, {.d = value}};
+      if (!credit_offer(credits, &item, &terminate_flag))
+        break;
+    } else if (!send_value(value)) {
+      break;
+    }
+    loadgen_sent(gen, msg_size);
+  }
+  link_flush(&p5_link);
+  loadgen_report(gen, "Process 3", my_pid);
+  if (credits)
+    credit_report(credits, "Process 3", my_pid);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <fg_color> <bg_color> <delay_ms>\n", argv[0]);
+  loadgen gen;
+  int credit_policy;
+  if (argc < 4 || !producer_parse_options(argc, argv, "mq", &use_shm,
+                                          &via_kind, &gen, &credit_policy)) {
+    fprintf(stderr,
+            "Usage: %s <fg_color> <bg_color> <delay_ms (0 = no pacing)> "
+            "[mq|shm|--via fifo|mq|stream|seqpacket] [--gen <spec> "
+            "[--credits block|coalesce|sample|drop-oldest]] "
+            "[--console all|sample:N|summary[:ms]|quiet]\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
 
   int fg_color = atoi(argv[1]);
   int bg_color = atoi(argv[2]);
   int delay_ms = atoi(argv[3]);
-  pid_t my_pid = getpid();
+  my_pid = getpid();
+  tuning_apply();
+  console_open(CONSOLE_QUIET);
 
-  const char *fg_code = get_color_code(fg_color, 0);
-  const char *bg_code = get_color_code(bg_color, 1);
+  fg_code = get_color_code(fg_color, 0);
+  bg_code = get_color_code(bg_color, 1);
 
+  if (!setup_signal_pipe()) {
+    perror("Process 3: Failed to create signal pipe");
+    return EXIT_FAILURE;
+  }
   signal(SIGTERM, handle_sigterm);
+  signal(SIGPIPE, SIG_IGN); // P5 going away shows up as EPIPE instead
 
-  printf("%s%s[Process 3 - PID: %d] Started. Delay: %d ms. Reading floats "
-         "-> Message Queue (%s)%s\n",
-         fg_code, bg_code, my_pid, delay_ms, MSGQ_NAME, COLOR_RESET);
+  // One banner, naming the channel actually in use
+  printf("%s%s[Process 3 - PID: %d] Started. Pacing: %d ms. Reading floats "
+         "-> %s (%s)%s\n",
+         fg_code, bg_code, my_pid, delay_ms,
+         via_kind >= 0 ? "Transport"
+         : use_shm     ? "Shared-memory ring"
+                       : "Message Queue",
+         via_kind >= 0 ? xport_backends[via_kind].name
+         : use_shm     ? SHM_RING_P3
+                       : MSGQ_NAME,
+         COLOR_RESET);
   fflush(stdout);
 
-  mqd_t mq;
-  struct mq_attr attr;
-
-  attr.mq_flags = 0;
-  attr.mq_maxmsg = 10;
-  attr.mq_msgsize = sizeof(mq_msg_float);
-  attr.mq_curmsgs = 0;
-
-  mq = mq_open(MSGQ_NAME, O_WRONLY | O_CREAT, 0666, &attr);
-  if (mq == (mqd_t)-1) {
-    perror("Process 3: Failed to open message queue");
+  // The queue and the rings take one message at a time; transports take
+  // batches
+  p5_link = (producer_link){"Process 3", my_pid, &terminate_flag,
+                            connect_channel, send_records, disconnect_channel,
+                            via_kind >= 0 ? XPORT_BATCH : 1,
+                            via_kind >= 0 ? XPORT_FLUSH_MS : 0};
+  if (!link_start(&p5_link)) {
+    perror("Process 3: Failed to allocate the spill buffer");
+    return EXIT_FAILURE;
+  }
+  if (credit_policy >= 0 &&
+      !credit_start(&credits, 3, credit_policy, "Process 3", my_pid)) {
+    perror("Process 3: Failed to set up flow control");
     return EXIT_FAILURE;
   }
+  if (credit_policy >= 0)
+    p5_link.connected = resume_credits;
+  tuning_report("Process 3", my_pid);
+  notify_ready();
 
   double input_float;
-  mq_msg_float msg;
-  msg.mtype = 1;
-  msg.source_pid = my_pid;
+  line_reader input = {0};
+  char line[LINE_READER_SIZE];
+  long long last_send_ms = 0;
+  int prompt_shown = 0;
 
-  printf("%s%s[Process 3 - PID: %d] Message Queue opened. Enter floats "
-         "(Ctrl+D or signal to stop):\n%s",
-         fg_code, bg_code, my_pid, COLOR_RESET);
-  fflush(stdout);
-
-  while (!terminate_flag) {
-    printf("%s%sP3 Input> %s", fg_code, bg_code, COLOR_RESET);
+  if (gen.enabled) {
+    run_generator(&gen, credit_policy >= 0 ? &credits : NULL);
+  } else {
+    printf("%s%s[Process 3 - PID: %d] Enter floats (Ctrl+D or signal to "
+           "stop):\n%s",
+           fg_code, bg_code, my_pid, COLOR_RESET);
     fflush(stdout);
+  }
 
-    sleep(1);
-    if (kbhit()) {
-      if (scanf("%lf", &input_float) == 1) {
-        while (getchar() != '\n')
-          ;
-
-        msg.value = input_float;
-
-        if (mq_send(mq, (const char *)&msg, sizeof(msg), 0) == -1) {
-          perror("Process 3: Failed to send message");
-          terminate_flag = 1;
-        }
-
-      } else {
-        if (feof(stdin)) {
-          printf("\n%s%s[Process 3 - PID: %d] EOF detected on input. "
-                 "Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-        } else {
-          printf("\n%s%s[Process 3 - PID: %d] Invalid input. Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-          while (getchar() != '\n' && !feof(stdin) && !ferror(stdin))
-            ;
-        }
-        terminate_flag = 1;
-        break;
+  // Interactive mode: values come from stdin
+  while (!gen.enabled && !terminate_flag) {
+    int have_line = line_reader_has_line(&input);
+    if (!have_line && input.eof) {
+      printf("\n%s%s[Process 3 - PID: %d] EOF detected on input. "
+             "Terminating.%s\n",
+             fg_code, bg_code, my_pid, COLOR_RESET);
+      break;
+    }
+
+    int timeout_ms = pacing_timeout(delay_ms, last_send_ms, have_line);
+    if (timeout_ms != 0) {
+      if (!have_line && !prompt_shown) {
+        printf("%s%sP3 Input> %s", fg_code, bg_code, COLOR_RESET);
+        fflush(stdout);
+        prompt_shown = 1;
       }
+      if (wait_and_poll(!have_line, timeout_ms) & PRODUCER_EV_INPUT)
+        line_reader_fill(&input, STDIN_FILENO);
+      continue;
     }
 
-    if (!terminate_flag && delay_ms > 0) {
-      usleep(delay_ms * 1000);
+    line_reader_next(&input, line, sizeof(line));
+    prompt_shown = 0;
+    if (line[strspn(line, " \t\r")] == '\0')
+      continue;
+    if (sscanf(line, "%lf", &input_float) != 1) {
+      printf("\n%s%s[Process 3 - PID: %d] Invalid input. Terminating.%s\n",
+             fg_code, bg_code, my_pid, COLOR_RESET);
+      terminate_flag = 1;
+      break;
     }
+
+    // Interactive values are sent right away, not batched
+    last_send_ms = monotonic_ms();
+    if (!send_value(input_float))
+      break;
+    link_flush(&p5_link);
   }
 
+  link_finish(&p5_link);
+  console_close();
+
   printf("%s%s[Process 3 - PID: %d] Terminating and closing Message Queue.%s\n",
          fg_code, bg_code, my_pid, COLOR_RESET);
-
-  if (mq != (mqd_t)-1) {
-    mq_close(mq);
-    mq_unlink(MSGQ_NAME);
-  }
+  if (credit_policy >= 0)
+    credit_detach(&credits);
 
   return EXIT_SUCCESS;
 }
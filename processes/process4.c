@@ -1,155 +1,338 @@
+#define _GNU_SOURCE // sched_setaffinity (tuning.h)
 #include "common.h"
+#include "loadgen.h"
+#include "shm_ring.h"
+#include "spill.h"
+#include "transport.h"
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
 
 volatile sig_atomic_t terminate_flag = 0;
+uint64_t last_seq = 0; // Sequence number of the last string sent
+pid_t my_pid;
+const char *fg_code, *bg_code;
+int use_shm, via_kind;
+int sock_fd = -1;
+shm_ring_producer ring = {NULL};
+transport via;         // --via: a shared transport instead of the socket
+producer_link p5_link; // Buffers strings while P5 is away, see spill.h
+credit_client credits; // --credits
 
-void handle_sigterm(int sig) { terminate_flag = 1; }
+void handle_sigterm(int sig) {
+  terminate_flag = 1;
+  notify_signal_pipe();
+}
+
+// Connects to P5's socket. Returns the socket or -1 with errno set.
+int connect_to_p5() {
+  struct sockaddr_un server_addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  // Prepare server address
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sun_family = AF_UNIX;
+  strncpy(server_addr.sun_path, SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// Opens the selected channel. Called again and again while P5 is away, so
+// failures are not reported.
+int connect_channel() {
+  if (via_kind >= 0)
+    return transport_open(&via, via_kind, 0);
+  if (use_shm)
+    return shm_ring_attach(&ring, SHM_RING_P4);
+  sock_fd = connect_to_p5();
+  return sock_fd >= 0;
+}
+
+// A ring P5 left behind may still hold values; they are taken back.
+void disconnect_channel(int lost) {
+  if (lost && ring.ring)
+    link_reclaim_ring(&p5_link, &ring);
+  transport_close(&via);
+  shm_ring_detach(&ring);
+  if (sock_fd >= 0)
+    close(sock_fd);
+  sock_fd = -1;
+}
+
+// The descriptor whose hangup means P5 went away, -1 if there is none.
+int channel_fd() {
+  if (!p5_link.up)
+    return -1;
+  return via.ops ? transport_fd(&via) : sock_fd;
+}
+
+// Sends one length-prefixed frame per record, resuming after short sends.
+// Returns how many records were sent.
+size_t send_frames(const xport_msg *msgs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned char frame[SOCK_FRAME_MAX];
+    sock_frame_header hdr = {0};
+    hdr.len = msgs[i].len;
+    hdr.source_pid = msgs[i].source_pid;
+    hdr.seq = msgs[i].seq;
+    hdr.send_ns = msgs[i].send_ns;
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), msgs[i].value.s, hdr.len);
+
+    size_t total = sizeof(hdr) + hdr.len, sent = 0;
+    while (sent < total) {
+      ssize_t n = send(sock_fd, frame + sent, total - sent, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR && !terminate_flag)
+          continue;
+        if (errno != EPIPE && errno != ECONNRESET) // P5 went away
+          perror("Process 4: Failed to send data");
+        return i;
+      }
+      sent += n;
+    }
+  }
+  return n;
+}
+
+// Adds the summary line if one is due and writes what the terminal takes.
+void render_console() {
+  uint64_t n[CONSOLE_KINDS];
+  double seconds = console_summary_due(n);
+  if (seconds > 0 && n[4] > 0)
+    console_printf("%s%s[Process 4 - PID: %d] Sent %llu strings in %.1f s "
+                   "(%.0f/s)%s\n",
+                   fg_code, bg_code, my_pid, (unsigned long long)n[4],
+                   seconds, n[4] / seconds, COLOR_RESET);
+  console_flush();
+}
+
+size_t send_records(const xport_msg *msgs, size_t n) {
+  size_t sent = via.ops     ? link_send_transport(&p5_link, &via, msgs, n)
+                : ring.ring ? link_send_ring(&p5_link, &ring, msgs, n)
+                            : send_frames(msgs, n);
+  for (size_t i = 0; i < sent; i++)
+    if (console_line(4))
+      console_printf("%s%s[Process 4 - PID: %d] Sent: \"%.*s\"%s\n",
+                     fg_code, bg_code, my_pid, (int)msgs[i].len,
+                     msgs[i].value.s, COLOR_RESET);
+  render_console();
+  return sent;
+}
+
+// Queues one string; the link sends it with the next batch. Returns 0 if
+// the process should terminate.
+int send_value(const char *value, size_t len) {
+  if (len > SOCK_MSG_MAX_LEN)
+    len = SOCK_MSG_MAX_LEN;
+  xport_msg m = {SHM_CH_P4, len, my_pid, ++last_seq, monotonic_ns(), {0}};
+  memcpy(m.value.s, value, len);
+  return link_send(&p5_link, &m);
+}
+
+// Waits for pacing, input (if want_input) or the link, whichever is due
+// first, and reconnects or flushes when the link is due. Returns the
+// PRODUCER_EV_* bits.
+int wait_and_poll(int want_input, int timeout_ms) {
+  int ev = producer_wait(want_input, channel_fd(),
+                         link_timeout(&p5_link, timeout_ms));
+  if (ev & PRODUCER_EV_CHANNEL_CLOSED)
+    link_lost(&p5_link);
+  link_poll(&p5_link);
+  render_console();
+  return ev;
+}
+
+// Flow control lapses while P5 is away; picks it up again from the P5
+// the link reconnected to.
+void resume_credits() { credit_resume(&credits, "Process 4", my_pid); }
+
+// Sends the held-back strings the credits allow. A transport batch is sent
+// as soon as they run out, as P5 cannot grant more before it arrives.
+int send_held(credit_client *credits) {
+  const credit_item *item;
+  while ((item = credit_next(credits))) {
+    if (!send_value(item->value.s, item->len))
+      return 0;
+    credit_sent(credits, last_seq);
+  }
+  if (credit_available(credits) == 0)
+    link_flush(&p5_link);
+  return 1;
+}
+
+// Sends generated strings until the generator's count or duration is
+// reached. With credits (NULL = none) every string goes through the flow
+// control policy, and what it still holds is sent before returning.
+void run_generator(loadgen *gen, credit_client *credits) {
+  credit_item item;
+  loadgen_start(gen);
+  while (!terminate_flag) {
+    if (credits && !send_held(credits))
+      break;
+    int wait_ms = loadgen_wait_ms(gen);
+    if (wait_ms < 0) {
+      if (!credits || !credit_held(credits) ||
+          !credit_wait(credits, &terminate_flag))
+        break;
+      continue;
+    }
+    if (wait_ms > 0) {
+      wait_and_poll(0, wait_ms);
+      continue;
+    }
+
+    // One spare byte for the terminator loadgen_string() writes
+    char value[SOCK_MSG_MAX_LEN + 1];
+    item.len = loadgen_string(gen, value, sizeof(value));
+    if (credits) {
+      memcpy(item.value.s, value, item.len);
+      if (!credit_offer(credits, &item, &terminate_flag))
+        break;
+    } else if (!send_value(value, item.len)) {
+      break;
+    }
+    loadgen_sent(gen, via_kind >= 0 ? offsetof(xport_msg, value) + item.len
+                      : use_shm     ? sizeof(shm_ring_slot)
+                                    : sizeof(sock_frame_header) + item.len);
+  }
+  link_flush(&p5_link);
+  loadgen_report(gen, "Process 4", my_pid);
+  if (credits)
+    credit_report(credits, "Process 4", my_pid);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <fg_color> <bg_color> <delay_ms>\n", argv[0]);
+  loadgen gen;
+  int credit_policy;
+  if (argc < 4 || !producer_parse_options(argc, argv, "socket", &use_shm,
+                                          &via_kind, &gen, &credit_policy)) {
+    fprintf(stderr,
+            "Usage: %s <fg_color> <bg_color> <delay_ms (0 = no pacing)> "
+            "[socket|shm|--via fifo|mq|stream|seqpacket] [--gen <spec> "
+            "[--credits block|coalesce|sample|drop-oldest]] "
+            "[--console all|sample:N|summary[:ms]|quiet]\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
 
   int fg_color = atoi(argv[1]);
   int bg_color = atoi(argv[2]);
   int delay_ms = atoi(argv[3]);
-  pid_t my_pid = getpid();
+  my_pid = getpid();
+  tuning_apply();
+  // Generated load is too fast to echo in full
+  console_open(gen.enabled ? CONSOLE_QUIET : CONSOLE_ALL);
 
-  const char *fg_code = get_color_code(fg_color, 0);
-  const char *bg_code = get_color_code(bg_color, 1);
+  fg_code = get_color_code(fg_color, 0);
+  bg_code = get_color_code(bg_color, 1);
 
+  if (!setup_signal_pipe()) {
+    perror("Process 4: Failed to create signal pipe");
+    return EXIT_FAILURE;
+  }
   signal(SIGTERM, handle_sigterm);
+  signal(SIGPIPE, SIG_IGN); // P5 going away shows up as EPIPE instead
 
-  printf("%s%s[Process 4 - PID: %d] Started. Delay: %d ms. Reading strings -> "
-         "Socket (%s)%s\n",
-         fg_code, bg_code, my_pid, delay_ms, SOCKET_PATH, COLOR_RESET);
+  // One banner, naming the channel actually in use
+  printf("%s%s[Process 4 - PID: %d] Started. Pacing: %d ms. Reading strings "
+         "-> %s (%s)%s\n",
+         fg_code, bg_code, my_pid, delay_ms,
+         via_kind >= 0 ? "Transport"
+         : use_shm     ? "Shared-memory ring"
+                       : "Socket",
+         via_kind >= 0 ? xport_backends[via_kind].name
+         : use_shm     ? SHM_RING_P4
+                       : SOCKET_PATH,
+         COLOR_RESET);
   fflush(stdout);
 
-  int sock_fd = -1;
-  struct sockaddr_un server_addr;
-
-  // Create socket
-  sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sock_fd < 0) {
-    perror("Process 4: Failed to create socket");
-    printf("%s%s[Process 4 - PID: %d] Terminating due to Socket error.%s\n",
-           fg_code, bg_code, my_pid, COLOR_RESET);
+  // The socket and the ring take one string at a time; transports take
+  // batches
+  p5_link = (producer_link){"Process 4", my_pid, &terminate_flag,
+                            connect_channel, send_records, disconnect_channel,
+                            via_kind >= 0 ? XPORT_BATCH : 1,
+                            via_kind >= 0 ? XPORT_FLUSH_MS : 0};
+  if (!link_start(&p5_link)) {
+    perror("Process 4: Failed to allocate the spill buffer");
     return EXIT_FAILURE;
   }
-
-  // Prepare server address
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sun_family = AF_UNIX;
-  strncpy(server_addr.sun_path, SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
-
-  // Connect to server (P5) - Retry briefly if P5 isn't ready yet
-  int connection_attempts = 5;
-  while (connect(sock_fd, (struct sockaddr *)&server_addr,
-                 sizeof(server_addr)) < 0) {
-    if (errno == ENOENT ||
-        errno ==
-            ECONNREFUSED) { // Socket file doesn't exist or server not listening
-      connection_attempts--;
-      if (connection_attempts <= 0) {
-        perror("Process 4: Failed to connect to socket after retries");
-        printf("%s%s[Process 4 - PID: %d] Terminating - P5 not available?%s\n",
-               fg_code, bg_code, my_pid, COLOR_RESET);
-        close(sock_fd);
-        return EXIT_FAILURE;
-      }
-      printf("%s%s[Process 4 - PID: %d] P5 socket not ready, retrying...%s\n",
-             fg_code, bg_code, my_pid, COLOR_RESET);
-      sleep(1); // Wait 1 second before retrying
-    } else {
-      perror("Process 4: Error connecting to socket");
-      close(sock_fd);
-      printf("%s%s[Process 4 - PID: %d] Terminating due to Socket connection "
-             "error.%s\n",
-             fg_code, bg_code, my_pid, COLOR_RESET);
-      return EXIT_FAILURE;
-    }
+  if (credit_policy >= 0 &&
+      !credit_start(&credits, 4, credit_policy, "Process 4", my_pid)) {
+    perror("Process 4: Failed to set up flow control");
+    return EXIT_FAILURE;
   }
-
-  printf("%s%s[Process 4 - PID: %d] Connected to P5 socket.%s\n", fg_code,
-         bg_code, my_pid, COLOR_RESET);
-  fflush(stdout);
+  if (credit_policy >= 0)
+    p5_link.connected = resume_credits;
+  tuning_report("Process 4", my_pid);
+  notify_ready();
 
   char input_string[SOCK_MSG_MAX_LEN];
-  sock_msg_string msg;
-  msg.source_pid = my_pid;
 
-  printf(
-      "%s%s[Process 4 - PID: %d] Enter strings (Ctrl+D or signal to stop):\n%s",
-      fg_code, bg_code, my_pid, COLOR_RESET);
-  fflush(stdout);
+  line_reader input = {0};
+  long long last_send_ms = 0;
+  int prompt_shown = 0;
 
-  while (!terminate_flag) {
-    printf("%s%sP4 Input> %s", fg_code, bg_code, COLOR_RESET);
+  if (gen.enabled) {
+    run_generator(&gen, credit_policy >= 0 ? &credits : NULL);
+  } else {
+    printf("%s%s[Process 4 - PID: %d] Enter strings (Ctrl+D or signal to "
+           "stop):\n%s",
+           fg_code, bg_code, my_pid, COLOR_RESET);
     fflush(stdout);
-    sleep(1);
-
-    if (kbhit()) {
+  }
 
-      if (fgets(input_string, sizeof(input_string), stdin) != NULL) {
-        input_string[strcspn(input_string, "\n")] =
-            0; // Remove trailing newline
+  // Interactive mode: values come from stdin
+  while (!gen.enabled && !terminate_flag) {
+    int have_line = line_reader_has_line(&input);
+    if (!have_line && input.eof) {
+      printf("\n%s%s[Process 4 - PID: %d] EOF detected on input. "
+             "Terminating.%s\n",
+             fg_code, bg_code, my_pid, COLOR_RESET);
+      break;
+    }
 
-        if (strlen(input_string) == 0 && !terminate_flag) {
-          continue;
-        }
-
-        strncpy(msg.value, input_string, SOCK_MSG_MAX_LEN - 1);
-        msg.value[SOCK_MSG_MAX_LEN - 1] = '\0'; // Ensure null termination
-
-        ssize_t bytes_sent = send(sock_fd, &msg, sizeof(msg), 0);
-        if (bytes_sent < 0) {
-          if (errno == EPIPE) {
-            printf("\n%s%s[Process 4 - PID: %d] Detected P5 closed the socket "
-                   "connection. Terminating.%s\n",
-                   fg_code, bg_code, my_pid, COLOR_RESET);
-            terminate_flag = 1;
-          } else {
-            perror("Process 4: Failed to send data");
-            terminate_flag = 1;
-          }
-        } else if (bytes_sent < sizeof(msg)) {
-          fprintf(
-              stderr,
-              "%s%s[Process 4 - PID: %d] Warning: Partial send on socket.%s\n",
-              fg_code, bg_code, my_pid, COLOR_RESET);
-        } else {
-          printf("%s%s[Process 4 - PID: %d] Sent: \"%s\"%s\n", fg_code, bg_code,
-                 my_pid, msg.value, COLOR_RESET);
-          fflush(stdout);
-        }
-      } else {
-        if (feof(stdin)) {
-          printf("\n%s%s[Process 4 - PID: %d] EOF detected on input. "
-                 "Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-        } else {
-          printf("\n%s%s[Process 4 - PID: %d] Input error. Terminating.%s\n",
-                 fg_code, bg_code, my_pid, COLOR_RESET);
-        }
-        terminate_flag = 1;
-        break;
+    int timeout_ms = pacing_timeout(delay_ms, last_send_ms, have_line);
+    if (timeout_ms != 0) {
+      if (!have_line && !prompt_shown) {
+        printf("%s%sP4 Input> %s", fg_code, bg_code, COLOR_RESET);
+        fflush(stdout);
+        prompt_shown = 1;
       }
+      if (wait_and_poll(!have_line, timeout_ms) & PRODUCER_EV_INPUT)
+        line_reader_fill(&input, STDIN_FILENO);
+      continue;
     }
 
-    if (!terminate_flag && delay_ms > 0) {
-      usleep(delay_ms * 1000);
-    }
+    line_reader_next(&input, input_string, sizeof(input_string));
+    prompt_shown = 0;
+    size_t len = strlen(input_string);
+    if (len == 0)
+      continue;
+
+    // Interactive strings are sent right away, not batched
+    last_send_ms = monotonic_ms();
+    if (!send_value(input_string, len))
+      break;
+    link_flush(&p5_link);
   }
 
+  link_finish(&p5_link);
+  console_close();
+
   printf("%s%s[Process 4 - PID: %d] Terminating and closing socket.%s\n",
          fg_code, bg_code, my_pid, COLOR_RESET);
-  if (sock_fd >= 0) {
-    close(sock_fd);
-  }
+  if (credit_policy >= 0)
+    credit_detach(&credits);
 
   return EXIT_SUCCESS;
 }
@@ -1,7 +1,25 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <string.h>
 #define _POSIX_C_SOURCE 200809L // Или може да опитате с 199309L
+#include "aggregate.h"
 #include "common.h"
+#include "console.h"
+#include "credits.h"
+#include "ingest_queue.h"
+#include "latency.h"
+#include "log_writer.h"
+#include "logidx.h"
+#include "p5_stats.h"
+#include "rawcap.h"
+#include "shm_ring.h"
+#include "transport.h"
+#include "tuning.h"
+#include "uring.h"
+#include <getopt.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
@@ -12,8 +30,205 @@ volatile sig_atomic_t terminate_flag = 0;
 int fifo_p2_fd = -1;  // <<<--- ПРОМЯНА: Преименуван за яснота
 mqd_t mq = (mqd_t)-1; // Message queue descriptor
 int listen_sock_fd = -1;
-int client_sock_fd = -1;
-FILE *log_file = NULL;
+log_writer *logger = NULL; // Writes the log file on its own thread
+int binary_log = 0;         // Typed records in segments instead of text
+int raw_capture = 0;        // -f raw: channel bytes spliced to a capture file
+rawcap_writer capture;
+uint32_t capture_streams = 0;   // Numbers the captured P4 connections
+uint64_t capture_fifo_bytes = 0; // For the P2 message count on the stats page
+logidx_builder log_index = {-1};
+int aggregate = 0; // -a: log window summaries instead of values
+aggregator agg;
+
+// Delivery latency per transport (P5_CH_*), since the last report and in
+// total
+latency_hist lat_interval[P5_CHANNELS];
+latency_hist lat_total[P5_CHANNELS];
+p5_stats_page *stats = NULL; // Published counters, see p5_stats.h
+seq_tracker delivery_seq = {0};
+credit_page *credits = NULL;   // Flow control for producers, see credits.h
+uint32_t credit_window = CREDIT_DEFAULT_WINDOW; // -c, 0 = no flow control
+int credits_throttled = 0; // The last grant was below the full window
+int latency_report_s = 10; // 0 = only at shutdown
+long long next_latency_report_ms = 0;
+
+// P3 message queue geometry (0 = default) and how full it runs
+long mq_depth = 0;
+long mq_msg_size = 0;
+char *mq_buf = NULL; // One message of the queue's actual mq_msgsize
+struct mq_attr mq_actual;
+long mq_peak = 0;         // Most messages waiting in the queue at a wakeup
+long long mq_drains = 0;  // Wakeups that found at least one message
+long long mq_drained = 0; // Messages received in total
+long long mq_full_drains = 0; // Wakeups that found every slot taken
+
+// Bytes read from FIFO P2 that do not yet form a complete record
+#define FIFO_READ_BUF_SIZE 65536
+unsigned char fifo_p2_buf[FIFO_READ_BUF_SIZE];
+size_t fifo_p2_len = 0;
+
+// Shared-memory rings (P2, P3, P4) and the FIFO producers ring to wake us
+#define P5_RING_COUNT 3
+const char *ring_names[P5_RING_COUNT] = {SHM_RING_P2, SHM_RING_P3,
+                                         SHM_RING_P4};
+shm_ring *rings[P5_RING_COUNT] = {NULL};
+int doorbell_fd = -1;
+
+// P5's end of every shared transport (transport.h)
+transport xports[XPORT_KINDS];
+
+// --- Event sources ---
+// Every descriptor registered with epoll has a slot in this slab; the slot
+// index is stored in the epoll event, so lookups are O(1) however many
+// producers are connected.
+typedef enum {
+  SRC_FIFO_P2,
+  SRC_MQ_P3,
+  SRC_LISTENER,
+  SRC_CLIENT,
+  SRC_DOORBELL,
+  SRC_HANDOFF, // Threaded mode: connections accepted by another reader
+  SRC_XPORT,   // A transport endpoint or an accepted transport connection
+  SRC_XPORT_LISTENER
+} p5_source_type;
+
+// Receive buffer of a P4 connection; holds at most one partial frame
+// between reads.
+#define SOCK_RX_BUF_SIZE 65536
+typedef struct {
+  size_t len;
+  unsigned char data[SOCK_RX_BUF_SIZE];
+} sock_rx_buf;
+
+typedef struct {
+  int in_use;
+  p5_source_type type;
+  int fd;
+  int next_free;   // Free-list link while not in use
+  unsigned gen;    // Bumped on reuse; tells stale io_uring completions apart
+  sock_rx_buf *rx; // SRC_CLIENT only, unless capturing
+  uint32_t stream; // SRC_CLIENT: connection number in a raw capture
+  transport *xport; // SRC_XPORT*; allocated for accepted connections
+} p5_source;
+
+// One epoll set and the sources registered with it. The default mode runs
+// a single loop with every source on the main thread; threaded mode (-T)
+// gives every reader thread a loop of its own, so a source is only ever
+// touched by the thread that owns it.
+typedef struct {
+  const char *name;
+  int epoll_fd; // -1 for the io_uring backend
+  p5_source *sources;
+  int sources_cap;
+  int sources_free;
+  int rings;      // Consumes the shared-memory rings
+  int handoff[2]; // Pipe of accepted P4 connections, threaded mode only
+  int cpu;        // Pinned CPU, -1 = not pinned
+  pthread_t thread;
+} p5_loop;
+
+p5_loop *loops = NULL;
+int loop_count = 0;
+_Atomic int client_count = 0;
+
+// --- Threaded ingest ---
+// Reader threads for FIFO P2, the P3 queue, the rings and socket_readers
+// groups of P4 connections parse messages into ingest_q; the main thread
+// consumes it and is the only one that renders, logs and keeps statistics
+// for messages. Readers print their own connection notices (accepted,
+// closed, errors) straight to stdout; those are rare, and stdio locks
+// each call.
+int socket_readers = 0; // -T; 0 = everything on the main thread
+int first_socket_loop = 0;
+int next_socket_loop = 0; // Round-robin target for accepted connections
+ingest_queue ingest_q;
+
+// --- io_uring backend ---
+// With -b uring the single-threaded loop runs on io_uring instead of epoll:
+// multishot accept and recv for P4 (into provided buffers), a READ_FIXED
+// into the registered fifo_p2_buf for P2, and multishot polls for the
+// message queue and the ring doorbell, all submitted in one io_uring_enter()
+// per iteration together with the wait.
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_RECV_GROUP 1
+#define URING_RECV_BUFS 64 // Power of two
+// A chunk always fits in a sock_rx_buf next to a partial frame
+#define URING_RECV_BUF_SIZE 16384
+enum {
+  URING_FIFO_P2 = 1,
+  URING_MQ_P3,
+  URING_ACCEPT,
+  URING_DOORBELL,
+  URING_CLIENT,
+  URING_XPORT // Transport sources, by generation and index as clients
+};
+// user_data: request kind in the top byte; for P4 connections the source
+// generation and index below it
+#define URING_DATA(kind, gen, idx)                                             \
+  ((uint64_t)(kind) << 56 | (uint64_t)((gen) & 0xFFFFFF) << 32 |               \
+   (uint32_t)(idx))
+int use_uring = 0;
+uring ring;
+uring_buf_ring recv_bufs;
+
+#define P5_MAX_EVENTS 64
+
+// --- Log records ---
+// Text mode writes "[<seconds>] P<channel>(<pid>): <value>" lines; binary
+// mode writes binlog records with nanosecond timestamps.
+void logBinary(binlog_record *rec, const char *str) {
+  unsigned char buf[sizeof(binlog_record) + SOCK_MSG_MAX_LEN + 8] = {0};
+  rec->timestamp_ns = realtime_ns();
+  if (rec->type == BINLOG_STRING && rec->len > SOCK_MSG_MAX_LEN)
+    rec->len = SOCK_MSG_MAX_LEN;
+  memcpy(buf, rec, sizeof(*rec));
+  if (rec->type == BINLOG_STRING)
+    memcpy(buf + sizeof(*rec), str, rec->len);
+  log_writer_append_record(logger, buf, binlog_record_size(rec));
+}
+
+void logInt(int channel, int pid, int value) {
+  if (!logger)
+    return;
+  if (binary_log) {
+    binlog_record rec = {channel, BINLOG_INT, 0, pid, 0, {.i = value}};
+    logBinary(&rec, NULL);
+  } else {
+    long ts = (long)time(NULL);
+    logidx_add(&log_index, logger->appended, ts, pid);
+    log_writer_printf(logger, "[%ld] P%d(%d): %d\n", ts, channel, pid,
+                      value);
+  }
+}
+
+void logDouble(int channel, int pid, double value) {
+  if (!logger)
+    return;
+  if (binary_log) {
+    binlog_record rec = {channel, BINLOG_DOUBLE, 0, pid, 0, {.d = value}};
+    logBinary(&rec, NULL);
+  } else {
+    long ts = (long)time(NULL);
+    logidx_add(&log_index, logger->appended, ts, pid);
+    log_writer_printf(logger, "[%ld] P%d(%d): %f\n", ts, channel, pid,
+                      value);
+  }
+}
+
+void logString(int channel, int pid, const char *str, int len) {
+  if (!logger)
+    return;
+  if (binary_log) {
+    binlog_record rec = {channel, BINLOG_STRING, len, pid, 0, {0}};
+    logBinary(&rec, str);
+  } else {
+    long ts = (long)time(NULL);
+    logidx_add(&log_index, logger->appended, ts, pid);
+    log_writer_printf(logger, "[%ld] P%d(%d): %.*s\n", ts, channel, pid, len,
+                      str);
+  }
+}
 
 void handle_sigterm(int sig) {
   terminate_flag = 1;
@@ -24,9 +239,22 @@ void handle_sigterm(int sig) {
 void cleanup_ipc() {
   printf("[Process 5] Cleaning up IPC resources...\n");
   fflush(stdout);
-  if (log_file) {
-    fclose(log_file);
-    log_file = NULL;
+  if (logger) {
+    log_writer_close(logger);
+    logger = NULL;
+  }
+  if (raw_capture)
+    rawcap_close(&capture);
+  logidx_close(&log_index);
+  if (stats) {
+    munmap(stats, sizeof(*stats));
+    stats = NULL;
+    shm_unlink(P5_STATS_SHM);
+  }
+  if (credits) {
+    credit_page_unmap(credits);
+    credits = NULL;
+    shm_unlink(P5_CREDITS_SHM);
   }
   if (fifo_p2_fd >= 0) {
     close(fifo_p2_fd);
@@ -37,15 +265,57 @@ void cleanup_ipc() {
     mq_unlink(MSGQ_NAME);
     mq = (mqd_t)-1;
   }
+  free(mq_buf);
+  mq_buf = NULL;
   // if (mq != (mqd_t)-1) { mq_close(mq); mq = (mqd_t)-1; } // <<<--- ПРЕМАХНАТО
-  if (client_sock_fd >= 0) {
-    close(client_sock_fd);
-    client_sock_fd = -1;
+  for (int l = 0; l < loop_count; l++) {
+    p5_loop *loop = &loops[l];
+    for (int i = 0; i < loop->sources_cap; i++) {
+      p5_source *src = &loop->sources[i];
+      if (src->in_use && src->type == SRC_CLIENT) {
+        close(src->fd);
+        free(src->rx);
+      } else if (src->in_use && src->type == SRC_XPORT &&
+                 !src->xport->server) {
+        transport_close(src->xport);
+        free(src->xport);
+      }
+    }
+    free(loop->sources);
+    if (loop->epoll_fd >= 0)
+      close(loop->epoll_fd);
+    if (loop->handoff[0] >= 0) {
+      close(loop->handoff[0]);
+      close(loop->handoff[1]);
+    }
+  }
+  free(loops);
+  loops = NULL;
+  loop_count = 0;
+  ingest_queue_free(&ingest_q);
+  if (use_uring) {
+    uring_buf_ring_free(&ring, &recv_bufs);
+    uring_free(&ring);
   }
   if (listen_sock_fd >= 0) {
     close(listen_sock_fd);
     listen_sock_fd = -1;
   }
+  for (int k = 0; k < XPORT_KINDS; k++)
+    transport_close(&xports[k]);
+
+  for (int i = 0; i < P5_RING_COUNT; i++) {
+    shm_ring_unmap(rings[i]);
+    rings[i] = NULL;
+    if (shm_unlink(ring_names[i]) < 0 && errno != ENOENT)
+      perror("  shm_unlink ring failed");
+  }
+  if (doorbell_fd >= 0) {
+    close(doorbell_fd);
+    doorbell_fd = -1;
+  }
+  if (unlink(SHM_RING_DOORBELL) < 0 && errno != ENOENT)
+    perror("  unlink ring doorbell failed");
 
   if (unlink(FIFO_PATH_P2) < 0 && errno != ENOENT)
     perror("  unlink fifo_p2 failed");
@@ -63,9 +333,9 @@ int openP2File() {
     perror("  ERROR: Failed to create FIFO P2");
     return 0;
   }
-  fifo_p2_fd =
-      open(FIFO_PATH_P2,
-           O_RDONLY | O_NONBLOCK); // <<<--- ПРОМЯНА: Име на променлива и път
+  // O_RDWR keeps a writer reference of our own, so the FIFO never reports
+  // EOF and any number of P2 instances can come and go
+  fifo_p2_fd = open(FIFO_PATH_P2, O_RDWR | O_NONBLOCK);
   if (fifo_p2_fd < 0) {
     perror("  ERROR: Failed to open FIFO P2 for reading");
     return 0;
@@ -73,19 +343,60 @@ int openP2File() {
   return 1;
 }
 
+// Opens (or creates) P5's queue with the given geometry, lowering the depth
+// to the system limit when the requested one is not allowed.
+mqd_t createP3Queue(struct mq_attr *attr) {
+  mqd_t q =
+      mq_open(MSGQ_NAME, O_RDONLY | O_CREAT | O_NONBLOCK, MSGQ_PERMS, attr);
+  if (q == (mqd_t)-1 && errno == EINVAL &&
+      attr->mq_maxmsg > mq_proc_limit("msg_max", 10)) {
+    // Root without CAP_SYS_RESOURCE: fall back to the system limit
+    attr->mq_maxmsg = mq_proc_limit("msg_max", 10);
+    fprintf(stderr, "  Queue depth beyond %smsg_max needs CAP_SYS_RESOURCE; "
+                    "using %ld\n",
+            MQ_PROC_DIR, attr->mq_maxmsg);
+    q = mq_open(MSGQ_NAME, O_RDONLY | O_CREAT | O_NONBLOCK, MSGQ_PERMS, attr);
+  }
+  if (q == (mqd_t)-1) {
+    perror("  ERROR: Failed to open message queue");
+    if (errno == EMFILE)
+      fprintf(stderr, "  Queue of %ld x %ld bytes exceeds RLIMIT_MSGQUEUE; "
+                      "lower the depth or raise `ulimit -q`\n",
+              attr->mq_maxmsg, attr->mq_msgsize);
+    else if (errno == EINVAL)
+      fprintf(stderr, "  Message size %ld is beyond %smsgsize_max\n",
+              attr->mq_msgsize, MQ_PROC_DIR);
+  }
+  return q;
+}
+
 int openP3File() {
   struct mq_attr attr;
+  if (!mq_fill_attr(&attr, mq_depth, mq_msg_size, "Process 5"))
+    return 0;
 
-  attr.mq_flags = 0;
-  attr.mq_maxmsg = 10;
-  attr.mq_msgsize = sizeof(mq_msg_float);
-  attr.mq_curmsgs = 0;
-
-  mq = mq_open(MSGQ_NAME, O_RDONLY | O_CREAT | O_NONBLOCK, 0666, &attr);
-  if (mq == (mqd_t)-1) {
-    perror("  ERROR: Failed to open message queue");
+  mq = createP3Queue(&attr);
+  if (mq == (mqd_t)-1)
     return 0;
+
+  // A queue left over from an earlier run (or created first by a P3) keeps
+  // its old geometry; recreate it so the requested one takes effect
+  mq_getattr(mq, &mq_actual);
+  if (mq_actual.mq_maxmsg != attr.mq_maxmsg ||
+      mq_actual.mq_msgsize != attr.mq_msgsize) {
+    mq_close(mq);
+    mq_unlink(MSGQ_NAME);
+    mq = createP3Queue(&attr);
+    if (mq == (mqd_t)-1)
+      return 0;
+    mq_getattr(mq, &mq_actual);
   }
+
+  mq_buf = malloc(mq_actual.mq_msgsize);
+  if (!mq_buf)
+    return 0;
+  printf("[Process 5] P3 message queue: depth %ld, message size %ld bytes\n",
+         mq_actual.mq_maxmsg, mq_actual.mq_msgsize);
   return 1;
 }
 
@@ -107,7 +418,7 @@ int openP4File() {
       listen_sock_fd = -1;
       return 0;
     }
-    if (listen(listen_sock_fd, 1) < 0) {
+    if (listen(listen_sock_fd, SOMAXCONN) < 0) {
       perror("  ERROR: Failed to listen on socket");
       close(listen_sock_fd);
       listen_sock_fd = -1;
@@ -118,222 +429,1347 @@ int openP4File() {
   return 1;
 }
 
-void errorOnStart() {
-  printf("[Process 5] CRITICAL: Failed to initialize one or more IPC "
-         "mechanisms. Terminating.\n");
-  fflush(stderr);
-  cleanup_ipc();
+int openTransports() {
+  for (int k = 0; k < XPORT_KINDS; k++) {
+    if (!transport_open(&xports[k], k, 1)) {
+      fprintf(stderr, "  ERROR: Failed to open the %s transport: %s\n",
+              xport_backends[k].name, strerror(errno));
+      return 0;
+    }
+  }
+  return 1;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <log_filename>\n", argv[0]);
-    return EXIT_FAILURE;
+// Records one delivered message: its latency from the producer's send
+// timestamp, its place in the producer's sequence and the channel counters.
+void recordDelivery(int transport, int channel, int pid, uint64_t seq,
+                    int64_t send_ns, size_t bytes) {
+  latency_record(&lat_interval[transport], monotonic_ns() - send_ns);
+  uint64_t lost = seq_track(&delivery_seq, channel, pid, seq);
+  if (stats) {
+    p5_channel_stats *ch = &stats->ch[transport];
+    p5_stat_add(&ch->messages, 1);
+    p5_stat_add(&ch->bytes, bytes);
+    if (lost)
+      p5_stat_add(&ch->lost, lost);
   }
-  const char *log_filename = argv[1];
+}
 
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = handle_sigterm;
-  sigaction(SIGTERM, &sa, NULL);
-  sigaction(SIGINT, &sa, NULL);
+// Publishes the backlog a channel had when it was last serviced.
+void setQueueDepth(int transport, uint64_t depth) {
+  if (stats)
+    p5_stat_set(&stats->ch[transport].queue_depth, depth);
+}
 
-  log_file = fopen(log_filename, "a");
-  if (!log_file) {
-    perror("Process 5: Failed to open log file");
-    return EXIT_FAILURE;
-  }
-  setvbuf(log_file, NULL, _IOLBF, BUFSIZ);
+// For channels with records of varying size: the backlog in bytes, counted
+// in messages of the mean size delivered on the channel so far.
+void setQueueBytes(int transport, uint64_t bytes) {
+  if (!stats)
+    return;
+  p5_channel_stats *ch = &stats->ch[transport];
+  uint64_t messages = p5_stat_get(&ch->messages);
+  uint64_t total = p5_stat_get(&ch->bytes);
+  setQueueDepth(transport, total ? bytes * messages / total : bytes > 0);
+}
 
-  if (!openP2File() || !openP3File() || !openP4File()) {
-    errorOnStart();
-    return EXIT_FAILURE;
+// Bytes the kernel holds for a pipe or socket; 0 if it cannot tell.
+uint64_t bytesWaiting(int fd) {
+  int n = 0;
+  return ioctl(fd, FIONREAD, &n) == 0 && n > 0 ? n : 0;
+}
+
+// Refreshes the counters that are not updated per message.
+void publishStats() {
+  if (!stats)
+    return;
+  p5_stat_set(&stats->clients, atomic_load(&client_count));
+  if (logger) {
+    p5_stat_set(&stats->log_bytes, atomic_load(&logger->bytes_written));
+    p5_stat_set(&stats->log_writes, atomic_load(&logger->writes));
+    p5_stat_set(&stats->log_write_ns_total,
+                atomic_load(&logger->write_ns_total));
+    p5_stat_set(&stats->log_write_ns_max, atomic_load(&logger->write_ns_max));
+    p5_stat_set(&stats->log_errors, atomic_load(&logger->write_errors));
+  } else if (raw_capture) {
+    // Captured chunks are written synchronously by the event loop
+    p5_stat_set(&stats->log_bytes, capture.bytes);
+    p5_stat_set(&stats->log_writes, capture.chunks);
+    p5_stat_set(&stats->log_errors, capture.errors);
   }
+  p5_stat_set(&stats->updated_ns, monotonic_ns());
+}
 
-  // --- Event Loop using poll() ---
-  struct pollfd fds[4]; // <<<--- Размерът 4 е все още ОК (fifo_p2, fifo_p3,
-                        // listener, client)
-  int nfds = 0;
-  int client_fds_index = -1;
+// Whether records are waiting for the log writer to go idle, in which case
+// the loops come back soon to hand them over.
+int logPending() { return logger && log_writer_pending(logger); }
 
-  memset(fds, 0, sizeof(fds));
+// How long the loops may sleep when idle: briefly while records wait for
+// the log writer or producers are throttled, since neither wakes them, and
+// while the terminal is behind on console output.
+int idleTimeoutMs() {
+  if (logPending() || credits_throttled)
+    return 1;
+  return console_pending() ? 10 : 500;
+}
 
-  // <<<--- ПРОМЯНА: Инициализация на pollfd масива ---
-  if (fifo_p2_fd != -1) {
-    fds[nfds].fd = fifo_p2_fd;
-    fds[nfds].events = POLLIN;
-    nfds++;
+// Refreshes every producer's grant: what P5 has delivered from it plus a
+// window scaled down by the headroom left in the ingest queue and the log
+// writer.
+void grantCredits() {
+  if (!credits)
+    return;
+  double headroom = logger ? log_writer_headroom(logger) : 1.0;
+  if (socket_readers > 0) {
+    double queue = 1.0 - (double)ingest_queue_depth(&ingest_q) /
+                             INGEST_QUEUE_SLOTS;
+    if (queue < headroom)
+      headroom = queue;
   }
-  if (mq != (mqd_t)-1) { // <<<--- НОВО: Добавяне на message queue
-    fds[nfds].fd = mq;
-    fds[nfds].events = POLLIN;
-    nfds++;
+  uint32_t window = credit_window * headroom;
+  if (window < CREDIT_MIN_WINDOW)
+    window = CREDIT_MIN_WINDOW;
+  credits_throttled = window < credit_window;
+  atomic_store_explicit(&credits->window, window, memory_order_relaxed);
+
+  for (int i = 0; i < CREDIT_SLOTS; i++) {
+    credit_slot *s = &credits->slots[i];
+    int32_t pid = atomic_load_explicit(&s->pid, memory_order_acquire);
+    if (pid == 0)
+      continue;
+    // Nothing older than the producer's baseline is owed to this P5
+    uint64_t delivered = seq_last(&delivery_seq, s->channel, pid);
+    uint64_t base = p5_stat_get(&s->base);
+    if (delivered < base)
+      delivered = base;
+    p5_stat_set(&s->delivered, delivered);
+    p5_stat_set(&s->granted, delivered + window);
   }
-  // if (mq != (mqd_t)-1) { ... } // <<<--- ПРЕМАХНАТО
-  if (listen_sock_fd != -1) {
-    fds[nfds].fd = listen_sock_fd;
-    fds[nfds].events = POLLIN;
-    nfds++;
+}
+
+// Raw capture does not parse messages, so it only feeds the stats page.
+void countCaptured(int transport, uint64_t messages, uint64_t bytes) {
+  if (!stats)
+    return;
+  p5_stat_add(&stats->ch[transport].messages, messages);
+  p5_stat_add(&stats->ch[transport].bytes, bytes);
+}
+
+// --- Aggregation ---
+// Summaries are logged as string records, so they read like any other line
+// of the log (and of p5_logconv's output).
+void logSummary(int channel, int pid, const agg_summary *sum) {
+  char text[SOCK_MSG_MAX_LEN];
+  int len = snprintf(text, sizeof(text), "window=%ds", agg.window_s);
+  if (agg.slide_s != agg.window_s)
+    len += snprintf(text + len, sizeof(text) - len, " slide=%ds", agg.slide_s);
+  len += snprintf(text + len, sizeof(text) - len,
+                  " n=%llu sum=%g min=%g max=%g mean=%g var=%g p50=%g "
+                  "p90=%g p99=%g",
+                  (unsigned long long)sum->count, sum->sum, sum->min,
+                  sum->max, sum->mean, sum->variance, sum->p50, sum->p90,
+                  sum->p99);
+  logString(channel, pid, text,
+            len < (int)sizeof(text) ? len : (int)sizeof(text) - 1);
+}
+
+// P4 strings are aggregated by length.
+void aggregateValue(int channel, int pid, double value) {
+  long now = (long)time(NULL);
+  aggregator_close(&agg, now, 0, logSummary);
+  aggregator_add(&agg, channel, pid, now, value);
+}
+
+// Prints, logs and accounts for one message. Called from a single thread
+// only (the main one), so the log, the histograms and the sequence tracker
+// never see concurrent updates.
+void deliver(const p5_msg *m) {
+  // 0: a shared transport, which names the producer in the message
+  static const int process[P5_CHANNELS] = {2, 3, 4, 2, 3, 4, 0, 0, 0, 0};
+  static const char *via[P5_CHANNELS] = {
+      "FIFO",           "Message Queue",   "Socket",
+      "Shared memory",  "Shared memory",   "Shared memory",
+      "FIFO transport", "Queue transport", "Stream transport",
+      "Seqpacket transport"};
+  int channel = m->channel ? m->channel : process[m->transport];
+  switch (channel) {
+  case 2:
+    if (console_line(2))
+      console_printf("[Process 5] Received from P2 (%s, PID %d): %d\n",
+                     via[m->transport], m->source_pid, m->value.i);
+    if (aggregate)
+      aggregateValue(2, m->source_pid, m->value.i);
+    else
+      logInt(2, m->source_pid, m->value.i);
+    break;
+  case 3:
+    if (console_line(3))
+      console_printf("[Process 5] Received from P3 (%s, PID %d): %f\n",
+                     via[m->transport], m->source_pid, m->value.d);
+    if (aggregate)
+      aggregateValue(3, m->source_pid, m->value.d);
+    else
+      logDouble(3, m->source_pid, m->value.d);
+    break;
+  case 4:
+    if (console_line(4))
+      console_printf("[Process 5] Received from P4 (%s, PID %d): \"%.*s\"\n",
+                     via[m->transport], m->source_pid, m->len, m->value.s);
+    if (aggregate)
+      aggregateValue(4, m->source_pid, m->len);
+    else
+      logString(4, m->source_pid, m->value.s, m->len);
+    break;
   }
-  for (int i = nfds; i < 4; ++i) {
-    fds[i].fd = -1;
+  recordDelivery(m->transport, channel, m->source_pid, m->seq, m->send_ns,
+                 m->bytes);
+}
+
+// Writes what deliver() rendered; in threaded mode the main thread does it
+// after every batch it takes from the queue.
+void flushDelivered() {
+  if (socket_readers == 0)
+    console_flush();
+}
+
+// Summary console mode: a line per refresh interval with each producer
+// type's message rate.
+void renderSummary() {
+  uint64_t n[CONSOLE_KINDS];
+  double seconds = console_summary_due(n);
+  if (seconds > 0 && n[2] + n[3] + n[4] > 0)
+    console_printf("[Process 5] Received in %.1f s: P2 %llu (%.0f/s), "
+                   "P3 %llu (%.0f/s), P4 %llu (%.0f/s)\n",
+                   seconds, (unsigned long long)n[2], n[2] / seconds,
+                   (unsigned long long)n[3], n[3] / seconds,
+                   (unsigned long long)n[4], n[4] / seconds);
+}
+
+// Delivers a parsed message right away, or in threaded mode queues it for
+// the main thread.
+void ingest(const p5_msg *m) {
+  if (socket_readers > 0)
+    ingest_queue_push_wait(&ingest_q, m, &terminate_flag);
+  else
+    deliver(m);
+}
+
+void reportLatency(int final) {
+  printf("[Process 5] %s delivery latency:\n",
+         final ? "Total" : "Interval");
+  for (int i = 0; i < P5_CHANNELS; i++) {
+    latency_merge(&lat_total[i], &lat_interval[i]);
+    latency_print(final ? &lat_total[i] : &lat_interval[i],
+                  p5_channel_names[i]);
+    latency_reset(&lat_interval[i]);
+  }
+  printf("  %llu lost, %llu out of order\n",
+         (unsigned long long)delivery_seq.gaps,
+         (unsigned long long)delivery_seq.reordered);
+  fflush(stdout);
+}
+
+// Handles the complete records in fifo_p2_buf and keeps a partial one.
+void handleP2Records() {
+  size_t offset = 0;
+  while (fifo_p2_len - offset >= sizeof(fifo_msg_int)) {
+    fifo_msg_int fifo_msg;
+    memcpy(&fifo_msg, fifo_p2_buf + offset, sizeof(fifo_msg));
+    offset += sizeof(fifo_msg);
+    p5_msg m = {P5_CH_FIFO_P2, 0, fifo_msg.source_pid, fifo_msg.seq,
+                fifo_msg.send_ns, sizeof(fifo_msg), 0, {.i = fifo_msg.value}};
+    ingest(&m);
   }
+  flushDelivered();
 
-  while (!terminate_flag) {
-    int current_nfds = 0;
-    for (int i = 0; i < 4; ++i) {
-      if (fds[i].fd != -1)
-        current_nfds++;
+  memmove(fifo_p2_buf, fifo_p2_buf + offset, fifo_p2_len - offset);
+  fifo_p2_len -= offset;
+}
+
+// Reads everything currently in FIFO P2 and handles all complete records.
+// A record split across reads is kept in fifo_p2_buf for the next call.
+// Returns 0 on EOF or error.
+int drainP2Fifo() {
+  int open = 1;
+  setQueueDepth(P5_CH_FIFO_P2, (bytesWaiting(fifo_p2_fd) + fifo_p2_len) /
+                                   sizeof(fifo_msg_int));
+  while (fifo_p2_len < sizeof(fifo_p2_buf)) {
+    ssize_t bytes_read = read(fifo_p2_fd, fifo_p2_buf + fifo_p2_len,
+                              sizeof(fifo_p2_buf) - fifo_p2_len);
+    if (bytes_read > 0) {
+      fifo_p2_len += bytes_read;
+      continue;
     }
-    if (current_nfds == 0 && !terminate_flag) {
-      printf("[Process 5] No active IPC descriptors left. Exiting loop.\n");
+    if (bytes_read == 0) { // EOF
+      printf("[Process 5] Process 2 (FIFO P2) closed connection.\n");
       fflush(stdout);
+      open = 0;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) { // Error
+      perror("Process 5: Error reading from FIFO P2");
+      open = 0;
+    }
+    break;
+  }
+
+  handleP2Records();
+  if (!open)
+    fifo_p2_len = 0; // Drop a trailing partial record
+  return open;
+}
+
+int openRings() {
+  if (mkfifo(SHM_RING_DOORBELL, FIFO_PERMS) < 0 && errno != EEXIST) {
+    perror("  ERROR: Failed to create ring doorbell FIFO");
+    return 0;
+  }
+  // O_RDWR keeps the FIFO from reporting POLLHUP while no producer has it open
+  doorbell_fd = open(SHM_RING_DOORBELL, O_RDWR | O_NONBLOCK);
+  if (doorbell_fd < 0) {
+    perror("  ERROR: Failed to open ring doorbell FIFO");
+    return 0;
+  }
+  for (int i = 0; i < P5_RING_COUNT; i++) {
+    shm_unlink(ring_names[i]); // Start from an empty ring
+    rings[i] = shm_ring_map(ring_names[i], 1);
+    if (!rings[i]) {
+      perror("  ERROR: Failed to create shared-memory ring");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void handleRingSlot(shm_ring_slot *slot) {
+  if (raw_capture) {
+    size_t len = slot->len > SOCK_MSG_MAX_LEN ? SOCK_MSG_MAX_LEN : slot->len;
+    size_t size = offsetof(shm_ring_slot, value) +
+                  (slot->channel == SHM_CH_P4 ? len : sizeof(double));
+    rawcap_write(&capture, RAWCAP_SHM, 0, slot, size);
+    countCaptured(P5_CH_SHM_P2 + slot->channel - SHM_CH_P2, 1, size);
+    return;
+  }
+  p5_msg m = {P5_CH_SHM_P2 + slot->channel - SHM_CH_P2, 0, slot->source_pid,
+              slot->seq, slot->send_ns, sizeof(*slot), 0, {0}};
+  if (slot->channel == SHM_CH_P4) {
+    m.len = slot->len > SOCK_MSG_MAX_LEN ? SOCK_MSG_MAX_LEN : slot->len;
+    memcpy(m.value.s, slot->value.s, m.len);
+  } else {
+    m.value.d = slot->value.d; // Copies an int as well
+  }
+  ingest(&m);
+}
+
+// Consumes a bounded batch from every ring so one busy producer cannot
+// starve the other channels.
+void consumeRings() {
+  int consumed = 0;
+  for (int i = 0; i < P5_RING_COUNT; i++) {
+    if (!rings[i])
+      continue;
+    shm_ring_wake(rings[i]);
+    setQueueDepth(P5_CH_SHM_P2 + i, shm_ring_depth(rings[i]));
+    int n = shm_ring_consume(rings[i], 4096, handleRingSlot);
+    consumed += n;
+  }
+  if (consumed > 0)
+    flushDelivered();
+}
+
+// Returns the poll() timeout: 0 if a ring still holds data, otherwise the
+// rings are marked as sleeping so producers ring the doorbell.
+int ringPollTimeout(int timeout_ms) {
+  for (int i = 0; i < P5_RING_COUNT; i++) {
+    if (rings[i] && !shm_ring_prepare_sleep(rings[i]))
+      return 0;
+  }
+  return timeout_ms;
+}
+
+int addSource(p5_loop *loop, p5_source_type type, int fd) {
+  if (loop->sources_free < 0) {
+    int new_cap = loop->sources_cap ? loop->sources_cap * 2 : 16;
+    p5_source *grown = realloc(loop->sources, new_cap * sizeof(p5_source));
+    if (!grown)
+      return -1;
+    loop->sources = grown;
+    for (int i = new_cap - 1; i >= loop->sources_cap; i--) {
+      loop->sources[i].in_use = 0;
+      loop->sources[i].gen = 0;
+      loop->sources[i].next_free = loop->sources_free;
+      loop->sources_free = i;
+    }
+    loop->sources_cap = new_cap;
+  }
+
+  int idx = loop->sources_free;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = idx;
+  if (loop->epoll_fd >= 0 &&
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("Process 5: epoll_ctl(ADD) failed");
+    return -1;
+  }
+  p5_source *src = &loop->sources[idx];
+  loop->sources_free = src->next_free;
+  src->in_use = 1;
+  src->gen++;
+  src->type = type;
+  src->fd = fd;
+  src->rx = NULL;
+  src->xport = NULL;
+  return idx;
+}
+
+void removeSource(p5_loop *loop, int idx) {
+  p5_source *src = &loop->sources[idx];
+  if (loop->epoll_fd >= 0)
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+  free(src->rx);
+  src->rx = NULL;
+  src->in_use = 0;
+  src->next_free = loop->sources_free;
+  loop->sources_free = idx;
+}
+
+void closeClient(p5_loop *loop, int idx) {
+  close(loop->sources[idx].fd);
+  removeSource(loop, idx);
+  atomic_fetch_sub(&client_count, 1);
+}
+
+// Registers an accepted P4 connection with the given loop. Returns its
+// source index, or -1 if the connection had to be closed.
+int adoptClient(p5_loop *loop, int fd) {
+  int idx = addSource(loop, SRC_CLIENT, fd);
+  if (idx < 0) {
+    close(fd);
+    return -1;
+  }
+  int connected = atomic_fetch_add(&client_count, 1) + 1;
+  if (raw_capture) {
+    loop->sources[idx].stream = ++capture_streams;
+  } else {
+    loop->sources[idx].rx = malloc(sizeof(sock_rx_buf));
+    if (!loop->sources[idx].rx) {
+      closeClient(loop, idx);
+      return -1;
+    }
+    loop->sources[idx].rx->len = 0;
+  }
+  printf("[Process 5] Accepted connection from Process 4 (Socket FD: %d, "
+         "%d connected%s%s)\n",
+         fd, connected, socket_readers > 0 ? ", reader " : "",
+         socket_readers > 0 ? loop->name : "");
+  fflush(stdout);
+  return idx;
+}
+
+// In threaded mode the connections are handed to the socket readers in
+// turn through their handoff pipes; each reader then owns its connections.
+void handleListener(p5_loop *loop) {
+  int fd;
+  while ((fd = accept(listen_sock_fd, NULL, NULL)) >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (socket_readers == 0) {
+      adoptClient(loop, fd);
+      continue;
+    }
+    p5_loop *target = &loops[first_socket_loop + next_socket_loop];
+    next_socket_loop = (next_socket_loop + 1) % socket_readers;
+    if (write(target->handoff[1], &fd, sizeof(fd)) != sizeof(fd)) {
+      perror("Process 5: Failed to hand off connection");
+      close(fd);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("Process 5: Failed to accept connection");
+}
+
+void handleHandoff(p5_loop *loop) {
+  int fd;
+  while (read(loop->handoff[0], &fd, sizeof(fd)) == sizeof(fd))
+    adoptClient(loop, fd);
+}
+
+// Handles every complete frame in the buffer and keeps the trailing
+// partial one. Returns 0 if the peer sent a malformed frame.
+int parseFrames(sock_rx_buf *rx) {
+  size_t off = 0;
+  while (rx->len - off >= sizeof(sock_frame_header)) {
+    sock_frame_header hdr;
+    memcpy(&hdr, rx->data + off, sizeof(hdr));
+    if (hdr.len > SOCK_MSG_MAX_LEN)
+      return 0;
+    size_t frame_len = sizeof(hdr) + hdr.len;
+    if (rx->len - off < frame_len)
+      break;
+    p5_msg m = {P5_CH_SOCK_P4, hdr.len, hdr.source_pid, hdr.seq,
+                hdr.send_ns, frame_len, 0, {0}};
+    memcpy(m.value.s, rx->data + off + sizeof(hdr), hdr.len);
+    ingest(&m);
+    off += frame_len;
+  }
+  flushDelivered();
+  memmove(rx->data, rx->data + off, rx->len - off);
+  rx->len -= off;
+  return 1;
+}
+
+// --- Raw capture ---
+
+// Splices what FIFO P2 holds into the capture file, a few pipes full per
+// wakeup so the other channels get their turn.
+void captureFifo() {
+  for (int i = 0; i < 4; i++) {
+    ssize_t n = rawcap_splice(&capture, fifo_p2_fd, RAWCAP_FIFO_P2, 0);
+    if (n <= 0) {
+      if (n < 0 && errno != EAGAIN)
+        perror("Process 5: Failed to capture FIFO P2");
       break;
     }
+    // Records are fixed-size, so the byte count gives the message count
+    uint64_t before = capture_fifo_bytes / sizeof(fifo_msg_int);
+    capture_fifo_bytes += n;
+    countCaptured(P5_CH_FIFO_P2,
+                  capture_fifo_bytes / sizeof(fifo_msg_int) - before, n);
+  }
+}
+
+// Frames are not parsed, so only bytes are counted for P4.
+void captureClient(p5_loop *loop, int idx) {
+  p5_source *src = &loop->sources[idx];
+  ssize_t n = rawcap_splice(&capture, src->fd, RAWCAP_SOCK_P4, src->stream);
+  if (n > 0) {
+    countCaptured(P5_CH_SOCK_P4, 0, n);
+    return;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  if (n == 0)
+    printf("[Process 5] Process 4 (Socket FD %d) closed connection.\n",
+           src->fd);
+  else
+    perror("Process 5: Failed to capture from socket");
+  fflush(stdout);
+  rawcap_write(&capture, RAWCAP_SOCK_P4, src->stream, NULL, 0);
+  closeClient(loop, idx);
+}
 
-    int poll_ret = poll(fds, 4, 500);
+void handleClient(p5_loop *loop, int idx, uint32_t events) {
+  if (raw_capture) {
+    captureClient(loop, idx);
+    return;
+  }
+  int fd = loop->sources[idx].fd;
+  sock_rx_buf *rx = loop->sources[idx].rx;
+  if (events & EPOLLIN) {
+    ssize_t bytes_received =
+        recv(fd, rx->data + rx->len, sizeof(rx->data) - rx->len, 0);
+    if (bytes_received > 0) {
+      rx->len += bytes_received;
+      setQueueBytes(P5_CH_SOCK_P4, bytesWaiting(fd) + rx->len);
+      if (!parseFrames(rx)) {
+        fprintf(stderr,
+                "[Process 5] Malformed frame from Process 4 (Socket FD %d); "
+                "closing connection.\n",
+                fd);
+        closeClient(loop, idx);
+      }
+    } else if (bytes_received == 0) {
+      if (rx->len > 0)
+        fprintf(stderr,
+                "[Process 5] Process 4 (Socket FD %d) closed mid-frame; "
+                "%zu bytes dropped.\n",
+                fd, rx->len);
+      printf("[Process 5] Process 4 (Socket FD %d) closed connection.\n", fd);
+      fflush(stdout);
+      closeClient(loop, idx);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("Process 5: recv failed");
+      closeClient(loop, idx);
+    }
+  } else if (events & (EPOLLHUP | EPOLLERR)) {
+    printf("[Process 5] Error/Hangup on Process 4 socket connection (FD "
+           "%d).\n",
+           fd);
+    fflush(stdout);
+    closeClient(loop, idx);
+  }
+}
 
-    if (poll_ret < 0) {
+// Receives everything queued, so P3 never waits on a queue that P5 could
+// have emptied in this wakeup.
+void handleMq() {
+  // Occupancy as the queue reports it; what one wakeup receives can be
+  // more, as P3 keeps sending while the queue is drained
+  struct mq_attr attr;
+  long waiting = mq_getattr(mq, &attr) == 0 ? attr.mq_curmsgs : 0;
+  long found = 0;
+  for (;;) {
+    ssize_t bytes_read = mq_receive(mq, mq_buf, mq_actual.mq_msgsize, NULL);
+    if (bytes_read < 0) {
       if (errno == EINTR)
         continue;
-      perror("Process 5: poll() failed");
+      if (errno != EAGAIN)
+        perror("Process 5: Error receiving from message queue");
       break;
     }
-    if (poll_ret == 0)
+    found++;
+    if (raw_capture) {
+      rawcap_write(&capture, RAWCAP_MQ_P3, 0, mq_buf, bytes_read);
+      countCaptured(P5_CH_MQ_P3, 1, bytes_read);
+      continue;
+    }
+    if (bytes_read < (ssize_t)sizeof(mq_msg_float))
       continue;
+    mq_msg_float mq_msg;
+    memcpy(&mq_msg, mq_buf, sizeof(mq_msg));
+    p5_msg m = {P5_CH_MQ_P3, 0, mq_msg.source_pid, mq_msg.seq, mq_msg.send_ns,
+                bytes_read, 0, {.d = mq_msg.value}};
+    ingest(&m);
+  }
+  flushDelivered();
+
+  setQueueDepth(P5_CH_MQ_P3, waiting);
+  if (found == 0)
+    return;
+  mq_drains++;
+  mq_drained += found;
+  if (waiting > mq_peak)
+    mq_peak = waiting;
+  if (waiting == mq_actual.mq_maxmsg && mq_full_drains++ == 0)
+    fprintf(stderr,
+            "[Process 5] P3 message queue was full (%ld messages); "
+            "producers may have blocked. Consider a deeper queue (-q).\n",
+            mq_actual.mq_maxmsg);
+}
+
+void reportMqOccupancy() {
+  if (mq == (mqd_t)-1)
+    return;
+  printf("[Process 5] P3 queue occupancy: depth %ld, peak %ld, "
+         "%.1f messages per wakeup on average, full %lld times\n",
+         mq_actual.mq_maxmsg, mq_peak,
+         mq_drains ? (double)mq_drained / mq_drains : 0.0, mq_full_drains);
+}
+
+// --- Shared transports ---
+#define XPORT_RECV_BATCH 64
+#define XPORT_BATCHES_PER_WAKEUP 16 // Then the other sources get their turn
 
-    int current_checked_fds = 0;
-    for (int i = 0; i < 4 && current_checked_fds < poll_ret; ++i) {
+// With io_uring every transport source is polled once and re-armed after
+// it was handled, so a closed connection leaves no request behind.
+int armTransport(p5_loop *loop, int idx) {
+  p5_source *src = &loop->sources[idx];
+  return uring_poll_once(&ring, src->fd,
+                         URING_DATA(URING_XPORT, src->gen, idx));
+}
+
+void closeTransport(p5_loop *loop, int idx) {
+  transport *t = loop->sources[idx].xport;
+  removeSource(loop, idx);
+  transport_close(t);
+  free(t);
+}
 
-      if (fds[i].fd == -1 || fds[i].revents == 0)
+// Registers a transport source with the loop. Returns its index or -1.
+int addTransport(p5_loop *loop, transport *t) {
+  int idx = addSource(loop, t->listening ? SRC_XPORT_LISTENER : SRC_XPORT,
+                      transport_fd(t));
+  if (idx < 0)
+    return -1;
+  loop->sources[idx].xport = t;
+  if (use_uring)
+    armTransport(loop, idx);
+  return idx;
+}
+
+// Accepted connections stay on the loop of their listener, so every
+// connection is read by one thread and stays in order.
+void handleTransportListener(p5_loop *loop, int idx) {
+  transport *listener = loop->sources[idx].xport;
+  transport conn;
+  while (transport_accept(listener, &conn)) {
+    transport *t = malloc(sizeof(*t));
+    if (t)
+      *t = conn;
+    if (!t || addTransport(loop, t) < 0) {
+      transport_close(&conn);
+      free(t);
+    }
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("Process 5: Failed to accept transport connection");
+}
+
+// Delivers what a transport source holds: a bounded number of reads per
+// wakeup, and every record already read. Returns 0 if the source was closed.
+int handleTransport(p5_loop *loop, int idx) {
+  transport *t = loop->sources[idx].xport;
+  int ch = P5_CH_VIA_FIFO + t->kind;
+  xport_msg msgs[XPORT_RECV_BATCH];
+  int n = 0;
+  setQueueBytes(ch, transport_waiting(t));
+  for (int b = 0;
+       (b < XPORT_BATCHES_PER_WAKEUP || transport_buffered(t)) &&
+       (n = transport_recv_batch(t, msgs, XPORT_RECV_BATCH)) > 0;
+       b++) {
+    for (int i = 0; i < n; i++) {
+      const xport_msg *x = &msgs[i];
+      size_t size = xport_msg_size(x);
+      if (raw_capture) {
+        // Same layout as a ring slot, so it is captured as one
+        rawcap_write(&capture, RAWCAP_SHM, 0, x, size);
+        countCaptured(ch, 1, size);
         continue;
-      current_checked_fds++;
-
-      // Check Listening Socket
-      if (fds[i].fd == listen_sock_fd && (fds[i].revents & POLLIN)) {
-        // ... (кодът за accept остава същият) ...
-        if (client_sock_fd == -1) {
-          struct sockaddr_un remote_addr;
-          socklen_t addr_len = sizeof(remote_addr);
-          client_sock_fd = accept(listen_sock_fd,
-                                  (struct sockaddr *)&remote_addr, &addr_len);
-          if (client_sock_fd >= 0) {
-            printf("[Process 5] Accepted connection from Process 4 (Socket FD: "
-                   "%d)\n",
-                   client_sock_fd);
-            fflush(stdout);
-            fcntl(client_sock_fd, F_SETFL, O_NONBLOCK);
-            client_fds_index = -1; // Reset index
-            for (int j = 0; j < 4; ++j) {
-              if (fds[j].fd == -1) {
-                fds[j].fd = client_sock_fd;
-                fds[j].events = POLLIN | POLLHUP;
-                client_fds_index = j;
-                break;
-              }
-            }
-            if (client_fds_index == -1) {
-              close(client_sock_fd);
-              client_sock_fd = -1;
-            }
-            // close(listen_sock_fd); fds[i].fd = -1; listen_sock_fd = -1;
-          } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("Process 5: Failed to accept connection");
-          }
-        } else {
-          int temp_fd = accept(listen_sock_fd, NULL, NULL);
-          if (temp_fd >= 0)
-            close(temp_fd);
-        } // Reject extra connections
       }
-
-      // Check FIFO P2
-      else if (fds[i].fd == fifo_p2_fd && (fds[i].revents & POLLIN)) {
-        fifo_msg_int fifo_msg;
-        ssize_t bytes_read = read(fifo_p2_fd, &fifo_msg, sizeof(fifo_msg));
-        if (bytes_read == sizeof(fifo_msg)) {
-          printf("[Process 5] Received from P2 (FIFO, PID %d): %d\n",
-                 fifo_msg.source_pid, fifo_msg.value);
-          fflush(stdout);
-          if (log_file)
-            fprintf(log_file, "[%ld] P2(%d): %d\n", time(NULL),
-                    fifo_msg.source_pid, fifo_msg.value);
-          fflush(log_file);
-        } else if (bytes_read == 0) { // EOF
-          printf("[Process 5] Process 2 (FIFO P2) closed connection.\n");
-          fflush(stdout);
-          close(fifo_p2_fd);
-          fds[i].fd = -1;
-          fifo_p2_fd = -1;
-        } else if (errno != EAGAIN && errno != EWOULDBLOCK) { // Error
-          perror("Process 5: Error reading from FIFO P2");
-          close(fifo_p2_fd);
-          fds[i].fd = -1;
-          fifo_p2_fd = -1;
-        }
+      p5_msg m = {ch, 0, x->source_pid, x->seq, x->send_ns, size, x->channel,
+                  {0}};
+      if (x->channel == SHM_CH_P4) {
+        m.len = x->len;
+        memcpy(m.value.s, x->value.s, x->len);
+      } else {
+        m.value.d = x->value.d; // Copies an int as well
       }
+      ingest(&m);
+    }
+  }
+  flushDelivered();
+  if (n >= 0)
+    return 1;
 
-      // Check Message Queue <<<--- НОВА ЛОГИКА ---
-      else if (fds[i].fd == mq && (fds[i].revents & POLLIN)) {
-        mq_msg_float mq_msg;
-        ssize_t bytes_read = mq_receive(mq, (char *)&mq_msg, sizeof(mq_msg),
-                                        NULL); // No priority
-        if (bytes_read == sizeof(mq_msg)) {
-          printf("[Process 5] Received from P3 (Message Queue, PID %d): %f\n",
-                 mq_msg.source_pid, mq_msg.value);
-          fflush(stdout);
-          if (log_file)
-            fprintf(log_file, "[%ld] P3(%d): %f\n", (long)time(NULL),
-                    mq_msg.source_pid, mq_msg.value);
-          fflush(log_file);
-        } else {
-          perror("Process 5: Error receiving from message queue");
-        }
+  int err = errno;
+  const char *name = t->ops->name;
+  if (err == EPROTO)
+    fprintf(stderr, "[Process 5] Malformed record on the %s transport%s\n",
+            name, t->server ? "; buffered bytes dropped" : "");
+  else if (err != 0)
+    fprintf(stderr, "Process 5: Error receiving from the %s transport: %s\n",
+            name, strerror(err));
+  if (t->server)
+    return 1; // P5's own endpoint stays open
+  if (err == 0 && t->rx_len > t->rx_off)
+    fprintf(stderr,
+            "[Process 5] %s transport connection (FD %d) closed mid-record; "
+            "%zu bytes dropped.\n",
+            name, t->fd, t->rx_len - t->rx_off);
+  printf("[Process 5] %s transport connection (FD %d) closed.\n", name,
+         t->fd);
+  fflush(stdout);
+  closeTransport(loop, idx);
+  return 0;
+}
+
+// --- Event loops ---
+
+p5_loop *addLoop(const char *name, int use_epoll) {
+  p5_loop *grown = realloc(loops, (loop_count + 1) * sizeof(p5_loop));
+  if (!grown)
+    return NULL;
+  loops = grown;
+  p5_loop *loop = &loops[loop_count];
+  memset(loop, 0, sizeof(*loop));
+  loop->name = name;
+  loop->sources_free = -1;
+  loop->handoff[0] = loop->handoff[1] = -1;
+  loop->cpu = -1;
+  loop->epoll_fd = use_epoll ? epoll_create1(EPOLL_CLOEXEC) : -1;
+  if (use_epoll && loop->epoll_fd < 0) {
+    perror("Process 5: epoll_create1() failed");
+    return NULL;
+  }
+  loop_count++;
+  return loop;
+}
+
+void dispatchEvents(p5_loop *loop, struct epoll_event *events, int nready) {
+  for (int i = 0; i < nready; ++i) {
+    int idx = events[i].data.u32;
+    p5_source *src = &loop->sources[idx];
+    if (!src->in_use)
+      continue; // Closed earlier in this batch
+
+    switch (src->type) {
+    case SRC_DOORBELL: {
+      // The rings themselves were drained before dispatching
+      char drain[256];
+      while (read(doorbell_fd, drain, sizeof(drain)) > 0)
+        ;
+      break;
+    }
+    case SRC_LISTENER:
+      handleListener(loop);
+      break;
+    case SRC_HANDOFF:
+      handleHandoff(loop);
+      break;
+    case SRC_FIFO_P2:
+      if (raw_capture)
+        captureFifo();
+      else if (!drainP2Fifo()) {
+        removeSource(loop, idx);
+        close(fifo_p2_fd);
+        fifo_p2_fd = -1;
       }
+      break;
+    case SRC_MQ_P3:
+      handleMq();
+      break;
+    case SRC_CLIENT:
+      handleClient(loop, idx, events[i].events);
+      break;
+    case SRC_XPORT:
+      handleTransport(loop, idx);
+      break;
+    case SRC_XPORT_LISTENER:
+      handleTransportListener(loop, idx);
+      break;
+    }
+  }
+}
+
+// Waits up to timeout_ms for events and handles them. Returns 0 if
+// epoll_wait() failed for good.
+int runLoopOnce(p5_loop *loop, int timeout_ms) {
+  struct epoll_event events[P5_MAX_EVENTS];
+  if (loop->rings)
+    timeout_ms = ringPollTimeout(timeout_ms);
+  int nready = epoll_wait(loop->epoll_fd, events, P5_MAX_EVENTS, timeout_ms);
+  if (nready < 0) {
+    if (errno == EINTR)
+      return 1;
+    perror("Process 5: epoll_wait() failed");
+    return 0;
+  }
+  if (loop->rings)
+    consumeRings();
+  dispatchEvents(loop, events, nready);
+  return 1;
+}
+
+// Work done by the thread that delivers messages, after every batch.
+void afterBatch() {
+  if (logger)
+    log_writer_commit(logger);
+  grantCredits();
+  publishStats();
+  renderSummary();
+  console_flush();
+  if (aggregate)
+    aggregator_close(&agg, (long)time(NULL), 0, logSummary);
+
+  if (latency_report_s > 0 && monotonic_ms() >= next_latency_report_ms) {
+    if (next_latency_report_ms > 0)
+      reportLatency(0);
+    next_latency_report_ms = monotonic_ms() + latency_report_s * 1000LL;
+  }
+}
+
+void *readerMain(void *arg) {
+  p5_loop *loop = arg;
+  if (loop->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+      fprintf(stderr, "[Process 5] Could not pin reader %s to CPU %d: %s\n",
+              loop->name, loop->cpu, strerror(err));
+  }
+  while (!terminate_flag && runLoopOnce(loop, 500))
+    ;
+  return NULL;
+}
+
+int addTransports(p5_loop *loop) {
+  for (int k = 0; k < XPORT_KINDS; k++)
+    if (addTransport(loop, &xports[k]) < 0)
+      return 0;
+  return 1;
+}
+
+// Builds the loops: one holding every source, or in threaded mode one per
+// reader thread (FIFO P2, P3 queue, rings, the shared transports and the
+// socket readers, of which the first also owns the listener).
+int setupLoops() {
+  if (socket_readers == 0) {
+    p5_loop *loop = addLoop("main", 1);
+    if (!loop)
+      return 0;
+    loop->rings = 1;
+    return addSource(loop, SRC_FIFO_P2, fifo_p2_fd) >= 0 &&
+           addSource(loop, SRC_MQ_P3, mq) >= 0 &&
+           addSource(loop, SRC_LISTENER, listen_sock_fd) >= 0 &&
+           addSource(loop, SRC_DOORBELL, doorbell_fd) >= 0 &&
+           addTransports(loop);
+  }
 
-      // Check Message Queue <<<--- ПРЕМАХНАТО ---
-      // else if (fds[i].fd == mq && ...) { ... }
-
-      // Check Client Socket
-      else if (fds[i].fd == client_sock_fd && client_sock_fd != -1) {
-        if (fds[i].revents & (POLLHUP | POLLERR)) {
-          printf("[Process 5] Error/Hangup on Process 4 socket connection (FD "
-                 "%d).\n",
-                 client_sock_fd);
-          fflush(stdout);
-          close(client_sock_fd);
-          fds[i].fd = -1;
-          client_sock_fd = -1;
-          client_fds_index = -1;
-        } else if (fds[i].revents & POLLIN) {
-          sock_msg_string sock_msg;
-          ssize_t bytes_received =
-              recv(client_sock_fd, &sock_msg, sizeof(sock_msg), 0);
-          if (bytes_received == sizeof(sock_msg)) {
-            printf("[Process 5] Received from P4 (Socket, PID %d): \"%s\"\n",
-                   sock_msg.source_pid, sock_msg.value);
-            fflush(stdout);
-          } else if (bytes_received == 0) {
-            printf("[Process 5] Process 4 (Socket FD %d) closed connection.\n",
-                   client_sock_fd);
-            fflush(stdout);
-            close(client_sock_fd);
-            fds[i].fd = -1;
-            client_sock_fd = -1;
-            client_fds_index = -1;
-          } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("Process 5: recv failed");
-            close(client_sock_fd);
-            fds[i].fd = -1;
-            client_sock_fd = -1;
-            client_fds_index = -1;
-          }
-        }
+  static const char *socket_names[] = {"sock0", "sock1", "sock2", "sock3",
+                                       "sock4", "sock5", "sock6", "sock7"};
+  if (!ingest_queue_init(&ingest_q)) {
+    perror("Process 5: Failed to create ingest queue");
+    return 0;
+  }
+  p5_loop *loop = addLoop("fifo", 1);
+  if (!loop || addSource(loop, SRC_FIFO_P2, fifo_p2_fd) < 0)
+    return 0;
+  loop = addLoop("mqueue", 1);
+  if (!loop || addSource(loop, SRC_MQ_P3, mq) < 0)
+    return 0;
+  loop = addLoop("rings", 1);
+  if (!loop || addSource(loop, SRC_DOORBELL, doorbell_fd) < 0)
+    return 0;
+  loop->rings = 1;
+  loop = addLoop("transports", 1);
+  if (!loop || !addTransports(loop))
+    return 0;
+
+  first_socket_loop = loop_count;
+  for (int i = 0; i < socket_readers; i++) {
+    loop = addLoop(socket_names[i], 1);
+    if (!loop)
+      return 0;
+    if (pipe2(loop->handoff, O_CLOEXEC) < 0) {
+      perror("Process 5: Failed to create handoff pipe");
+      return 0;
+    }
+    fcntl(loop->handoff[0], F_SETFL, O_NONBLOCK);
+    if (addSource(loop, SRC_HANDOFF, loop->handoff[0]) < 0 ||
+        (i == 0 && addSource(loop, SRC_LISTENER, listen_sock_fd) < 0))
+      return 0;
+  }
+
+  // Readers go on the second, third, ... allowed CPU and wrap around,
+  // leaving the first to the main thread; with a single CPU nothing is
+  // pinned. Allowed means within a tuning's cpus= set, if there is one.
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE], ncpus = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus[ncpus++] = cpu;
+  for (int i = 0; i < loop_count && ncpus > 1; i++)
+    loops[i].cpu = cpus[1 + i % (ncpus - 1)];
+  return 1;
+}
+
+// Starts the reader threads with SIGTERM/SIGINT blocked, so the signals
+// always interrupt the main thread.
+int startReaders() {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int started = 0;
+  for (; started < loop_count; started++) {
+    int err = pthread_create(&loops[started].thread, NULL, readerMain,
+                             &loops[started]);
+    if (err) {
+      fprintf(stderr, "[Process 5] Failed to start reader thread: %s\n",
+              strerror(err));
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (started < loop_count) {
+    terminate_flag = 1;
+    for (int i = 0; i < started; i++)
+      pthread_join(loops[i].thread, NULL);
+    return 0;
+  }
+
+  printf("[Process 5] Threaded ingest: %d reader threads (", loop_count);
+  for (int i = 0; i < loop_count; i++) {
+    if (loops[i].cpu >= 0)
+      printf("%s%s@cpu%d", i ? ", " : "", loops[i].name, loops[i].cpu);
+    else
+      printf("%s%s", i ? ", " : "", loops[i].name);
+  }
+  printf(")\n");
+  fflush(stdout);
+  return 1;
+}
+
+// Main thread in threaded mode: delivers the queued messages in the order
+// the readers queued them until a signal arrives, then stops the readers
+// and delivers what they left behind.
+void runSequencer() {
+  while (!terminate_flag) {
+    if (ingest_queue_consume(&ingest_q, 4096, deliver) == 0)
+      ingest_queue_wait(&ingest_q, idleTimeoutMs());
+    afterBatch();
+  }
+  for (int i = 0; i < loop_count; i++)
+    pthread_join(loops[i].thread, NULL);
+  while (ingest_queue_consume(&ingest_q, 4096, deliver) > 0)
+    ;
+  log_writer_commit(logger);
+}
+
+// --- io_uring backend ---
+
+int armP2Read() {
+  return uring_read_fixed(&ring, fifo_p2_fd, fifo_p2_buf + fifo_p2_len,
+                          sizeof(fifo_p2_buf) - fifo_p2_len, 0,
+                          URING_DATA(URING_FIFO_P2, 0, 0));
+}
+
+int armClient(p5_loop *loop, int idx) {
+  p5_source *src = &loop->sources[idx];
+  return uring_recv_multishot(&ring, src->fd, URING_RECV_GROUP,
+                              URING_DATA(URING_CLIENT, src->gen, idx));
+}
+
+void handleUringClient(p5_loop *loop, struct io_uring_cqe *cqe) {
+  int idx = (uint32_t)cqe->user_data;
+  unsigned gen = (cqe->user_data >> 32) & 0xFFFFFF;
+  p5_source *src = &loop->sources[idx];
+  // The slot may hold a newer connection by now
+  int live = idx < loop->sources_cap && src->in_use &&
+             src->type == SRC_CLIENT && (src->gen & 0xFFFFFF) == gen;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (live && cqe->res > 0) {
+      sock_rx_buf *rx = src->rx;
+      memcpy(rx->data + rx->len, uring_buf(&recv_bufs, bid), cqe->res);
+      rx->len += cqe->res;
+      setQueueBytes(P5_CH_SOCK_P4, bytesWaiting(src->fd) + rx->len);
+      if (!parseFrames(rx)) {
+        fprintf(stderr,
+                "[Process 5] Malformed frame from Process 4 (Socket FD %d); "
+                "closing connection.\n",
+                src->fd);
+        shutdown(src->fd, SHUT_RDWR); // Ends the multishot recv
+        closeClient(loop, idx);
+        live = 0;
       }
     }
+    uring_buf_recycle(&recv_bufs, bid);
+  }
+  if (!live || (cqe->flags & IORING_CQE_F_MORE))
+    return;
+
+  // The multishot recv has ended: out of buffers, or the peer is gone
+  if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+    armClient(loop, idx);
+    return;
+  }
+  if (cqe->res == 0)
+    printf("[Process 5] Process 4 (Socket FD %d) closed connection.\n",
+           src->fd);
+  else
+    fprintf(stderr, "Process 5: recv failed: %s\n", strerror(-cqe->res));
+  fflush(stdout);
+  closeClient(loop, idx);
+}
+
+void handleUringTransport(p5_loop *loop, struct io_uring_cqe *cqe) {
+  int idx = (uint32_t)cqe->user_data;
+  unsigned gen = (cqe->user_data >> 32) & 0xFFFFFF;
+  p5_source *src = &loop->sources[idx];
+  if (idx >= loop->sources_cap || !src->in_use ||
+      (src->type != SRC_XPORT && src->type != SRC_XPORT_LISTENER) ||
+      (src->gen & 0xFFFFFF) != gen)
+    return;
+  if (src->type == SRC_XPORT_LISTENER)
+    handleTransportListener(loop, idx);
+  else if (!handleTransport(loop, idx))
+    return;
+  armTransport(loop, idx);
+}
+
+void handleCqe(struct io_uring_cqe *cqe) {
+  p5_loop *loop = &loops[0];
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  switch (cqe->user_data >> 56) {
+  case URING_FIFO_P2:
+    if (cqe->res > 0) {
+      fifo_p2_len += cqe->res;
+      setQueueDepth(P5_CH_FIFO_P2, (bytesWaiting(fifo_p2_fd) + fifo_p2_len) /
+                                       sizeof(fifo_msg_int));
+      handleP2Records();
+    } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+      // P5 holds a writer reference, so this is never a plain EOF. As in
+      // the epoll loop, the FIFO is closed and P2 input ends here.
+      fprintf(stderr, "Process 5: Error reading from FIFO P2: %s\n",
+              strerror(cqe->res ? -cqe->res : EPIPE));
+      close(fifo_p2_fd);
+      fifo_p2_fd = -1;
+      fifo_p2_len = 0; // Drop a trailing partial record
+      break;
+    }
+    // Transient errors just retry
+    if (!armP2Read())
+      perror("Process 5: Failed to re-arm the FIFO P2 read");
+    break;
+  case URING_MQ_P3:
+    handleMq();
+    if (!more && cqe->res != -EINVAL)
+      uring_poll_multishot(&ring, mq, URING_DATA(URING_MQ_P3, 0, 0));
+    break;
+  case URING_DOORBELL: {
+    // The rings themselves are drained once per iteration
+    char drain[256];
+    while (read(doorbell_fd, drain, sizeof(drain)) > 0)
+      ;
+    if (!more && cqe->res != -EINVAL)
+      uring_poll_multishot(&ring, doorbell_fd,
+                           URING_DATA(URING_DOORBELL, 0, 0));
+    break;
+  }
+  case URING_ACCEPT:
+    if (cqe->res >= 0) {
+      int idx = adoptClient(loop, cqe->res);
+      if (idx >= 0)
+        armClient(loop, idx);
+    } else {
+      fprintf(stderr, "Process 5: Failed to accept connection: %s\n",
+              strerror(-cqe->res));
+    }
+    if (!more && cqe->res != -EINVAL)
+      uring_accept_multishot(&ring, listen_sock_fd,
+                             URING_DATA(URING_ACCEPT, 0, 0));
+    break;
+  case URING_CLIENT:
+    handleUringClient(loop, cqe);
+    break;
+  case URING_XPORT:
+    handleUringTransport(loop, cqe);
+    break;
+  }
+}
+
+// Sets up the ring and arms every source. Returns 0 with errno set if
+// io_uring cannot be used, leaving the epoll setup untouched.
+int setupUring() {
+  if (!uring_init(&ring, URING_ENTRIES, URING_CQ_ENTRIES))
+    return 0;
+  struct iovec iov = {fifo_p2_buf, sizeof(fifo_p2_buf)};
+  if (!uring_register_buffers(&ring, &iov, 1) ||
+      !uring_buf_ring_setup(&ring, &recv_bufs, URING_RECV_GROUP,
+                            URING_RECV_BUFS, URING_RECV_BUF_SIZE)) {
+    int err = errno;
+    uring_free(&ring);
+    errno = err;
+    return 0;
+  }
+  p5_loop *loop = addLoop("uring", 0); // Only for the P4 connection slab
+  if (!loop) {
+    uring_buf_ring_free(&ring, &recv_bufs);
+    uring_free(&ring);
+    return 0;
   }
+  loop->rings = 1;
 
+  // io_uring waits for readiness itself; on an O_NONBLOCK descriptor it
+  // would complete with EAGAIN instead
+  fcntl(fifo_p2_fd, F_SETFL, 0);
+  fcntl(listen_sock_fd, F_SETFL, 0);
+  armP2Read();
+  uring_poll_multishot(&ring, mq, URING_DATA(URING_MQ_P3, 0, 0));
+  uring_poll_multishot(&ring, doorbell_fd, URING_DATA(URING_DOORBELL, 0, 0));
+  uring_accept_multishot(&ring, listen_sock_fd, URING_DATA(URING_ACCEPT, 0, 0));
+  if (!addTransports(loop))
+    perror("Process 5: Failed to register the shared transports");
+  return 1;
+}
+
+void runUringLoop() {
+  while (!terminate_flag) {
+    int timeout_ms = ringPollTimeout(idleTimeoutMs());
+    if (uring_submit_and_wait(&ring, 1, timeout_ms) < 0 && errno != ETIME &&
+        errno != EINTR && errno != EBUSY) {
+      perror("Process 5: io_uring_enter() failed");
+      break;
+    }
+    consumeRings();
+    uring_consume(&ring, handleCqe);
+    afterBatch();
+  }
+}
+
+void errorOnStart() {
+  printf("[Process 5] CRITICAL: Failed to initialize one or more IPC "
+         "mechanisms. Terminating.\n");
+  fflush(stderr);
+  cleanup_ipc();
+}
+
+int main(int argc, char *argv[]) {
+  log_durability durability = LOG_DURABILITY_NONE;
+  int sync_interval_ms = LOG_DEFAULT_SYNC_MS;
+  uint64_t segment_mb = BINLOG_DEFAULT_SEGMENT_MB;
+  int index_every = LOGIDX_DEFAULT_EVERY;
+  int opt, usage_error = 0;
+  while ((opt = getopt(argc, argv, "a:b:c:d:f:i:l:m:o:q:s:T:")) != -1) {
+    switch (opt) {
+    case 'a':
+      aggregate = 1;
+      usage_error |= !aggregator_init(&agg, optarg);
+      break;
+    case 'b':
+      use_uring = strcmp(optarg, "uring") == 0;
+      usage_error |= !use_uring && strcmp(optarg, "epoll") != 0;
+      break;
+    case 'c':
+      credit_window = atoi(optarg);
+      usage_error |= atoi(optarg) < 0;
+      break;
+    case 'd':
+      usage_error |=
+          !log_durability_parse(optarg, &durability, &sync_interval_ms);
+      break;
+    case 'f':
+      binary_log = strcmp(optarg, "binary") == 0;
+      raw_capture = strcmp(optarg, "raw") == 0;
+      usage_error |=
+          !binary_log && !raw_capture && strcmp(optarg, "text") != 0;
+      break;
+    case 'i':
+      index_every = atoi(optarg);
+      usage_error |= index_every < 0;
+      break;
+    case 'o':
+      usage_error |= !console_parse(optarg);
+      break;
+    case 'q':
+      mq_depth = atol(optarg);
+      usage_error |= mq_depth < 1;
+      break;
+    case 'l':
+      latency_report_s = atoi(optarg);
+      usage_error |= latency_report_s < 0;
+      break;
+    case 'm':
+      mq_msg_size = atol(optarg);
+      usage_error |= mq_msg_size < 1;
+      break;
+    case 's':
+      segment_mb = strtoull(optarg, NULL, 10);
+      usage_error |= segment_mb == 0;
+      break;
+    case 'T':
+      socket_readers = atoi(optarg);
+      usage_error |= socket_readers < 1 || socket_readers > 8;
+      break;
+    default:
+      usage_error = 1;
+    }
+  }
+  // The io_uring backend replaces the single-threaded loop only
+  usage_error |= use_uring && socket_readers > 0;
+  // Raw capture runs on the single-threaded epoll loop
+  usage_error |= raw_capture && (use_uring || socket_readers > 0);
+  usage_error |= raw_capture && aggregate;
+  if (usage_error || optind != argc - 1) {
+    printf("Usage: %s [-a window_s[:slide_s] (log window summaries)] "
+           "[-b epoll|uring] [-c credit_window (0 = off)] "
+           "[-d none|periodic[:ms]|sync] "
+           "[-f text|binary|raw] [-s segment_mb] [-i index_every (0 = off)] "
+           "[-q mq_depth] "
+           "[-m mq_msg_size] [-l latency_report_s (0 = at exit)] "
+           "[-o all|sample:N|summary[:ms]|quiet (console output)] "
+           "[-T socket_readers (1-8, threaded ingest)] <log_filename>\n",
+           argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *log_filename = argv[optind];
+  tuning_apply(); // Before the reader and sync threads start
+  console_open(CONSOLE_ALL);
+
+  for (int i = 0; i < P5_CHANNELS; i++) {
+    latency_reset(&lat_interval[i]);
+    latency_reset(&lat_total[i]);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigterm;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  if (raw_capture) {
+    if (!rawcap_open(&capture, log_filename)) {
+      perror("Process 5: Failed to open capture file");
+      return EXIT_FAILURE;
+    }
+  } else {
+    if (binary_log)
+      logger = log_writer_open_segmented(log_filename, segment_mb << 20,
+                                         durability, sync_interval_ms);
+    else
+      logger = log_writer_open(log_filename, durability, sync_interval_ms);
+    if (!logger) {
+      perror("Process 5: Failed to open log file");
+      return EXIT_FAILURE;
+    }
+  }
+  // The sparse index covers the text log; binary records carry their own
+  // timestamps and are read with p5_logconv
+  if (!binary_log && !raw_capture && index_every > 0 &&
+      !logidx_open(&log_index, log_filename, index_every))
+    perror("Process 5: Failed to open log index");
+
+  stats = p5_stats_create();
+  if (!stats)
+    perror("Process 5: Failed to create stats page (continuing without)");
+  // Raw capture does not parse messages, so it cannot tell what it delivered
+  if (credit_window > 0 && !raw_capture) {
+    credits = credit_page_create(credit_window);
+    if (!credits)
+      perror("Process 5: Failed to create credit page (continuing without)");
+  }
+
+  if (!openP2File() || !openP3File() || !openP4File() || !openRings() ||
+      !openTransports()) {
+    errorOnStart();
+    return EXIT_FAILURE;
+  }
+
+  if (use_uring && !setupUring()) {
+    fprintf(stderr,
+            "[Process 5] io_uring backend unavailable (%s); using epoll\n",
+            strerror(errno));
+    use_uring = 0;
+  }
+  if (!use_uring && !setupLoops()) {
+    errorOnStart();
+    return EXIT_FAILURE;
+  }
+  if (socket_readers > 0 && !startReaders()) {
+    errorOnStart();
+    return EXIT_FAILURE;
+  }
+
+  tuning_report("Process 5", getpid()); // Buffers are allocated by now
+  notify_ready(); // Every endpoint exists; producers can connect now
+
+  if (use_uring) {
+    printf("[Process 5] Event loop backend: io_uring\n");
+    fflush(stdout);
+    runUringLoop();
+  } else if (socket_readers > 0) {
+    runSequencer();
+  } else {
+    while (!terminate_flag &&
+           runLoopOnce(&loops[0], idleTimeoutMs()))
+      afterBatch();
+  }
+
+  console_close();
   printf("[Process 5] Exited event loop. Cleaning up...\n");
+  if (aggregate) {
+    aggregator_close(&agg, (long)time(NULL), 1, logSummary);
+    aggregator_free(&agg);
+  }
+  reportMqOccupancy();
+  reportLatency(1);
+  seq_tracker_free(&delivery_seq);
   fflush(stdout);
   cleanup_ipc();
 
@@ -0,0 +1,172 @@
+#ifndef RAWCAP_H
+#define RAWCAP_H
+
+#include "binlog.h"
+#include "common.h"
+#include <sys/uio.h>
+
+// --- Raw capture ---
+// With -f raw P5 archives what arrives on its channels without parsing it.
+// The P2 FIFO and P4 socket byte streams are spliced into a pipe and from
+// there into the capture file, so they never enter user space; the header
+// in front of every chunk is vmspliced through a second pipe. P3 and
+// shared-memory records, which P5 has to copy out anyway, are appended
+// with writev(). p5_logconv turns a capture back into the text log.
+#define RAWCAP_MAGIC 0x50414352 // "RCAP"
+#define RAWCAP_VERSION 1
+#define RAWCAP_PIPE_SIZE (1 << 20) // Largest chunk, if the pipe can grow
+
+enum {
+  RAWCAP_FIFO_P2 = 1, // fifo_msg_int records, possibly split across chunks
+  RAWCAP_SOCK_P4,     // One connection's frame stream; len 0 = closed
+  RAWCAP_MQ_P3,       // One message-queue message
+  RAWCAP_SHM          // One shm_ring_slot, up to the end of its value
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t reserved[3];
+} rawcap_file_header;
+
+typedef struct {
+  uint16_t kind;   // RAWCAP_*
+  uint16_t reserved;
+  uint32_t stream; // Connection number for RAWCAP_SOCK_P4, otherwise 0
+  uint32_t len;    // Bytes that follow
+  uint32_t reserved2;
+  uint64_t timestamp_ns; // CLOCK_REALTIME
+} rawcap_chunk;
+
+typedef struct {
+  int fd;
+  int data_pipe[2];
+  int hdr_pipe[2];
+  size_t pipe_size;
+  uint64_t bytes; // Everything written to the file
+  uint64_t chunks;
+  uint64_t errors;
+} rawcap_writer;
+
+// Opens (or continues) a capture file. Returns 0 with errno set on failure.
+int rawcap_open(rawcap_writer *w, const char *path) {
+  memset(w, 0, sizeof(*w));
+  w->data_pipe[0] = w->data_pipe[1] = w->hdr_pipe[0] = w->hdr_pipe[1] = -1;
+  // No O_APPEND: splice() refuses append-mode files
+  w->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (w->fd < 0)
+    return 0;
+  off_t end = lseek(w->fd, 0, SEEK_END);
+  if (end == 0) {
+    rawcap_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RAWCAP_MAGIC;
+    hdr.version = RAWCAP_VERSION;
+    if (write(w->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+      return 0;
+  }
+  if (pipe2(w->data_pipe, O_CLOEXEC) < 0 || pipe2(w->hdr_pipe, O_CLOEXEC) < 0)
+    return 0;
+  // Bigger chunks mean fewer headers and system calls; without
+  // CAP_SYS_RESOURCE the size is capped by /proc/sys/fs/pipe-max-size
+  int size = fcntl(w->data_pipe[1], F_SETPIPE_SZ, RAWCAP_PIPE_SIZE);
+  if (size < 0)
+    size = fcntl(w->data_pipe[1], F_GETPIPE_SZ);
+  w->pipe_size = size > 0 ? size : 65536;
+  return 1;
+}
+
+void rawcap_close(rawcap_writer *w) {
+  int *fds[] = {&w->fd, &w->data_pipe[0], &w->data_pipe[1], &w->hdr_pipe[0],
+                &w->hdr_pipe[1]};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] >= 0)
+      close(*fds[i]);
+    *fds[i] = -1;
+  }
+}
+
+// Moves len bytes from the read end of a pipe into the capture file.
+int rawcap_drain(rawcap_writer *w, int pipe_fd, size_t len) {
+  while (len > 0) {
+    ssize_t n = splice(pipe_fd, NULL, w->fd, NULL, len, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      w->errors++;
+      return 0;
+    }
+    len -= n;
+    w->bytes += n;
+  }
+  return 1;
+}
+
+void rawcap_fill_header(rawcap_chunk *hdr, int kind, uint32_t stream,
+                        uint32_t len) {
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->kind = kind;
+  hdr->stream = stream;
+  hdr->len = len;
+  hdr->timestamp_ns = realtime_ns();
+}
+
+// Captures whatever src_fd (a pipe or socket) has ready, up to one pipe
+// full. Returns the payload bytes captured, 0 at EOF, or -1 with errno set
+// (EAGAIN when nothing was ready).
+ssize_t rawcap_splice(rawcap_writer *w, int src_fd, int kind,
+                      uint32_t stream) {
+  ssize_t n;
+  do {
+    n = splice(src_fd, NULL, w->data_pipe[1], NULL, w->pipe_size,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return n;
+
+  rawcap_chunk hdr;
+  rawcap_fill_header(&hdr, kind, stream, n);
+  struct iovec iov = {&hdr, sizeof(hdr)};
+  // The header reaches the file before vmsplice()'s reference to it is
+  // dropped, as splice() copies into the page cache
+  if (vmsplice(w->hdr_pipe[1], &iov, 1, 0) != sizeof(hdr) ||
+      !rawcap_drain(w, w->hdr_pipe[0], sizeof(hdr)) ||
+      !rawcap_drain(w, w->data_pipe[0], n)) {
+    w->errors++;
+    errno = EIO;
+    return -1;
+  }
+  w->chunks++;
+  return n;
+}
+
+// Appends a chunk from user memory (len may be 0, e.g. to mark a closed
+// connection).
+int rawcap_write(rawcap_writer *w, int kind, uint32_t stream, const void *data,
+                 uint32_t len) {
+  rawcap_chunk hdr;
+  rawcap_fill_header(&hdr, kind, stream, len);
+  struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)data, len}};
+  ssize_t n = writev(w->fd, iov, len ? 2 : 1);
+  if (n != (ssize_t)(sizeof(hdr) + len)) {
+    w->errors++;
+    return 0;
+  }
+  w->bytes += n;
+  w->chunks++;
+  return 1;
+}
+
+// Whether path is a capture file rather than a text log or segment base.
+int rawcap_detect(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  rawcap_file_header hdr;
+  int is_capture = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+                   hdr.magic == RAWCAP_MAGIC && hdr.version == RAWCAP_VERSION;
+  close(fd);
+  return is_capture;
+}
+
+#endif // RAWCAP_H
@@ -0,0 +1,187 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include "common.h"
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// --- Shared-memory transport ---
+// One single-producer/single-consumer ring per producer type, created by P5.
+// Producers select it with the "shm" transport argument.
+#define SHM_RING_P2 "/p5_ring_p2"
+#define SHM_RING_P3 "/p5_ring_p3"
+#define SHM_RING_P4 "/p5_ring_p4"
+#define SHM_RING_DOORBELL "./p5_ring_doorbell"
+#define SHM_RING_SLOTS 16384 // Must be a power of two
+#define CACHE_LINE 64
+
+enum { SHM_CH_P2 = 2, SHM_CH_P3 = 3, SHM_CH_P4 = 4 };
+
+typedef struct {
+  uint16_t channel;
+  uint16_t len; // String length for SHM_CH_P4
+  int32_t source_pid;
+  uint64_t seq;    // As in the channel message structs in common.h
+  int64_t send_ns;
+  union {
+    int i;
+    double d;
+    char s[SOCK_MSG_MAX_LEN];
+  } value;
+} shm_ring_slot;
+
+// head and tail live on separate cache lines so the producer and consumer
+// never write to the same line in the fast path.
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t head; // Next slot to consume
+  _Alignas(CACHE_LINE) _Atomic uint64_t tail; // Next slot to fill
+  _Alignas(CACHE_LINE) _Atomic uint32_t consumer_sleeping;
+  _Atomic int32_t producer_pid; // Enforces a single producer
+  _Alignas(CACHE_LINE) shm_ring_slot slots[SHM_RING_SLOTS];
+} shm_ring;
+
+// Producer-side handle; caches the consumer position to avoid reading the
+// shared head on every push.
+typedef struct {
+  shm_ring *ring;
+  uint64_t cached_head;
+  int doorbell_fd;
+} shm_ring_producer;
+
+shm_ring *shm_ring_map(const char *name, int create) {
+  int fd = shm_open(name, O_RDWR | (create ? O_CREAT : 0), 0666);
+  if (fd < 0)
+    return NULL;
+  if (create && ftruncate(fd, sizeof(shm_ring)) < 0) {
+    close(fd);
+    return NULL;
+  }
+  void *addr = mmap(NULL, sizeof(shm_ring), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  return addr == MAP_FAILED ? NULL : (shm_ring *)addr;
+}
+
+void shm_ring_unmap(shm_ring *ring) {
+  if (ring)
+    munmap(ring, sizeof(shm_ring));
+}
+
+// --- Producer side ---
+
+// Attaches to a ring created by P5. Fails if P5 is not running or another
+// live producer already owns the ring.
+int shm_ring_attach(shm_ring_producer *p, const char *name) {
+  p->ring = shm_ring_map(name, 0);
+  if (!p->ring)
+    return 0;
+
+  int32_t owner = 0;
+  while (!atomic_compare_exchange_strong(&p->ring->producer_pid, &owner,
+                                         (int32_t)getpid())) {
+    if (kill(owner, 0) == 0 || errno != ESRCH) {
+      errno = EBUSY;
+      shm_ring_unmap(p->ring);
+      p->ring = NULL;
+      return 0;
+    }
+    // The previous producer died without detaching
+  }
+
+  p->cached_head = atomic_load_explicit(&p->ring->head, memory_order_acquire);
+  p->doorbell_fd = open(SHM_RING_DOORBELL, O_WRONLY | O_NONBLOCK);
+  return 1;
+}
+
+void shm_ring_detach(shm_ring_producer *p) {
+  if (!p->ring)
+    return;
+  atomic_store(&p->ring->producer_pid, 0);
+  shm_ring_unmap(p->ring);
+  p->ring = NULL;
+  if (p->doorbell_fd >= 0)
+    close(p->doorbell_fd);
+}
+
+// Reserves the next slot, or returns NULL if the ring is full.
+shm_ring_slot *shm_ring_reserve(shm_ring_producer *p) {
+  uint64_t tail = atomic_load_explicit(&p->ring->tail, memory_order_relaxed);
+  if (tail - p->cached_head >= SHM_RING_SLOTS) {
+    p->cached_head =
+        atomic_load_explicit(&p->ring->head, memory_order_acquire);
+    if (tail - p->cached_head >= SHM_RING_SLOTS)
+      return NULL;
+  }
+  return &p->ring->slots[tail & (SHM_RING_SLOTS - 1)];
+}
+
+// Publishes the reserved slot and wakes the consumer only if it is about
+// to sleep or sleeping.
+void shm_ring_commit(shm_ring_producer *p) {
+  uint64_t tail = atomic_load_explicit(&p->ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&p->ring->tail, tail + 1, memory_order_seq_cst);
+  if (atomic_load_explicit(&p->ring->consumer_sleeping,
+                           memory_order_seq_cst) &&
+      atomic_exchange(&p->ring->consumer_sleeping, 0) && p->doorbell_fd >= 0)
+    write(p->doorbell_fd, "x", 1);
+}
+
+// Blocking variant of reserve: yields while the ring is full. Returns NULL
+// if *stop becomes set meanwhile.
+shm_ring_slot *shm_ring_reserve_wait(shm_ring_producer *p,
+                                     volatile sig_atomic_t *stop) {
+  shm_ring_slot *slot;
+  int spins = 0;
+  while ((slot = shm_ring_reserve(p)) == NULL) {
+    if (*stop)
+      return NULL;
+    if (++spins < 100)
+      sched_yield();
+    else
+      usleep(100);
+  }
+  return slot;
+}
+
+// --- Consumer side ---
+
+// Announces that the consumer is about to block. Returns 0 (and clears the
+// flag) if data arrived in the meantime, in which case it must not block.
+int shm_ring_prepare_sleep(shm_ring *ring) {
+  atomic_store_explicit(&ring->consumer_sleeping, 1, memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->tail, memory_order_seq_cst) !=
+      atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+    atomic_store_explicit(&ring->consumer_sleeping, 0, memory_order_relaxed);
+    return 0;
+  }
+  return 1;
+}
+
+void shm_ring_wake(shm_ring *ring) {
+  atomic_store_explicit(&ring->consumer_sleeping, 0, memory_order_relaxed);
+}
+
+// Slots published and not consumed yet.
+uint64_t shm_ring_depth(shm_ring *ring) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return tail - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+// Hands up to max_items published slots to handle() and releases them.
+// Returns the number of slots consumed.
+int shm_ring_consume(shm_ring *ring, int max_items,
+                     void (*handle)(shm_ring_slot *)) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  int n = 0;
+  while (head != tail && n < max_items) {
+    handle(&ring->slots[head & (SHM_RING_SLOTS - 1)]);
+    head++;
+    n++;
+  }
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+  return n;
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,386 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include "common.h"
+#include "p5_stats.h"
+#include "shm_ring.h"
+#include "transport.h"
+#include "tuning.h"
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+// --- Producer spill buffer and reconnect ---
+// Producers do not give up when P5 goes away. Every value is queued in a
+// spill buffer and sent from there a batch at a time. While P5 is away the
+// buffer keeps taking values -- SPILL_MEM_RECORDS in memory, then up to
+// SPILL_FILE_RECORDS more in a file mapped from the working directory --
+// and the producer reconnects with exponential backoff, starting at
+// SPILL_BACKOFF_MIN_MS and doubling up to SPILL_BACKOFF_MAX_MS. Once P5 is
+// back the buffer is replayed in order, with the values' original sequence
+// numbers and send times, before anything newer. Only a full buffer makes
+// the producer wait. There are no acknowledgements: what P5 had received
+// but not yet logged when it went away is lost.
+#define SPILL_MEM_RECORDS 4096
+#define SPILL_FILE_RECORDS 65536
+#define SPILL_BACKOFF_MIN_MS 5
+#define SPILL_BACKOFF_MAX_MS 500
+#define SPILL_CHECK_MS 10   // How often senders check that P5 is alive
+#define SPILL_DRAIN_MS 5000 // How long an exiting producer waits for P5
+
+// Two FIFOs: records go to memory until it fills, then to the file until
+// that drains. Everything in memory is therefore older than everything in
+// the file, and the file is only touched during an outage.
+typedef struct {
+  xport_msg *mem;
+  size_t mem_head, mem_count;
+  xport_msg *file; // Mapped on the first overflow
+  size_t file_head, file_count;
+  char path[64];
+} spill_buffer;
+
+int spill_init(spill_buffer *s) {
+  memset(s, 0, sizeof(*s));
+  s->mem = tuning_alloc(SPILL_MEM_RECORDS * sizeof(xport_msg));
+  return s->mem != NULL;
+}
+
+int spill_map_file(spill_buffer *s) {
+  snprintf(s->path, sizeof(s->path), "./p5_spill_%d", getpid());
+  int fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return 0;
+  size_t size = SPILL_FILE_RECORDS * sizeof(xport_msg);
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    unlink(s->path);
+    return 0;
+  }
+  s->file = map;
+  return 1;
+}
+
+void spill_free(spill_buffer *s) {
+  tuning_free(s->mem, SPILL_MEM_RECORDS * sizeof(xport_msg));
+  s->mem = NULL;
+  if (s->file) {
+    munmap(s->file, SPILL_FILE_RECORDS * sizeof(xport_msg));
+    unlink(s->path);
+    s->file = NULL;
+  }
+}
+
+size_t spill_count(const spill_buffer *s) {
+  return s->mem_count + s->file_count;
+}
+
+// Returns 0 if the buffer is full.
+int spill_push(spill_buffer *s, const xport_msg *m) {
+  xport_msg *slot;
+  if (s->file_count == 0 && s->mem_count < SPILL_MEM_RECORDS) {
+    slot = &s->mem[(s->mem_head + s->mem_count++) % SPILL_MEM_RECORDS];
+  } else {
+    if (s->file_count == SPILL_FILE_RECORDS ||
+        (!s->file && !spill_map_file(s)))
+      return 0;
+    slot = &s->file[(s->file_head + s->file_count++) % SPILL_FILE_RECORDS];
+  }
+  memcpy(slot, m, xport_msg_size(m));
+  return 1;
+}
+
+// Puts a record back in front of everything buffered. Returns 0 if memory
+// is full.
+int spill_unshift(spill_buffer *s, const xport_msg *m) {
+  if (s->mem_count == SPILL_MEM_RECORDS)
+    return 0;
+  s->mem_head = (s->mem_head + SPILL_MEM_RECORDS - 1) % SPILL_MEM_RECORDS;
+  s->mem_count++;
+  memcpy(&s->mem[s->mem_head], m, xport_msg_size(m));
+  return 1;
+}
+
+// The oldest records, as many of them (up to max) as are contiguous.
+const xport_msg *spill_front(const spill_buffer *s, size_t max, size_t *n) {
+  const xport_msg *base = s->mem;
+  size_t head = s->mem_head, count = s->mem_count, cap = SPILL_MEM_RECORDS;
+  if (count == 0) {
+    base = s->file;
+    head = s->file_head;
+    count = s->file_count;
+    cap = SPILL_FILE_RECORDS;
+  }
+  *n = count < cap - head ? count : cap - head;
+  if (*n > max)
+    *n = max;
+  return *n ? &base[head] : NULL;
+}
+
+// Drops n records of the run spill_front() returned.
+void spill_pop(spill_buffer *s, size_t n) {
+  if (s->mem_count > 0) {
+    s->mem_head = (s->mem_head + n) % SPILL_MEM_RECORDS;
+    s->mem_count -= n;
+  } else {
+    s->file_head = (s->file_head + n) % SPILL_FILE_RECORDS;
+    s->file_count -= n;
+  }
+}
+
+// A producer's connection to P5. The producer supplies the channel:
+// connect() opens it and returns 1 on success, send() delivers records and
+// returns how many (fewer, with errno set, once the channel failed), and
+// disconnect() closes it; lost says P5 went away.
+typedef struct {
+  const char *who;
+  pid_t pid;
+  volatile sig_atomic_t *stop;
+  int (*connect)(void);
+  size_t (*send)(const xport_msg *msgs, size_t n);
+  void (*disconnect)(int lost);
+  size_t batch;       // Records per send()
+  int flush_ms;       // Longest a partial batch waits
+  void (*connected)(void); // Optional: called after each (re)connect
+  int up;
+  long long first_ms; // When the oldest buffered record was queued
+  int backoff_ms;
+  long long retry_ms; // Next reconnect attempt
+  pid_t p5_pid;       // P5 as of the last connect, 0 = unknown
+  long long check_ms; // Next liveness check
+  uint64_t outages;
+  size_t peak; // Most records buffered during an outage
+  spill_buffer spill;
+} producer_link;
+
+// P5's pid from its stats page: 0 if there is no page, -1 if the page was
+// left behind by a P5 that is gone.
+pid_t link_find_p5() {
+  const p5_stats_page *page = p5_stats_map();
+  if (!page)
+    return 0;
+  pid_t pid = page->p5_pid;
+  p5_stats_unmap(page);
+  return kill(pid, 0) < 0 && errno == ESRCH ? -1 : pid;
+}
+
+// Whether P5 is still running, checked at most every SPILL_CHECK_MS. A
+// queue or ring outlives its P5, and writes to it would just disappear.
+int link_p5_alive(producer_link *l) {
+  long long now = monotonic_ms();
+  if (l->p5_pid <= 0 || now < l->check_ms)
+    return 1;
+  l->check_ms = now + SPILL_CHECK_MS;
+  return !(kill(l->p5_pid, 0) < 0 && errno == ESRCH);
+}
+
+// Waits up to SPILL_CHECK_MS for a full channel to take more. Returns 0 if
+// the producer should stop trying: it is terminating or P5 is gone.
+int link_wait_writable(producer_link *l, int fd) {
+  struct pollfd pfd = {fd, POLLOUT, 0};
+  poll(&pfd, 1, SPILL_CHECK_MS);
+  l->check_ms = 0;
+  return !*l->stop && link_p5_alive(l);
+}
+
+// send() for the shared transports: a full message queue is waited out as
+// long as P5 is alive.
+size_t link_send_transport(producer_link *l, transport *t,
+                           const xport_msg *msgs, size_t n) {
+  size_t sent = 0;
+  while (sent < n) {
+    sent += transport_send_batch(t, msgs + sent, n - sent);
+    if (sent < n &&
+        (errno != EAGAIN || !link_wait_writable(l, transport_fd(t))))
+      break;
+  }
+  return sent;
+}
+
+// send() for the shared-memory rings: yields while the ring is full, as
+// long as P5 is alive.
+size_t link_send_ring(producer_link *l, shm_ring_producer *ring,
+                      const xport_msg *msgs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    shm_ring_slot *slot;
+    int spins = 0;
+    while ((slot = shm_ring_reserve(ring)) == NULL) {
+      if (*l->stop || !link_p5_alive(l))
+        return i;
+      if (++spins < 100)
+        sched_yield();
+      else
+        usleep(100);
+    }
+    memcpy(slot, &msgs[i], xport_msg_size(&msgs[i]));
+    shm_ring_commit(ring);
+  }
+  return n;
+}
+
+// Takes back what P5 never consumed from a ring it left behind, to be
+// replayed first: it is older than anything buffered.
+void link_reclaim_ring(producer_link *l, shm_ring_producer *ring) {
+  shm_ring *r = ring->ring;
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  for (; tail != head; tail--)
+    if (!spill_unshift(&l->spill, &r->slots[(tail - 1) & (SHM_RING_SLOTS - 1)]))
+      break;
+  if (tail != head)
+    printf("[%s - PID: %d] %llu values left in P5's ring are lost\n", l->who,
+           l->pid, (unsigned long long)(tail - head));
+}
+
+void link_lost(producer_link *l) {
+  l->disconnect(1);
+  l->up = 0;
+  l->outages++;
+  l->backoff_ms = SPILL_BACKOFF_MIN_MS;
+  l->retry_ms = monotonic_ms() + l->backoff_ms;
+  printf("[%s - PID: %d] Lost P5; buffering values and reconnecting\n",
+         l->who, l->pid);
+  fflush(stdout);
+}
+
+// Sends everything buffered, unless the channel fails.
+void link_flush(producer_link *l) {
+  while (l->up && spill_count(&l->spill) > 0) {
+    if (!link_p5_alive(l)) {
+      link_lost(l);
+      break;
+    }
+    size_t n;
+    const xport_msg *run = spill_front(&l->spill, l->batch, &n);
+    size_t sent = l->send(run, n);
+    spill_pop(&l->spill, sent);
+    if (sent < n) {
+      if (!*l->stop)
+        link_lost(l);
+      break;
+    }
+  }
+  l->first_ms = monotonic_ms();
+}
+
+void link_connect(producer_link *l) {
+  pid_t p5 = link_find_p5();
+  if (p5 >= 0 && l->connect()) {
+    l->up = 1;
+    l->p5_pid = p5;
+    l->check_ms = monotonic_ms() + SPILL_CHECK_MS;
+    if (l->connected)
+      l->connected();
+    if (spill_count(&l->spill) > 0) {
+      printf("[%s - PID: %d] Connected to P5; replaying %zu buffered "
+             "values\n",
+             l->who, l->pid, spill_count(&l->spill));
+      fflush(stdout);
+    }
+    link_flush(l);
+    return;
+  }
+  l->retry_ms = monotonic_ms() + l->backoff_ms;
+  l->backoff_ms *= 2;
+  if (l->backoff_ms > SPILL_BACKOFF_MAX_MS)
+    l->backoff_ms = SPILL_BACKOFF_MAX_MS;
+}
+
+// Connects for the first time. A P5 that is not running yet is not an
+// error: values are buffered until it is. Returns 0 only if the spill
+// buffer cannot be allocated.
+int link_start(producer_link *l) {
+  if (!spill_init(&l->spill))
+    return 0;
+  l->backoff_ms = SPILL_BACKOFF_MIN_MS;
+  link_connect(l);
+  if (!l->up) {
+    printf("[%s - PID: %d] P5 not available; buffering values until it "
+           "is\n",
+           l->who, l->pid);
+    fflush(stdout);
+  }
+  return 1;
+}
+
+// Milliseconds until link_poll() has work, -1 if none.
+int link_due_in(const producer_link *l) {
+  long long due;
+  if (!l->up)
+    due = l->retry_ms;
+  else if (spill_count(&l->spill) > 0)
+    due = l->first_ms + l->flush_ms;
+  else
+    return -1;
+  due -= monotonic_ms();
+  return due > 0 ? (int)due : 0;
+}
+
+// The shorter of timeout_ms (-1 = none) and link_due_in().
+int link_timeout(const producer_link *l, int timeout_ms) {
+  int due = link_due_in(l);
+  return due >= 0 && (timeout_ms < 0 || due < timeout_ms) ? due : timeout_ms;
+}
+
+// Reconnects or sends a partial batch when due.
+void link_poll(producer_link *l) {
+  if (link_due_in(l) != 0)
+    return;
+  if (l->up)
+    link_flush(l);
+  else
+    link_connect(l);
+}
+
+// Queues one record and sends what is due. Waits only while the spill
+// buffer is full. Returns 0 if the producer is terminating.
+int link_send(producer_link *l, const xport_msg *m) {
+  while (!spill_push(&l->spill, m)) {
+    if (*l->stop)
+      return 0;
+    producer_wait(0, -1, link_due_in(l));
+    link_poll(l);
+  }
+  size_t count = spill_count(&l->spill);
+  if (count == 1)
+    l->first_ms = monotonic_ms();
+  if (!l->up) {
+    if (count > l->peak)
+      l->peak = count;
+    link_poll(l);
+  } else if (count >= l->batch || l->flush_ms == 0) {
+    link_flush(l);
+  }
+  return 1;
+}
+
+// Sends what is still buffered, waiting up to SPILL_DRAIN_MS for P5 if it
+// is away, then disconnects and reports the outages.
+void link_finish(producer_link *l) {
+  long long deadline = monotonic_ms() + SPILL_DRAIN_MS;
+  link_flush(l);
+  while (spill_count(&l->spill) > 0 && !*l->stop) {
+    long long left = deadline - monotonic_ms();
+    if (left <= 0)
+      break;
+    producer_wait(0, -1, link_timeout(l, (int)left));
+    link_poll(l);
+  }
+  if (spill_count(&l->spill) > 0)
+    printf("[%s - PID: %d] P5 not available; %zu buffered values not "
+           "sent\n",
+           l->who, l->pid, spill_count(&l->spill));
+  if (l->outages > 0)
+    printf("[%s - PID: %d] P5 went away %llu times; at most %zu values "
+           "were buffered\n",
+           l->who, l->pid, (unsigned long long)l->outages, l->peak);
+  fflush(stdout);
+  if (l->up)
+    l->disconnect(0);
+  l->up = 0;
+  spill_free(&l->spill);
+}
+
+#endif // SPILL_H
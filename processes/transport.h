@@ -0,0 +1,371 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "common.h"
+#include "shm_ring.h"
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// --- Transports ---
+// Besides its own channel, every producer can reach P5 over any of these
+// backends (--via <name>), so transports can be compared by throughput and
+// latency under the same load. All of them carry the same records: a
+// shm_ring_slot up to the end of its value, packed back to back. Byte
+// streams (FIFO, UNIX stream) are reassembled as P4's frames are; packet
+// backends (message queue, UNIX seqpacket) carry a whole batch per packet.
+// A backend only provides the operations in transport_ops; batching,
+// framing and parsing are shared.
+#define XPORT_FIFO_PATH "./p5_xport_fifo"
+#define XPORT_MQ_NAME "/p5_xport_mq"
+#define XPORT_STREAM_PATH "./p5_xport_stream"
+#define XPORT_SEQPACKET_PATH "./p5_xport_seqpacket"
+#define XPORT_PACKET_SIZE 4096  // Largest batch per queue message or packet
+#define XPORT_STREAM_UNIT 16384 // Largest batch per write on a UNIX stream
+#define XPORT_RX_SIZE 65536
+#define XPORT_BATCH 64   // Messages a producer buffers before sending
+#define XPORT_FLUSH_MS 2 // As FIFO_FLUSH_MS
+
+enum { XPORT_FIFO, XPORT_MQ, XPORT_STREAM, XPORT_SEQPACKET, XPORT_KINDS };
+
+typedef shm_ring_slot xport_msg;
+
+typedef struct transport transport;
+
+typedef struct {
+  const char *name;
+  size_t unit;     // Largest write that keeps records whole
+  int byte_stream; // Records may be split across reads
+  // Producers connect, P5 (server) creates the endpoint. Return 0 with
+  // errno set on failure.
+  int (*open)(transport *t, int server);
+  // Listening endpoints only: the next connection's descriptor, or -1 with
+  // errno set (EAGAIN once none is pending).
+  int (*accept)(transport *t);
+  ssize_t (*send)(transport *t, const void *buf, size_t len);
+  ssize_t (*recv)(transport *t, void *buf, size_t len);
+  void (*close)(transport *t);
+} transport_ops;
+
+struct transport {
+  const transport_ops *ops; // NULL = not open
+  int kind;                 // XPORT_*
+  int fd;                   // Pollable; the mqd_t for the message queue
+  int server;               // P5's endpoint, removed again on close
+  int listening;            // Hands out connections instead of records
+  unsigned char *rx;        // Received bytes not parsed yet
+  size_t rx_off, rx_len;
+  uint64_t rx_reads, rx_bytes; // For the mean packet size
+};
+
+// Bytes a message takes on the wire.
+size_t xport_msg_size(const xport_msg *m) {
+  size_t len = m->len > SOCK_MSG_MAX_LEN ? SOCK_MSG_MAX_LEN : m->len;
+  return offsetof(xport_msg, value) +
+         (m->channel == SHM_CH_P4 ? len : sizeof(double));
+}
+
+// --- FIFO ---
+
+int xport_fifo_open(transport *t, int server) {
+  if (!server) {
+    signal(SIGPIPE, SIG_IGN); // Report EPIPE from write() instead
+    // Non-blocking, so that without P5 the open fails (ENXIO) instead of
+    // waiting; writes block as usual
+    t->fd = open(XPORT_FIFO_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    return t->fd >= 0 && fcntl(t->fd, F_SETFL, 0) == 0;
+  }
+  if (mkfifo(XPORT_FIFO_PATH, FIFO_PERMS) < 0 && errno != EEXIST)
+    return 0;
+  // O_RDWR: as FIFO P2, no EOF however often the producers come and go
+  t->fd = open(XPORT_FIFO_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  return t->fd >= 0;
+}
+
+ssize_t xport_fd_send(transport *t, const void *buf, size_t len) {
+  return write(t->fd, buf, len);
+}
+
+ssize_t xport_fd_recv(transport *t, void *buf, size_t len) {
+  return read(t->fd, buf, len);
+}
+
+void xport_fifo_close(transport *t) {
+  close(t->fd);
+  if (t->server)
+    unlink(XPORT_FIFO_PATH);
+}
+
+// --- Message queue ---
+
+int xport_mq_open(transport *t, int server) {
+  mqd_t q;
+  if (server) {
+    // Sized for whole batches; the depth any user may ask for
+    struct mq_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.mq_maxmsg = mq_proc_limit("msg_max", 10);
+    attr.mq_msgsize = XPORT_PACKET_SIZE;
+    mq_unlink(XPORT_MQ_NAME); // A leftover queue may have another geometry
+    q = mq_open(XPORT_MQ_NAME, O_RDONLY | O_CREAT | O_NONBLOCK | O_CLOEXEC,
+                MSGQ_PERMS, &attr);
+  } else {
+    // Non-blocking: a queue outlives its P5, so a full queue is waited out
+    // by the producer, which can tell whether P5 is still there
+    q = mq_open(XPORT_MQ_NAME, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  }
+  t->fd = q;
+  return q != (mqd_t)-1;
+}
+
+ssize_t xport_mq_send(transport *t, const void *buf, size_t len) {
+  return mq_send(t->fd, buf, len, 0) == 0 ? (ssize_t)len : -1;
+}
+
+ssize_t xport_mq_recv(transport *t, void *buf, size_t len) {
+  return mq_receive(t->fd, buf, len, NULL);
+}
+
+void xport_mq_close(transport *t) {
+  mq_close(t->fd);
+  if (t->server)
+    mq_unlink(XPORT_MQ_NAME);
+}
+
+// --- UNIX sockets ---
+
+const char *xport_socket_path(const transport *t) {
+  return t->kind == XPORT_STREAM ? XPORT_STREAM_PATH : XPORT_SEQPACKET_PATH;
+}
+
+int xport_socket_open(transport *t, int server) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, xport_socket_path(t), sizeof(addr.sun_path) - 1);
+  int type = t->kind == XPORT_STREAM ? SOCK_STREAM : SOCK_SEQPACKET;
+  t->fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if (t->fd < 0)
+    return 0;
+
+  int ok;
+  if (server) {
+    unlink(addr.sun_path);
+    ok = bind(t->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+         listen(t->fd, SOMAXCONN) == 0 &&
+         fcntl(t->fd, F_SETFL, O_NONBLOCK) == 0;
+    t->listening = ok;
+  } else {
+    ok = connect(t->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+  if (!ok) {
+    int err = errno;
+    close(t->fd);
+    errno = err;
+  }
+  return ok;
+}
+
+int xport_socket_accept(transport *t) {
+  int fd = accept(t->fd, NULL, NULL);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+ssize_t xport_socket_send(transport *t, const void *buf, size_t len) {
+  return send(t->fd, buf, len, MSG_NOSIGNAL);
+}
+
+ssize_t xport_socket_recv(transport *t, void *buf, size_t len) {
+  return recv(t->fd, buf, len, 0);
+}
+
+void xport_socket_close(transport *t) {
+  close(t->fd);
+  if (t->server && t->listening)
+    unlink(xport_socket_path(t));
+}
+
+const transport_ops xport_backends[XPORT_KINDS] = {
+    {"fifo", PIPE_BUF, 1, xport_fifo_open, NULL, xport_fd_send,
+     xport_fd_recv, xport_fifo_close},
+    {"mq", XPORT_PACKET_SIZE, 0, xport_mq_open, NULL, xport_mq_send,
+     xport_mq_recv, xport_mq_close},
+    {"stream", XPORT_STREAM_UNIT, 1, xport_socket_open, xport_socket_accept,
+     xport_socket_send, xport_socket_recv, xport_socket_close},
+    {"seqpacket", XPORT_PACKET_SIZE, 0, xport_socket_open,
+     xport_socket_accept, xport_socket_send, xport_socket_recv,
+     xport_socket_close},
+};
+
+// --- Uniform API ---
+
+// Returns the XPORT_* backend of that name, or -1.
+int transport_parse(const char *name) {
+  for (int k = 0; k < XPORT_KINDS; k++)
+    if (strcmp(name, xport_backends[k].name) == 0)
+      return k;
+  return -1;
+}
+
+// Returns 0 with errno set on failure.
+int transport_open(transport *t, int kind, int server) {
+  memset(t, 0, sizeof(*t));
+  t->kind = kind;
+  t->server = server;
+  t->fd = -1;
+  if (!xport_backends[kind].open(t, server))
+    return 0;
+  t->ops = &xport_backends[kind];
+  return 1;
+}
+
+// Takes the next pending connection of a listening endpoint. Returns 0 with
+// errno set (EAGAIN) once there is none.
+int transport_accept(transport *listener, transport *conn) {
+  int fd = listener->ops->accept(listener);
+  if (fd < 0)
+    return 0;
+  memset(conn, 0, sizeof(*conn));
+  conn->ops = listener->ops;
+  conn->kind = listener->kind;
+  conn->fd = fd;
+  return 1;
+}
+
+int transport_fd(const transport *t) { return t->fd; }
+
+// Bytes received or waiting in the kernel and not parsed yet. A message
+// queue reports whole packets only, so those count at the mean packet size
+// received so far.
+uint64_t transport_waiting(const transport *t) {
+  uint64_t bytes = t->rx_len - t->rx_off;
+  if (t->kind == XPORT_MQ) {
+    struct mq_attr attr;
+    if (t->rx_reads > 0 && mq_getattr((mqd_t)t->fd, &attr) == 0)
+      bytes += attr.mq_curmsgs * (t->rx_bytes / t->rx_reads);
+  } else {
+    int n = 0;
+    if (ioctl(t->fd, FIONREAD, &n) == 0 && n > 0)
+      bytes += n;
+  }
+  return bytes;
+}
+
+void transport_close(transport *t) {
+  if (!t->ops)
+    return;
+  t->ops->close(t);
+  free(t->rx);
+  t->rx = NULL;
+  t->ops = NULL;
+  t->fd = -1;
+}
+
+// Writes one unit, resuming short writes on byte streams.
+int xport_send_unit(transport *t, const unsigned char *buf, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = t->ops->send(t, buf + sent, len - sent);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    sent += n;
+  }
+  return 1;
+}
+
+// Sends n messages in as few writes as the backend's unit allows. Returns
+// how many were sent; fewer than n, with errno set, if the transport
+// failed (EAGAIN: a message queue is full).
+size_t transport_send_batch(transport *t, const xport_msg *msgs, size_t n) {
+  unsigned char buf[XPORT_STREAM_UNIT];
+  size_t len = 0, sent = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t size = xport_msg_size(&msgs[i]);
+    if (len + size > t->ops->unit) {
+      if (!xport_send_unit(t, buf, len))
+        return sent;
+      sent = i;
+      len = 0;
+    }
+    memcpy(buf + len, &msgs[i], size);
+    len += size;
+  }
+  return len == 0 || xport_send_unit(t, buf, len) ? n : sent;
+}
+
+// Whether a whole record is buffered, so the next transport_recv_batch()
+// returns it without reading. Readers that stop after a bounded number of
+// batches must not leave such records behind: the descriptor is no longer
+// readable and nothing would wake them up for those.
+int transport_buffered(const transport *t) {
+  const size_t hdr = offsetof(xport_msg, value);
+  if (!t->rx || t->rx_len - t->rx_off < hdr)
+    return 0;
+  xport_msg m;
+  memcpy(&m, t->rx + t->rx_off, hdr);
+  return m.len > SOCK_MSG_MAX_LEN || // Reported as malformed
+         t->rx_len - t->rx_off >= xport_msg_size(&m);
+}
+
+// Receives up to max messages. Returns how many, 0 if nothing is ready, or
+// -1 once the peer is gone (errno 0) or on an error (EPROTO for a malformed
+// record, after which the buffered bytes are dropped).
+int transport_recv_batch(transport *t, xport_msg *out, int max) {
+  const size_t hdr = offsetof(xport_msg, value);
+  if (!t->rx && !(t->rx = malloc(XPORT_RX_SIZE)))
+    return -1;
+  int n = 0;
+  for (;;) {
+    while (n < max && t->rx_len - t->rx_off >= hdr) {
+      xport_msg *m = &out[n];
+      memcpy(m, t->rx + t->rx_off, hdr);
+      if (m->channel < SHM_CH_P2 || m->channel > SHM_CH_P4 ||
+          m->len > SOCK_MSG_MAX_LEN) {
+        t->rx_off = t->rx_len = 0;
+        errno = EPROTO;
+        return -1;
+      }
+      size_t size = xport_msg_size(m);
+      if (t->rx_len - t->rx_off < size)
+        break;
+      memcpy(&m->value, t->rx + t->rx_off + hdr, size - hdr);
+      t->rx_off += size;
+      n++;
+    }
+    if (n > 0)
+      return n;
+    if (!t->ops->byte_stream && t->rx_off < t->rx_len) {
+      t->rx_off = t->rx_len = 0; // A packet ended inside a record
+      errno = EPROTO;
+      return -1;
+    }
+
+    memmove(t->rx, t->rx + t->rx_off, t->rx_len - t->rx_off);
+    t->rx_len -= t->rx_off;
+    t->rx_off = 0;
+    ssize_t got = t->ops->recv(t, t->rx + t->rx_len, XPORT_RX_SIZE - t->rx_len);
+    if (got > 0) {
+      t->rx_len += got;
+      t->rx_reads++;
+      t->rx_bytes += got;
+      continue;
+    }
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (got == 0)
+      errno = 0;
+    return -1;
+  }
+}
+
+#endif // TRANSPORT_H
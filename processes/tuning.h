@@ -0,0 +1,255 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include "common.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// --- Low-latency tuning ---
+// Process 1 hands each child its tuning in TUNING_ENV, in the topology's
+// key=value syntax:
+//   cpus=<list>    pin to these CPUs, e.g. "2" or "0-3,6"
+//   rt=<1-99>      run SCHED_FIFO at this priority (threads inherit it)
+//   mlock=1        lock all memory once startup is done, so the hot path
+//                  takes no page faults
+//   hugepages=1    back the large buffers with huge pages: reserved ones
+//                  (MAP_HUGETLB) if there are any, else transparent ones
+// The process applies it to itself -- a memory lock does not survive exec
+// -- and carries on untuned where a setting is refused (no CAP_SYS_NICE, a
+// cpuset, RLIMIT_MEMLOCK, no huge pages). tuning_report() reads every
+// setting back and says what actually took effect.
+#define TUNING_ENV "P5_TUNING"
+#define TUNING_HUGE_PAGE (2UL << 20)
+
+typedef struct {
+  char cpus[64];   // "" = not pinned
+  int rt_priority; // 0 = normal scheduling
+  int mlock;
+  int hugepages;
+} launch_tuning;
+
+typedef struct {
+  launch_tuning want;
+  int cpus_err, rt_err; // errno of a refused setting, 0 = applied
+  int hugetlb_buffers, thp_buffers, plain_buffers;
+} tuning_state;
+
+tuning_state tuning; // This process's, from TUNING_ENV
+
+// Parses a CPU list such as "0-3,6". Returns 0 if it is malformed.
+int tuning_parse_cpus(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if (end == p)
+      return 0;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p)
+        return 0;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return 0;
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return 0;
+    p = end;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+// Sets one key=value tuning option. Returns 0 if the key is not a tuning
+// option or the value is invalid.
+int tuning_parse_key(launch_tuning *t, const char *key, const char *val) {
+  cpu_set_t set;
+  if (strcmp(key, "cpus") == 0) {
+    if (strlen(val) >= sizeof(t->cpus) || !tuning_parse_cpus(val, &set))
+      return 0;
+    snprintf(t->cpus, sizeof(t->cpus), "%s", val);
+  } else if (strcmp(key, "rt") == 0) {
+    t->rt_priority = atoi(val);
+    return t->rt_priority >= 0 && t->rt_priority <= 99;
+  } else if (strcmp(key, "mlock") == 0) {
+    t->mlock = atoi(val) != 0;
+  } else if (strcmp(key, "hugepages") == 0) {
+    t->hugepages = atoi(val) != 0;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int tuning_enabled(const launch_tuning *t) {
+  return t->cpus[0] || t->rt_priority || t->mlock || t->hugepages;
+}
+
+// Formats the tuning for TUNING_ENV; "" if there is none. size must hold
+// every option (128 bytes do).
+void tuning_format(const launch_tuning *t, char *buf, size_t size) {
+  int n = 0;
+  buf[0] = '\0';
+  if (t->cpus[0])
+    n += snprintf(buf + n, size - n, "cpus=%s ", t->cpus);
+  if (t->rt_priority)
+    n += snprintf(buf + n, size - n, "rt=%d ", t->rt_priority);
+  if (t->mlock)
+    n += snprintf(buf + n, size - n, "mlock=1 ");
+  if (t->hugepages)
+    n += snprintf(buf + n, size - n, "hugepages=1 ");
+  if (n > 0)
+    buf[n - 1] = '\0';
+}
+
+// Reads TUNING_ENV and applies affinity and scheduling. Call first thing,
+// before any thread starts, so that every thread inherits them.
+void tuning_apply() {
+  const char *env = getenv(TUNING_ENV);
+  if (!env)
+    return;
+  char text[256], *save = NULL;
+  snprintf(text, sizeof(text), "%s", env);
+  for (char *tok = strtok_r(text, " ", &save); tok;
+       tok = strtok_r(NULL, " ", &save)) {
+    char *val = strchr(tok, '=');
+    if (val) {
+      *val++ = '\0';
+      tuning_parse_key(&tuning.want, tok, val);
+    }
+  }
+
+  cpu_set_t set;
+  if (tuning.want.cpus[0] && tuning_parse_cpus(tuning.want.cpus, &set) &&
+      sched_setaffinity(0, sizeof(set), &set) < 0)
+    tuning.cpus_err = errno;
+  if (tuning.want.rt_priority > 0) {
+    struct sched_param param = {.sched_priority = tuning.want.rt_priority};
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+      tuning.rt_err = errno;
+  }
+}
+
+size_t tuning_huge_size(size_t size) {
+  return (size + TUNING_HUGE_PAGE - 1) & ~(TUNING_HUGE_PAGE - 1);
+}
+
+// Allocates a zeroed buffer, huge-page backed if the tuning asks for it.
+// Release it with tuning_free() and the same size.
+void *tuning_alloc(size_t size) {
+  if (!tuning.want.hugepages)
+    return calloc(1, size);
+  size_t len = tuning_huge_size(size);
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    tuning.hugetlb_buffers++;
+    return p;
+  }
+  p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  if (madvise(p, len, MADV_HUGEPAGE) == 0)
+    tuning.thp_buffers++;
+  else
+    tuning.plain_buffers++;
+  return p;
+}
+
+void tuning_free(void *p, size_t size) {
+  if (!p)
+    return;
+  if (tuning.want.hugepages)
+    munmap(p, tuning_huge_size(size));
+  else
+    free(p);
+}
+
+// A "<field>: <n> kB" line of a /proc/self file, -1 if it is not there.
+long tuning_proc_kb(const char *path, const char *field) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  char line[256];
+  long kb = -1;
+  size_t len = strlen(field);
+  while (fgets(line, sizeof(line), f))
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      kb = atol(line + len + 1);
+      break;
+    }
+  fclose(f);
+  return kb;
+}
+
+// Locks memory if asked to (once the startup allocations are done), then
+// reports what took effect. Call just before reporting ready.
+void tuning_report(const char *who, pid_t pid) {
+  const launch_tuning *t = &tuning.want;
+  if (!tuning_enabled(t))
+    return;
+  printf("[%s - PID: %d] Tuning:", who, pid);
+  const char *sep = " ";
+
+  if (t->cpus[0]) {
+    cpu_set_t want, got;
+    tuning_parse_cpus(t->cpus, &want);
+    if (tuning.cpus_err)
+      printf("%scpus=%s failed (%s)", sep, t->cpus, strerror(tuning.cpus_err));
+    else if (sched_getaffinity(0, sizeof(got), &got) == 0 &&
+             CPU_EQUAL(&want, &got))
+      printf("%scpus=%s ok", sep, t->cpus);
+    else
+      printf("%scpus=%s partly (%d of %d CPUs allowed)", sep, t->cpus,
+             CPU_COUNT(&got), CPU_COUNT(&want));
+    sep = "; ";
+  }
+
+  if (t->rt_priority > 0) {
+    struct sched_param param;
+    if (tuning.rt_err)
+      printf("%sSCHED_FIFO %d failed (%s)", sep, t->rt_priority,
+             strerror(tuning.rt_err));
+    else if (sched_getscheduler(0) == SCHED_FIFO &&
+             sched_getparam(0, &param) == 0 &&
+             param.sched_priority == t->rt_priority)
+      printf("%sSCHED_FIFO %d ok", sep, t->rt_priority);
+    else
+      printf("%sSCHED_FIFO %d not in effect", sep, t->rt_priority);
+    sep = "; ";
+  }
+
+  if (t->mlock) {
+    // Up to the hard limit; beyond it mlockall() needs CAP_IPC_LOCK
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_MEMLOCK, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+      lim.rlim_cur = lim.rlim_max;
+      setrlimit(RLIMIT_MEMLOCK, &lim);
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+      printf("%smlockall failed (%s)", sep, strerror(errno));
+    else
+      printf("%smlockall ok (%ld kB locked)", sep,
+             tuning_proc_kb("/proc/self/status", "VmLck"));
+    sep = "; ";
+  }
+
+  if (t->hugepages) {
+    int buffers =
+        tuning.hugetlb_buffers + tuning.thp_buffers + tuning.plain_buffers;
+    printf("%shugepages: %d of %d buffers reserved, %d transparent (%ld kB "
+           "backed)",
+           sep, tuning.hugetlb_buffers, buffers, tuning.thp_buffers,
+           tuning_proc_kb("/proc/self/smaps_rollup", "AnonHugePages"));
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+#endif // TUNING_H
@@ -0,0 +1,314 @@
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+#include "tuning.h"
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// --- Minimal io_uring ---
+// Just enough of the io_uring interface for P5's event loop, on raw system
+// calls so there is no dependency on liburing. One thread owns a ring:
+// SQEs are queued with uring_get_sqe() and submitted together by the next
+// uring_submit_and_wait(), and CQEs are consumed in place.
+typedef struct {
+  int fd;
+  unsigned features;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // SQEs handed out but not yet published
+
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+} uring;
+
+// Buffers the kernel picks from for multishot receives (IORING_OP_RECV
+// with IOSQE_BUFFER_SELECT); completions name the buffer they filled.
+typedef struct {
+  struct io_uring_buf_ring *ring;
+  size_t ring_size;
+  char *data;
+  unsigned entries; // Power of two
+  unsigned buf_size;
+  uint16_t group;
+} uring_buf_ring;
+
+// Returns 0 with errno set if io_uring is unavailable (old kernel, seccomp,
+// kernel.io_uring_disabled) or lacks a feature P5 relies on.
+int uring_init(uring *r, unsigned entries, unsigned cq_entries) {
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+  r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return 0;
+  r->features = p.features;
+  // Timed waits need EXT_ARG (5.11); NODROP keeps overflowing CQEs
+  if (!(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(r->fd);
+    errno = ENOSYS;
+    return 0;
+  }
+
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (r->cq_size > r->sq_size)
+    r->sq_size = r->cq_size;
+  r->cq_size = r->sq_size; // One mapping holds both rings
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    close(r->fd);
+    return 0;
+  }
+  r->cq_ptr = r->sq_ptr;
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    return 0;
+  }
+
+  char *sq = r->sq_ptr, *cq = r->cq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->sq_local_tail = *r->sq_tail;
+  return 1;
+}
+
+void uring_free(uring *r) {
+  if (!r->sqes)
+    return;
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->sq_ptr, r->sq_size);
+  close(r->fd);
+  r->sqes = NULL;
+}
+
+int uring_enter(uring *r, unsigned to_submit, unsigned min_complete,
+                unsigned flags, void *arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                      flags, arg, arg_size);
+}
+
+int uring_register(uring *r, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args);
+}
+
+// Publishes the queued SQEs to the kernel. Returns how many there are.
+unsigned uring_flush(uring *r) {
+  unsigned tail = *r->sq_tail;
+  unsigned n = r->sq_local_tail - tail;
+  for (unsigned i = 0; i < n; i++, tail++)
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+  atomic_store_explicit((_Atomic unsigned *)r->sq_tail, tail,
+                        memory_order_release);
+  return n;
+}
+
+// Submits the queued SQEs and waits until at least wait_nr completions are
+// ready or timeout_ms passes (< 0 = no timeout). Returns -1 with errno set
+// on failure; ETIME and EINTR are the expected ones.
+int uring_submit_and_wait(uring *r, unsigned wait_nr, int timeout_ms) {
+  unsigned to_submit = uring_flush(r);
+  struct __kernel_timespec ts = {timeout_ms / 1000,
+                                 (timeout_ms % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0)
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (wait_nr)
+    flags |= IORING_ENTER_GETEVENTS;
+  return uring_enter(r, to_submit, wait_nr, flags, &arg, sizeof(arg));
+}
+
+// Returns a zeroed SQE, submitting the queued ones first if the ring is
+// full. NULL only if even that fails.
+struct io_uring_sqe *uring_get_sqe(uring *r) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)r->sq_head,
+                                       memory_order_acquire);
+  if (r->sq_local_tail - head > *r->sq_mask) {
+    if (uring_submit_and_wait(r, 0, -1) < 0)
+      return NULL;
+    head = atomic_load_explicit((_Atomic unsigned *)r->sq_head,
+                                memory_order_acquire);
+    if (r->sq_local_tail - head > *r->sq_mask)
+      return NULL;
+  }
+  struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail++ & *r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// Hands every ready CQE to handle() and releases them. Returns the count.
+int uring_consume(uring *r, void (*handle)(struct io_uring_cqe *)) {
+  unsigned head = *r->cq_head;
+  unsigned tail = atomic_load_explicit((_Atomic unsigned *)r->cq_tail,
+                                       memory_order_acquire);
+  int n = 0;
+  for (; head != tail; head++, n++)
+    handle(&r->cqes[head & *r->cq_mask]);
+  atomic_store_explicit((_Atomic unsigned *)r->cq_head, head,
+                        memory_order_release);
+  return n;
+}
+
+// --- Requests ---
+
+struct io_uring_sqe *uring_prep(uring *r, int opcode, int fd,
+                                uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+  if (sqe) {
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+  }
+  return sqe;
+}
+
+// One CQE per accepted connection until the request is cancelled or fails.
+int uring_accept_multishot(uring *r, int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_ACCEPT, fd, user_data);
+  if (!sqe)
+    return 0;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  return 1;
+}
+
+// One CQE per chunk received into a buffer of the given group.
+int uring_recv_multishot(uring *r, int fd, uint16_t group,
+                         uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_RECV, fd, user_data);
+  if (!sqe)
+    return 0;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = group;
+  return 1;
+}
+
+// Reads into a buffer registered with uring_register_buffers().
+int uring_read_fixed(uring *r, int fd, void *buf, unsigned len,
+                     uint16_t buf_index, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_READ_FIXED, fd, user_data);
+  if (!sqe)
+    return 0;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1; // Current position; pipes have none
+  sqe->buf_index = buf_index;
+  return 1;
+}
+
+// One CQE every time fd becomes readable, for descriptors io_uring cannot
+// read itself (message queues, or when the reader is a library call).
+int uring_poll_multishot(uring *r, int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_POLL_ADD, fd, user_data);
+  if (!sqe)
+    return 0;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  return 1;
+}
+
+// One CQE the next time fd is readable; re-armed by the caller, so nothing
+// stays outstanding once fd is closed.
+int uring_poll_once(uring *r, int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_POLL_ADD, fd, user_data);
+  if (!sqe)
+    return 0;
+  sqe->poll32_events = POLLIN;
+  return 1;
+}
+
+int uring_register_buffers(uring *r, struct iovec *iov, unsigned n) {
+  return uring_register(r, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+// --- Provided buffer rings (5.19+) ---
+
+int uring_buf_ring_setup(uring *r, uring_buf_ring *br, uint16_t group,
+                         unsigned entries, unsigned buf_size) {
+  memset(br, 0, sizeof(*br));
+  br->entries = entries;
+  br->buf_size = buf_size;
+  br->group = group;
+  br->ring_size = entries * sizeof(struct io_uring_buf);
+  br->ring = mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br->ring == MAP_FAILED) {
+    br->ring = NULL;
+    return 0;
+  }
+  br->data = tuning_alloc((size_t)entries * buf_size);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  if (!br->data || uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    tuning_free(br->data, (size_t)br->entries * br->buf_size);
+    munmap(br->ring, br->ring_size);
+    br->ring = NULL;
+    return 0;
+  }
+  for (unsigned i = 0; i < entries; i++) {
+    struct io_uring_buf *buf = &br->ring->bufs[i];
+    buf->addr = (uint64_t)(uintptr_t)(br->data + (size_t)i * buf_size);
+    buf->len = buf_size;
+    buf->bid = i;
+  }
+  atomic_store_explicit((_Atomic uint16_t *)&br->ring->tail, entries,
+                        memory_order_release);
+  return 1;
+}
+
+char *uring_buf(uring_buf_ring *br, uint16_t bid) {
+  return br->data + (size_t)bid * br->buf_size;
+}
+
+// Gives a buffer back to the kernel once its data has been handled.
+void uring_buf_recycle(uring_buf_ring *br, uint16_t bid) {
+  uint16_t tail = br->ring->tail;
+  struct io_uring_buf *buf = &br->ring->bufs[tail & (br->entries - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+  buf->len = br->buf_size;
+  buf->bid = bid;
+  atomic_store_explicit((_Atomic uint16_t *)&br->ring->tail, tail + 1,
+                        memory_order_release);
+}
+
+void uring_buf_ring_free(uring *r, uring_buf_ring *br) {
+  if (!br->ring)
+    return;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = br->group;
+  uring_register(r, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(br->ring, br->ring_size);
+  tuning_free(br->data, (size_t)br->entries * br->buf_size);
+  br->ring = NULL;
+}
+
+#endif // URING_H